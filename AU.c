@@ -1,284 +1,2315 @@
+// For mkstemp, ftruncate, etc., under -std=c99.
+#define _POSIX_C_SOURCE 200809L
+
 #include <string.h>
 #include <stdint.h>
 #include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 
 #include "AU.h"
+#include "AUChecksum.h"
 #include "XMalloc.h"
 
 #define ISSUE_ERROR(err) xerror(err, # err)
 
+////////////////////////
+//// Tracing Probes ////
+////////////////////////
+
+/*
+ * USDT static tracepoints, for perf/bpftrace/systemtap. They're only compiled
+ * in when AU_USDT is defined at build time (make USDT=1), which requires
+ * <sys/sdt.h>. Each probe is a single nop in the instruction stream until a
+ * tracer attaches to it, and its arguments are only read by the tracer.
+ *
+ * Without AU_USDT, the probes expand to nothing at all.
+ */
+
+#ifdef AU_USDT
+
+#include <sys/sdt.h>
+
+#define AU_PROBE2(name, a, b) DTRACE_PROBE2(AU, name, a, b)
+#define AU_PROBE3(name, a, b, c) DTRACE_PROBE3(AU, name, a, b, c)
+#define AU_PROBE4(name, a, b, c, d) DTRACE_PROBE4(AU, name, a, b, c, d)
+
+#else
+
+#define AU_PROBE2(name, a, b) ((void)0)
+#define AU_PROBE3(name, a, b, c) ((void)0)
+#define AU_PROBE4(name, a, b, c, d) ((void)0)
+
+#endif
+
 /////////////////////////
 //// Alignment Utils ////
 /////////////////////////
 
-union AlignmentType {
-  int i;
-  long l;
-  long long ll;
-  void *vp;
-  void (*funp)(void);
-  float f;
-  double d;
-  long double ld;
-  float *fp;
-  double *dp;
-  long double *ldp;
+enum {
+  ALIGNMENT_BOUNDARY = sizeof (union AU_AlignmentType),
+};
+
+static inline size_t
+AlignSize(size_t n, size_t boundary) {
+  assert(boundary > 1);
+  assert(n <= SIZE_MAX - boundary + 1);
+  assert(n > 0);
+  return ((n - 1) + boundary)/boundary * boundary;
+}
+
+// The union has a void* in it, so this is the same as AU_FSA_NODE_HEADER.
+#define PTR_SIZE_ALIGN AlignSize(sizeof (void*), ALIGNMENT_BOUNDARY)
+
+static inline size_t
+maxsz(size_t a, size_t b) {
+  return a < b ? b : a;
+}
+
+// Largest k with 2^k <= n.
+static inline unsigned
+FloorLog2(size_t n) {
+  assert(n > 0);
+#if defined(__GNUC__)
+  return (unsigned)(sizeof (unsigned long long) * CHAR_BIT - 1)
+         - (unsigned)__builtin_clzll(n);
+#else
+  unsigned k = 0;
+  while (n >>= 1) {
+    k++;
+  }
+  return k;
+#endif
+}
+
+// Smallest k with n <= 2^k.
+static inline unsigned
+CeilLog2(size_t n) {
+  assert(n > 0);
+  return n == 1 ? 0 : FloorLog2(n - 1) + 1;
+}
+
+/*
+ * Thread local storage. C99 doesn't have it, but GCC and Clang do. Define
+ * AU_THREAD_LOCAL at build time for other compilers (e.g. to _Thread_local).
+ */
+#ifndef AU_THREAD_LOCAL
+#define AU_THREAD_LOCAL __thread
+#endif
+
+////////////////
+//// Budget ////
+////////////////
+
+enum {
+  // Instances take credit from their budget in chunks of 1/64 of the limit,
+  // but never more than 64 KiB at once, so credit sitting unused in
+  // instances can't starve the others much.
+  BUDGET_CREDIT_FRACTION = 64,
+  BUDGET_MAX_CREDIT_CHUNK = 64*1024
+};
+
+int
+AU_BDG_Setup(AU_Budget *bdg,
+             size_t limit,
+             AU_PressureFn pressure,
+             void *ctx) {
+  assert(bdg);
+
+  bdg->limit = limit;
+  bdg->used = 0;
+  bdg->credit_chunk = limit/BUDGET_CREDIT_FRACTION < BUDGET_MAX_CREDIT_CHUNK
+                      ? limit/BUDGET_CREDIT_FRACTION
+                      : BUDGET_MAX_CREDIT_CHUNK;
+  bdg->pressure = pressure;
+  bdg->ctx = ctx;
+  return 0;
+}
+
+/*
+ * Takes n bytes from the budget if they're available, without calling the
+ * pressure callback. Returns non zero on success.
+ */
+static int
+AU_BDG_TryCharge(AU_Budget *bdg, size_t n) {
+  size_t used = __atomic_load_n(&bdg->used, __ATOMIC_RELAXED);
+  do {
+    assert(used <= bdg->limit);
+    if (n > bdg->limit - used) {
+      return 0;
+    }
+  } while (!__atomic_compare_exchange_n(&bdg->used, &used, used + n, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return 1;
+}
+
+int
+AU_BDG_Charge(AU_Budget *bdg, size_t n) {
+  assert(bdg);
+
+  while (!AU_BDG_TryCharge(bdg, n)) {
+    if (!bdg->pressure || !bdg->pressure(bdg, n, bdg->ctx)) {
+      ISSUE_ERROR(AU_ERR_BUDGET);
+      return AU_ERR_BUDGET;
+    }
+  }
+  return 0;
+}
+
+void
+AU_BDG_Return(AU_Budget *bdg, size_t n) {
+  assert(bdg);
+  assert(AU_BDG_GetUsed(bdg) >= n);
+
+  __atomic_sub_fetch(&bdg->used, n, __ATOMIC_RELAXED);
+}
+
+size_t
+AU_BDG_GetUsed(AU_Budget *bdg) {
+  assert(bdg);
+
+  return __atomic_load_n(&bdg->used, __ATOMIC_RELAXED);
+}
+
+/*
+ * Budget links are how instances are attached to budgets. An instance owns
+ * its link, and instances aren't shared among threads, so the credit in a
+ * link is effectively per thread and needs no atomics. Only refilling it
+ * touches the budget.
+ */
+
+static inline void
+AU_BL_Init(struct AU_BudgetLink *bl) {
+  bl->bdg = 0;
+  bl->charged = 0;
+  bl->credit = 0;
+}
+
+static int
+AU_BL_Attach(struct AU_BudgetLink *bl, AU_Budget *bdg, size_t held) {
+  assert(bdg);
+  assert(!bl->bdg);
+
+  int res = AU_BDG_Charge(bdg, held);
+  if (res < 0) {
+    return res;
+  }
+  bl->bdg = bdg;
+  bl->charged = held;
+  bl->credit = 0;
+  return 0;
+}
+
+static void
+AU_BL_Release(struct AU_BudgetLink *bl) {
+  if (bl->bdg) {
+    AU_BDG_Return(bl->bdg, bl->charged);
+  }
+  AU_BL_Init(bl);
+}
+
+/*
+ * Pays for n more bytes of memory, from the credit if possible. Otherwise
+ * the credit is refilled with what's missing plus a chunk, or at least with
+ * what's missing, only then involving the pressure callback.
+ */
+static int
+AU_BL_Charge(struct AU_BudgetLink *bl, size_t n) {
+  if (!bl->bdg) {
+    return 0;
+  }
+  if (bl->credit >= n) {
+    bl->credit -= n;
+    return 0;
+  }
+
+  size_t missing = n - bl->credit;
+  size_t chunk = bl->bdg->credit_chunk;
+  if (missing <= SIZE_MAX - chunk
+      && AU_BDG_TryCharge(bl->bdg, missing + chunk)) {
+    bl->charged += missing + chunk;
+    bl->credit = chunk;
+    return 0;
+  }
+  int res = AU_BDG_Charge(bl->bdg, missing);
+  if (res < 0) {
+    return res;
+  }
+  bl->charged += missing;
+  bl->credit = 0;
+  return 0;
+}
+
+/*
+ * Like AU_BL_Charge, but without involving the pressure callback or issuing
+ * an error: for callers that have something else to do if the budget is
+ * exhausted. Returns non zero on success.
+ */
+static int
+AU_BL_TryCharge(struct AU_BudgetLink *bl, size_t n) {
+  if (!bl->bdg) {
+    return 1;
+  }
+  if (bl->credit >= n) {
+    bl->credit -= n;
+    return 1;
+  }
+  size_t missing = n - bl->credit;
+  if (!AU_BDG_TryCharge(bl->bdg, missing)) {
+    return 0;
+  }
+  bl->charged += missing;
+  bl->credit = 0;
+  return 1;
+}
+
+// For when the memory paid for with AU_BL_Charge didn't get allocated after
+// all. It stays as credit.
+static inline void
+AU_BL_Refund(struct AU_BudgetLink *bl, size_t n) {
+  if (bl->bdg) {
+    bl->credit += n;
+  }
+}
+
+////////////////////
+//// Size Hints ////
+////////////////////
+
+enum {
+  // Each record moves the estimate by a step of 1/64 of itself: 9 steps up
+  // for sizes above it, 1 step down for sizes below it. It settles where 1
+  // in 10 sizes are above it, the 90th percentile (of recent sizes, since
+  // the steps are large enough for old ones to be forgotten).
+  SH_STEP_SHIFT = 6,
+  SH_UP_STEPS = 9
 };
 
-enum {
-  ALIGNMENT_BOUNDARY = sizeof (union AlignmentType),
-};
+size_t
+AU_SH_Suggest(const AU_SizeHint *hint, size_t fallback) {
+  assert(hint);
+
+  size_t estimate = __atomic_load_n(&hint->estimate, __ATOMIC_RELAXED);
+  return estimate ? estimate : fallback;
+}
+
+void
+AU_SH_Record(AU_SizeHint *hint, size_t size) {
+  assert(hint);
+
+  size_t q = __atomic_load_n(&hint->estimate, __ATOMIC_RELAXED);
+  size_t step = maxsz(q >> SH_STEP_SHIFT, 1);
+  if (q == 0) {
+    q = size;
+  } else if (size > q) {
+    q = q > SIZE_MAX - SH_UP_STEPS*step ? SIZE_MAX : q + SH_UP_STEPS*step;
+  } else if (size < q) {
+    q = q > step ? q - step : 1;
+  }
+  __atomic_store_n(&hint->estimate, q, __ATOMIC_RELAXED);
+}
+
+//////////////////////
+//// BYTE Builder ////
+//////////////////////
+
+#ifndef NDEBUG
+
+#define ASSERT_VALID_B1(b1) \
+  do { \
+    assert(b1); \
+    assert((b1)->mem); \
+    assert((b1)->used <= (b1)->cap); \
+    assert((b1)->cap > 0); \
+  } while (0)
+
+#else
+
+#define ASSERT_VALID_B1(b1)
+
+#endif
+
+int
+AU_B1_Setup(AU_ByteBuilder *b1, size_t cap) {
+  assert(cap > 0);
+
+  b1->cap = cap;
+  b1->used = 0;
+  AU_BL_Init(&b1->bl);
+  b1->sum = 0;
+  b1->spill = 0;
+  b1->mem = xmalloc(cap);
+  if (!b1->mem) {
+    ISSUE_ERROR(AU_ERR_XMALLOC);
+    return AU_ERR_XMALLOC;
+  }
+  AU_PROBE3(b1__setup, b1, cap, b1->mem);
+  ASSERT_VALID_B1(b1);
+  return 0;
+}
+
+/*
+ * Grows the builder's memory so it can hold at least min_cap bytes. The
+ * capacity is at least doubled, so appends take amortized constant time.
+ */
+static int
+AU_B1_GrowSpilled(AU_ByteBuilder *b1, size_t new_cap);
+
+static int
+AU_B1_Grow(AU_ByteBuilder *b1, size_t min_cap) {
+  assert(min_cap > b1->cap);
+
+  size_t new_cap = b1->cap > SIZE_MAX/2
+                   ? SIZE_MAX
+                   : maxsz(b1->cap*2, min_cap);
+  if (b1->spill) {
+    if (b1->spill->fd >= 0
+        || new_cap > b1->spill->limit
+        || !AU_BL_TryCharge(&b1->bl, new_cap - b1->cap)) {
+      return AU_B1_GrowSpilled(b1, new_cap);
+    }
+  } else {
+    int res = AU_BL_Charge(&b1->bl, new_cap - b1->cap);
+    if (res < 0) {
+      return res;
+    }
+  }
+  void *p = xrealloc(b1->mem, new_cap);
+  if (!p) {
+    AU_BL_Refund(&b1->bl, new_cap - b1->cap);
+    ISSUE_ERROR(AU_ERR_XREALLOC);
+    return AU_ERR_XREALLOC;
+  }
+  AU_PROBE4(b1__grow, b1, b1->cap, new_cap, p);
+  b1->mem = p;
+  b1->cap = new_cap;
+  return 0;
+}
+
+/*
+ * Makes sure size more bytes fit in the builder, without using them yet.
+ */
+static int
+AU_B1_EnsureRoom(AU_ByteBuilder *b1, size_t size) {
+  if (b1->used > SIZE_MAX - size) {
+    ISSUE_ERROR(AU_ERR_OVERFLOW);
+    return AU_ERR_OVERFLOW;
+  }
+  if (b1->used + size > b1->cap) {
+    if (b1->cap == SIZE_MAX || b1->cap > SIZE_MAX - size) {
+      // This seems so absurd...
+      ISSUE_ERROR(AU_ERR_OVERFLOW);
+      return AU_ERR_OVERFLOW;
+    }
+    return AU_B1_Grow(b1, b1->used + size);
+  }
+  return 0;
+}
+
+/*
+ * The attached checksum (if any) catches up with the builder's contents,
+ * except for reserved bytes that are still to be patched.
+ */
+static void
+AU_B1_SyncChecksum(AU_ByteBuilder *b1) {
+  AU_Checksum *ck = b1->sum;
+  size_t limit = b1->used < ck->hold ? b1->used : ck->hold;
+  if (ck->hashed < limit) {
+    AU_CK_Update(ck, (char*)b1->mem + ck->hashed, limit - ck->hashed);
+    ck->hashed = limit;
+  }
+}
+
+/*
+ * The bytes from offset on are about to change. If they were hashed, the
+ * checksum has to start over.
+ */
+static void
+AU_B1_RewindChecksum(AU_ByteBuilder *b1, size_t offset) {
+  AU_Checksum *ck = b1->sum;
+  if (offset < ck->hashed) {
+    AU_CK_Reset(ck);
+    ck->hashed = 0;
+  }
+}
+
+/*
+ * size reserved bytes at offset were filled in.
+ */
+static void
+AU_B1_PatchChecksum(AU_ByteBuilder *b1, size_t offset, size_t size) {
+  AU_Checksum *ck = b1->sum;
+  AU_B1_RewindChecksum(b1, offset);
+  ck->pending -= size < ck->pending ? size : ck->pending;
+  if (ck->pending == 0) {
+    ck->hold = SIZE_MAX;
+  }
+}
+
+int
+AU_B1_Append(AU_ByteBuilder *b1, const void *mem, size_t size) {
+  ASSERT_VALID_B1(b1);
+  assert(mem);
+
+  int res = AU_B1_EnsureRoom(b1, size);
+  if (res < 0) {
+    return res;
+  }
+  memcpy((char*)b1->mem + b1->used, mem, size);
+  b1->used += size;
+  if (b1->sum) {
+    AU_B1_SyncChecksum(b1);
+  }
+  return 0;
+}
+
+void *
+AU_B1_AppendForSetup(AU_ByteBuilder *b1, size_t size) {
+  ASSERT_VALID_B1(b1);
+
+  if (AU_B1_EnsureRoom(b1, size) < 0) {
+    return 0;
+  }
+  if (b1->sum) {
+    AU_B1_SyncChecksum(b1);
+  }
+  void *out_addr = (char*)b1->mem + b1->used;
+  b1->used += size;
+  return out_addr;
+}
+
+void *
+AU_B1_GetMemory(const AU_ByteBuilder *b1) {
+  ASSERT_VALID_B1(b1);
+
+  return b1->mem;
+}
+
+void
+AU_B1_DiscardAppends(AU_ByteBuilder *b1) {
+  ASSERT_VALID_B1(b1);
+
+  b1->used = 0;
+  if (b1->sum) {
+    AU_B1_RewindChecksum(b1, 0);
+    b1->sum->hold = SIZE_MAX;
+    b1->sum->pending = 0;
+  }
+}
+
+void
+AU_B1_DiscardLastBytes(AU_ByteBuilder *b1, size_t n) {
+  ASSERT_VALID_B1(b1);
+  assert(b1->used >= n);
+
+  b1->used -= n;
+  if (b1->sum) {
+    AU_B1_RewindChecksum(b1, b1->used);
+    if (b1->sum->hold >= b1->used) {
+      b1->sum->hold = SIZE_MAX;
+      b1->sum->pending = 0;
+    }
+  }
+}
+
+size_t
+AU_B1_GetUsedCount(AU_ByteBuilder *b1) {
+  return b1->used;
+}
+
+int
+AU_B1_SetBudget(AU_ByteBuilder *b1, AU_Budget *bdg) {
+  ASSERT_VALID_B1(b1);
+
+  return AU_BL_Attach(&b1->bl, bdg, b1->cap);
+}
+
+void
+AU_B1_ReleaseBudget(AU_ByteBuilder *b1) {
+  ASSERT_VALID_B1(b1);
+
+  AU_BL_Release(&b1->bl);
+}
+
+/*
+ * The pool of retired builder buffers. Each thread has its own, so there is
+ * no locking. Buffers are kept in buckets by capacity: bucket k has buffers of
+ * at least 2^(B1_POOL_MIN_SHIFT + k) bytes, linked through their first bytes.
+ */
+
+enum {
+  B1_POOL_MIN_SHIFT = 6,
+  B1_POOL_MAX_SHIFT = 24,
+  B1_POOL_BUCKETS = B1_POOL_MAX_SHIFT - B1_POOL_MIN_SHIFT + 1,
+
+  // How many buffers a bucket holds on to. The rest go back to xfree.
+  B1_POOL_BUCKET_DEPTH = 8
+};
+
+struct B1PoolBucket {
+  void *head;
+  size_t count;
+};
+
+static AU_THREAD_LOCAL struct B1PoolBucket b1_pool[B1_POOL_BUCKETS];
+
+int
+AU_B1_SetupFromPool(AU_ByteBuilder *b1, size_t cap) {
+  assert(cap > 0);
+
+  unsigned shift = CeilLog2(cap);
+  if (shift > B1_POOL_MAX_SHIFT) {
+    return AU_B1_Setup(b1, cap);
+  }
+  if (shift < B1_POOL_MIN_SHIFT) {
+    shift = B1_POOL_MIN_SHIFT;
+  }
+
+  // The smallest buffer that's large enough. Builders usually grow past the
+  // capacity they were set up with, so their buffers come back in larger
+  // buckets than they were asked from.
+  unsigned k = shift;
+  while (k <= B1_POOL_MAX_SHIFT && !b1_pool[k - B1_POOL_MIN_SHIFT].head) {
+    k++;
+  }
+  if (k > B1_POOL_MAX_SHIFT) {
+    // Power of two capacities, so the buffer comes back to the pool nicely.
+    return AU_B1_Setup(b1, (size_t)1 << shift);
+  }
+
+  struct B1PoolBucket *bucket = &b1_pool[k - B1_POOL_MIN_SHIFT];
+  b1->mem = bucket->head;
+  bucket->head = *(void**)bucket->head;
+  bucket->count--;
+  b1->cap = (size_t)1 << k;
+  b1->used = 0;
+  AU_BL_Init(&b1->bl);
+  b1->sum = 0;
+  b1->spill = 0;
+  AU_PROBE3(b1__setup, b1, b1->cap, b1->mem);
+  ASSERT_VALID_B1(b1);
+  return 0;
+}
+
+void
+AU_B1_Release(AU_ByteBuilder *b1) {
+  ASSERT_VALID_B1(b1);
+
+  if (AU_B1_IsSpilled(b1)) {
+    AU_B1_Destroy(b1);
+    return;
+  }
+  AU_PROBE3(b1__destroy, b1, b1->cap, b1->mem);
+  AU_BL_Release(&b1->bl);
+
+  unsigned shift = FloorLog2(b1->cap);
+  if (shift < B1_POOL_MIN_SHIFT || shift > B1_POOL_MAX_SHIFT) {
+    xfree(b1->mem);
+  } else {
+    struct B1PoolBucket *bucket = &b1_pool[shift - B1_POOL_MIN_SHIFT];
+    if (bucket->count == B1_POOL_BUCKET_DEPTH) {
+      xfree(b1->mem);
+    } else {
+      *(void**)b1->mem = bucket->head;
+      bucket->head = b1->mem;
+      bucket->count++;
+    }
+  }
+  b1->mem = 0;
+  b1->cap = 0;
+  b1->used = 0;
+  b1->sum = 0;
+  b1->spill = 0;
+}
+
+int
+AU_B1_AppendV(AU_ByteBuilder *b1, const struct iovec *iov, int n) {
+  ASSERT_VALID_B1(b1);
+  assert(n >= 0);
+  assert(n == 0 || iov);
+
+  size_t total = 0;
+  for (int i = 0; i < n; i++) {
+    if (iov[i].iov_len > SIZE_MAX - total) {
+      ISSUE_ERROR(AU_ERR_OVERFLOW);
+      return AU_ERR_OVERFLOW;
+    }
+    total += iov[i].iov_len;
+  }
+  int res = AU_B1_EnsureRoom(b1, total);
+  if (res < 0) {
+    return res;
+  }
+  char *out = (char*)b1->mem + b1->used;
+  for (int i = 0; i < n; i++) {
+    memcpy(out, iov[i].iov_base, iov[i].iov_len);
+    out += iov[i].iov_len;
+  }
+  b1->used += total;
+  if (b1->sum) {
+    AU_B1_SyncChecksum(b1);
+  }
+  return 0;
+}
+
+int
+AU_B1_Reserve(AU_ByteBuilder *b1, size_t n, size_t *offset) {
+  ASSERT_VALID_B1(b1);
+  assert(offset);
+
+  int res = AU_B1_EnsureRoom(b1, n);
+  if (res < 0) {
+    return res;
+  }
+  if (b1->sum) {
+    AU_B1_SyncChecksum(b1);
+    if (b1->sum->pending == 0) {
+      b1->sum->hold = b1->used;
+    }
+    b1->sum->pending += n;
+  }
+  *offset = b1->used;
+  b1->used += n;
+  return 0;
+}
+
+void
+AU_B1_PatchU32(AU_ByteBuilder *b1, size_t offset, uint32_t v) {
+  ASSERT_VALID_B1(b1);
+  assert(offset <= b1->used && b1->used - offset >= 4);
+
+  if (b1->sum) {
+    AU_B1_PatchChecksum(b1, offset, 4);
+  }
+  unsigned char *p = (unsigned char*)b1->mem + offset;
+  for (int i = 0; i < 4; i++) {
+    p[i] = (unsigned char)(v >> 8*i);
+  }
+}
+
+void
+AU_B1_PatchU64(AU_ByteBuilder *b1, size_t offset, uint64_t v) {
+  ASSERT_VALID_B1(b1);
+  assert(offset <= b1->used && b1->used - offset >= 8);
+
+  if (b1->sum) {
+    AU_B1_PatchChecksum(b1, offset, 8);
+  }
+  unsigned char *p = (unsigned char*)b1->mem + offset;
+  for (int i = 0; i < 8; i++) {
+    p[i] = (unsigned char)(v >> 8*i);
+  }
+}
+
+int
+AU_B1_BeginVarintPrefix(AU_ByteBuilder *b1, size_t *mark) {
+  return AU_B1_Reserve(b1, 1, mark);
+}
+
+int
+AU_B1_EndVarintPrefix(AU_ByteBuilder *b1, size_t mark) {
+  ASSERT_VALID_B1(b1);
+  assert(mark < b1->used);
+
+  size_t len = b1->used - mark - 1;
+  size_t extra = 0;
+  for (size_t v = len >> 7; v; v >>= 7) {
+    extra++;
+  }
+  if (extra > 0) {
+    int res = AU_B1_EnsureRoom(b1, extra);
+    if (res < 0) {
+      return res;
+    }
+    char *body = (char*)b1->mem + mark + 1;
+    memmove(body + extra, body, len);
+    b1->used += extra;
+  }
+
+  unsigned char *p = (unsigned char*)b1->mem + mark;
+  while (len >= 0x80) {
+    *p++ = (unsigned char)(len | 0x80);
+    len >>= 7;
+  }
+  *p = (unsigned char)len;
+  // Only now is the reserved byte filled in: if growing failed above, it
+  // stays held back from the checksum, and End can be tried again.
+  if (b1->sum) {
+    AU_B1_PatchChecksum(b1, mark, 1);
+  }
+  return 0;
+}
+
+int
+AU_B1_SetupHinted(AU_ByteBuilder *b1, AU_SizeHint *hint, size_t cap) {
+  return AU_B1_Setup(b1, AU_SH_Suggest(hint, cap));
+}
+
+void
+AU_B1_RecordHint(AU_SizeHint *hint, AU_ByteBuilder *b1) {
+  ASSERT_VALID_B1(b1);
+
+  AU_SH_Record(hint, b1->used);
+}
+
+int
+AU_B1_MakeRoom(AU_ByteBuilder *b1, size_t n) {
+  ASSERT_VALID_B1(b1);
+
+  return AU_B1_EnsureRoom(b1, n);
+}
+
+void
+AU_B1_SetChecksum(AU_ByteBuilder *b1, AU_Checksum *ck) {
+  ASSERT_VALID_B1(b1);
+
+  b1->sum = ck;
+  if (ck) {
+    AU_CK_Reset(ck);
+    ck->hashed = 0;
+    ck->hold = SIZE_MAX;
+    ck->pending = 0;
+  }
+}
+
+uint64_t
+AU_B1_GetChecksum(AU_ByteBuilder *b1) {
+  ASSERT_VALID_B1(b1);
+  assert(b1->sum);
+
+  // Whatever is reserved is taken as filled in by now.
+  b1->sum->hold = SIZE_MAX;
+  b1->sum->pending = 0;
+  AU_B1_SyncChecksum(b1);
+  return AU_CK_Digest(b1->sum);
+}
+
+/*
+ * Extends the spill file to size bytes and maps all of it. Returns MAP_FAILED
+ * on failure.
+ *
+ * ftruncate alone leaves a sparse file, and writing to a page of it that the
+ * disk has no room for raises SIGBUS. posix_fallocate reserves the blocks, so
+ * a full disk fails here instead.
+ */
+static void *
+AU_B1_MapSpillFile(int fd, size_t size) {
+  off_t off_size = (off_t)size;
+  if (off_size < 0 || (size_t)off_size != size
+      || ftruncate(fd, off_size) != 0
+      || posix_fallocate(fd, 0, off_size) != 0) {
+    return MAP_FAILED;
+  }
+  void *p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p != MAP_FAILED) {
+    posix_madvise(p, size, POSIX_MADV_SEQUENTIAL);
+  }
+  return p;
+}
+
+/*
+ * Creates the spill file and moves the builder's contents to it. The file is
+ * unlinked at once, so only the descriptor (and the mapping) keep it around.
+ */
+static int
+AU_B1_SpillToFile(AU_ByteBuilder *b1, size_t new_cap) {
+  static const char name[] = "/AUSpillXXXXXX";
+  AU_Spill *sp = b1->spill;
+
+  size_t dir_len = strlen(sp->dir);
+  char *path = xmalloc(dir_len + sizeof name);
+  if (!path) {
+    ISSUE_ERROR(AU_ERR_XMALLOC);
+    return AU_ERR_XMALLOC;
+  }
+  memcpy(path, sp->dir, dir_len);
+  memcpy(path + dir_len, name, sizeof name);
+  int fd = mkstemp(path);
+  if (fd >= 0) {
+    unlink(path);
+  }
+  xfree(path);
+  if (fd < 0) {
+    ISSUE_ERROR(AU_ERR_SPILL);
+    return AU_ERR_SPILL;
+  }
+
+  void *p = AU_B1_MapSpillFile(fd, new_cap);
+  if (p == MAP_FAILED) {
+    close(fd);
+    ISSUE_ERROR(AU_ERR_SPILL);
+    return AU_ERR_SPILL;
+  }
+  memcpy(p, b1->mem, b1->used);
+  xfree(b1->mem);
+
+  // The memory is the page cache's problem now.
+  AU_BL_Release(&b1->bl);
+  AU_PROBE4(b1__spill, b1, b1->cap, new_cap, p);
+  sp->fd = fd;
+  b1->mem = p;
+  b1->cap = new_cap;
+  return 0;
+}
+
+/*
+ * Grows a builder with a spill attached that can't (or can't anymore) grow in
+ * memory. Growing a spilled builder maps the extended file anew, and only
+ * then drops the old mapping, so a failure leaves the builder as it was.
+ */
+static int
+AU_B1_GrowSpilled(AU_ByteBuilder *b1, size_t new_cap) {
+  AU_Spill *sp = b1->spill;
+  if (sp->fd < 0) {
+    return AU_B1_SpillToFile(b1, new_cap);
+  }
+
+  void *p = AU_B1_MapSpillFile(sp->fd, new_cap);
+  if (p == MAP_FAILED) {
+    ISSUE_ERROR(AU_ERR_SPILL);
+    return AU_ERR_SPILL;
+  }
+  munmap(b1->mem, b1->cap);
+  AU_PROBE4(b1__grow, b1, b1->cap, new_cap, p);
+  b1->mem = p;
+  b1->cap = new_cap;
+  return 0;
+}
+
+void
+AU_B1_SetSpill(AU_ByteBuilder *b1, AU_Spill *sp, const char *dir,
+               size_t limit) {
+  ASSERT_VALID_B1(b1);
+  assert(!AU_B1_IsSpilled(b1));
+  assert(sp);
+  assert(dir);
+
+  sp->dir = dir;
+  sp->limit = limit;
+  sp->fd = -1;
+  b1->spill = sp;
+}
+
+int
+AU_B1_IsSpilled(const AU_ByteBuilder *b1) {
+  return b1->spill && b1->spill->fd >= 0;
+}
+
+void
+AU_B1_Destroy(AU_ByteBuilder *b1) {
+  ASSERT_VALID_B1(b1);
+
+  AU_PROBE3(b1__destroy, b1, b1->cap, b1->mem);
+  AU_BL_Release(&b1->bl);
+  if (AU_B1_IsSpilled(b1)) {
+    munmap(b1->mem, b1->cap);
+    close(b1->spill->fd);
+    b1->spill->fd = -1;
+  } else {
+    xfree(b1->mem);
+  }
+  b1->mem = 0;
+  b1->cap = 0;
+  b1->used = 0;
+  b1->sum = 0;
+  b1->spill = 0;
+}
+
+void
+AU_B1_TrimPool(void) {
+  for (int i = 0; i < B1_POOL_BUCKETS; i++) {
+    while (b1_pool[i].head) {
+      void *next = *(void**)b1_pool[i].head;
+      xfree(b1_pool[i].head);
+      b1_pool[i].head = next;
+    }
+    b1_pool[i].count = 0;
+  }
+}
+
+////////////////////////////
+//// Fixed Size Builder ////
+////////////////////////////
+
+#ifndef NDEBUG
+
+#define ASSERT_VALID_FSB(fsb) \
+  do { \
+    assert(fsb); \
+    assert((fsb)->elt_size > 0); \
+    assert((fsb)->elt_size <= SIZE_MAX / (fsb)->b1.cap); \
+    ASSERT_VALID_B1(&(fsb)->b1); \
+  } while (0)
+
+#else
+
+#define ASSERT_VALID_FSB(fsb)
+
+#endif
+
+int
+AU_FSB_Setup(AU_FixedSizeBuilder *fsb, size_t elt_size, size_t cap) {
+  assert(cap > 0);
+  assert(elt_size > 0);
+  assert(cap <= SIZE_MAX/elt_size);
+
+  int b1_res = AU_B1_Setup(&fsb->b1, elt_size*cap);
+  if (b1_res < 0) {
+    return b1_res;
+  }
+  fsb->elt_size = elt_size;
+
+  ASSERT_VALID_FSB(fsb);
+
+  return 0;
+}
+
+int
+AU_FSB_Append(AU_FixedSizeBuilder *fsb, const void *mem, size_t n) {
+  ASSERT_VALID_FSB(fsb);
+  assert(mem);
+
+  if (n != 0 && fsb->elt_size > SIZE_MAX/n) {
+    ISSUE_ERROR(AU_ERR_OVERFLOW);
+    return AU_ERR_OVERFLOW;
+  }
+
+  int res = AU_B1_Append(&fsb->b1, mem, n*fsb->elt_size);
+  if (res < 0) {
+    return res;
+  }
+  return 0;
+}
+
+void *
+AU_FSB_AppendForSetup(AU_FixedSizeBuilder *fsb, size_t n) {
+  ASSERT_VALID_FSB(fsb);
+
+  if (n != 0 && fsb->elt_size > SIZE_MAX/n) {
+    ISSUE_ERROR(AU_ERR_OVERFLOW);
+    return 0;
+  }
+  void *mem = AU_B1_AppendForSetup(&fsb->b1, n*fsb->elt_size);
+  if (!mem) {
+    return 0;
+  }
+  return mem;
+}
+
+void *
+AU_FSB_GetMemory(AU_FixedSizeBuilder *fsb) {
+  ASSERT_VALID_FSB(fsb);
+
+  return AU_B1_GetMemory(&fsb->b1);
+}
+
+void
+AU_FSB_DiscardAppends(AU_FixedSizeBuilder *fsb) {
+  ASSERT_VALID_FSB(fsb);
+
+  AU_B1_DiscardAppends(&fsb->b1);
+}
+
+void
+AU_FSB_DiscardLastAppends(AU_FixedSizeBuilder *fsb, size_t n) {
+  ASSERT_VALID_FSB(fsb);
+  assert(n == 0 || fsb->elt_size <= SIZE_MAX/n);
+  assert(fsb->b1.used/fsb->elt_size >= n);
+
+  AU_B1_DiscardLastBytes(&fsb->b1, n*fsb->elt_size);
+}
+
+size_t
+AU_FSB_GetUsedCount(AU_FixedSizeBuilder *fsb) {
+  return fsb->b1.used/fsb->elt_size;
+}
+
+int
+AU_FSB_AppendV(AU_FixedSizeBuilder *fsb, const struct iovec *iov, int n) {
+  ASSERT_VALID_FSB(fsb);
+  assert(n >= 0);
+  assert(n == 0 || iov);
+
+  size_t total = 0;
+  for (int i = 0; i < n; i++) {
+    if (iov[i].iov_len > SIZE_MAX - total) {
+      ISSUE_ERROR(AU_ERR_OVERFLOW);
+      return AU_ERR_OVERFLOW;
+    }
+    total += iov[i].iov_len;
+  }
+  if (total != 0 && fsb->elt_size > SIZE_MAX/total) {
+    ISSUE_ERROR(AU_ERR_OVERFLOW);
+    return AU_ERR_OVERFLOW;
+  }
+  int res = AU_B1_EnsureRoom(&fsb->b1, total*fsb->elt_size);
+  if (res < 0) {
+    return res;
+  }
+  char *out = (char*)fsb->b1.mem + fsb->b1.used;
+  for (int i = 0; i < n; i++) {
+    size_t bytes = iov[i].iov_len*fsb->elt_size;
+    memcpy(out, iov[i].iov_base, bytes);
+    out += bytes;
+  }
+  fsb->b1.used += total*fsb->elt_size;
+  if (fsb->b1.sum) {
+    AU_B1_SyncChecksum(&fsb->b1);
+  }
+  return 0;
+}
+
+int
+AU_FSB_SetBudget(AU_FixedSizeBuilder *fsb, AU_Budget *bdg) {
+  ASSERT_VALID_FSB(fsb);
+
+  return AU_B1_SetBudget(&fsb->b1, bdg);
+}
+
+void
+AU_FSB_ReleaseBudget(AU_FixedSizeBuilder *fsb) {
+  ASSERT_VALID_FSB(fsb);
+
+  AU_B1_ReleaseBudget(&fsb->b1);
+}
+
+int
+AU_FSB_SetupHinted(AU_FixedSizeBuilder *fsb,
+                   size_t elt_size,
+                   AU_SizeHint *hint,
+                   size_t cap) {
+  assert(elt_size > 0);
+  assert(cap > 0);
+
+  size_t bytes = AU_SH_Suggest(hint, 0);
+  if (bytes != 0) {
+    cap = bytes/elt_size + (bytes % elt_size != 0);
+  }
+  return AU_FSB_Setup(fsb, elt_size, cap);
+}
+
+void
+AU_FSB_RecordHint(AU_SizeHint *hint, AU_FixedSizeBuilder *fsb) {
+  ASSERT_VALID_FSB(fsb);
+
+  AU_SH_Record(hint, fsb->b1.used);
+}
+
+int
+AU_FSB_MakeRoom(AU_FixedSizeBuilder *fsb, size_t n) {
+  ASSERT_VALID_FSB(fsb);
+
+  if (n != 0 && fsb->elt_size > SIZE_MAX/n) {
+    ISSUE_ERROR(AU_ERR_OVERFLOW);
+    return AU_ERR_OVERFLOW;
+  }
+  return AU_B1_EnsureRoom(&fsb->b1, n*fsb->elt_size);
+}
+
+void
+AU_FSB_SetChecksum(AU_FixedSizeBuilder *fsb, AU_Checksum *ck) {
+  ASSERT_VALID_FSB(fsb);
+
+  AU_B1_SetChecksum(&fsb->b1, ck);
+}
+
+uint64_t
+AU_FSB_GetChecksum(AU_FixedSizeBuilder *fsb) {
+  ASSERT_VALID_FSB(fsb);
+
+  return AU_B1_GetChecksum(&fsb->b1);
+}
+
+void
+AU_FSB_SetSpill(AU_FixedSizeBuilder *fsb,
+                AU_Spill *sp,
+                const char *dir,
+                size_t limit) {
+  ASSERT_VALID_FSB(fsb);
+
+  AU_B1_SetSpill(&fsb->b1, sp, dir, limit);
+}
+
+int
+AU_FSB_IsSpilled(const AU_FixedSizeBuilder *fsb) {
+  return AU_B1_IsSpilled(&fsb->b1);
+}
+
+void
+AU_FSB_Destroy(AU_FixedSizeBuilder *fsb) {
+  ASSERT_VALID_FSB(fsb);
+
+  AU_B1_Destroy(&fsb->b1);
+}
+
+///////////////////////////////
+//// Variable Size Builder ////
+///////////////////////////////
+
+int
+AU_VSB_Setup(AU_VarSizeBuilder *vsb, size_t cap, size_t align) {
+  vsb->align = align == AU_ALIGN_CONSERVATIVE ? ALIGNMENT_BOUNDARY : align;
+  return AU_B1_Setup(&vsb->b1, AlignSize(cap, vsb->align));
+}
+
+int
+AU_VSB_Append(AU_VarSizeBuilder *vsb, const void *mem, size_t n) {
+  return AU_B1_Append(&vsb->b1, mem, AlignSize(n, vsb->align));
+}
+
+void *
+AU_VSB_AppendForSetup(AU_VarSizeBuilder *vsb, size_t n) {
+  return AU_B1_AppendForSetup(&vsb->b1, AlignSize(n, vsb->align));
+}
+
+void *
+AU_VSB_GetMemory(AU_VarSizeBuilder *vsb) {
+  return AU_B1_GetMemory(&vsb->b1);
+}
+
+void
+AU_VSB_DiscardAppends(AU_VarSizeBuilder *vsb) {
+  AU_B1_DiscardAppends(&vsb->b1);
+}
+
+size_t
+AU_VSB_GetUsedCount(AU_VarSizeBuilder *vsb) {
+  return AU_B1_GetUsedCount(&vsb->b1);
+}
+
+int
+AU_VSB_SetBudget(AU_VarSizeBuilder *vsb, AU_Budget *bdg) {
+  return AU_B1_SetBudget(&vsb->b1, bdg);
+}
+
+void
+AU_VSB_ReleaseBudget(AU_VarSizeBuilder *vsb) {
+  AU_B1_ReleaseBudget(&vsb->b1);
+}
+
+///////////////
+//// Arena ////
+///////////////
+
+struct AU_ArenaBlock {
+  struct AU_ArenaBlock *next;
+
+  // Bytes available after the header.
+  size_t size;
+};
+
+struct AU_ArenaCleanup {
+  struct AU_ArenaCleanup *next;
+  void (*fn)(void *data);
+  void *data;
+};
+
+#define ARENA_HEADER_SIZE \
+  AlignSize(sizeof (struct AU_ArenaBlock), ALIGNMENT_BOUNDARY)
+
+#ifndef NDEBUG
+
+#define ASSERT_VALID_AR(ar) \
+  do { \
+    assert(ar); \
+    assert((ar)->blocks); \
+    assert((ar)->block_size > 0); \
+    assert((ar)->top <= (ar)->end); \
+  } while (0)
+
+#else
+
+#define ASSERT_VALID_AR(ar)
+
+#endif
+
+static inline char *
+AU_AR_BlockData(struct AU_ArenaBlock *blk) {
+  return (char*)blk + ARENA_HEADER_SIZE;
+}
+
+/*
+ * Gets a standard sized block for ar: from the closest cache up the arena
+ * tree that has one, or from xmalloc.
+ */
+static struct AU_ArenaBlock *
+AU_AR_TakeBlock(AU_Arena *ar) {
+  for (AU_Arena *a = ar; a; a = a->parent) {
+    struct AU_ArenaBlock *blk = a->free_blocks;
+    if (blk) {
+      a->free_blocks = blk->next;
+      return blk;
+    }
+  }
+  if (ar->block_size > SIZE_MAX - ARENA_HEADER_SIZE) {
+    ISSUE_ERROR(AU_ERR_OVERFLOW);
+    return 0;
+  }
+  struct AU_ArenaBlock *blk = xmalloc(ARENA_HEADER_SIZE + ar->block_size);
+  if (!blk) {
+    ISSUE_ERROR(AU_ERR_XMALLOC);
+    return 0;
+  }
+  blk->size = ar->block_size;
+  return blk;
+}
+
+// Makes blk the block allocations are bumped from.
+static void
+AU_AR_PushBlock(AU_Arena *ar, struct AU_ArenaBlock *blk) {
+  blk->next = ar->blocks;
+  ar->blocks = blk;
+  ar->top = AU_AR_BlockData(blk);
+  ar->end = ar->top + blk->size;
+}
+
+/*
+ * Where the next allocation would start: top, aligned. If the current block
+ * doesn't have room even for the alignment, that's end.
+ */
+static inline char *
+AU_AR_AlignedTop(AU_Arena *ar) {
+  char *data = AU_AR_BlockData(ar->blocks);
+  size_t offset = (size_t)(ar->top - data);
+  if (offset == 0) {
+    return ar->top;
+  }
+  size_t aligned = AlignSize(offset, ALIGNMENT_BOUNDARY);
+  return aligned >= ar->blocks->size ? ar->end : data + aligned;
+}
+
+static int
+AU_AR_Init(AU_Arena *ar, AU_Arena *parent, size_t block_size) {
+  ar->blocks = 0;
+  ar->free_blocks = 0;
+  ar->cleanups = 0;
+  ar->parent = parent;
+  ar->children = 0;
+  ar->prev_sibling = 0;
+  ar->next_sibling = 0;
+  ar->block_size = block_size;
+
+  struct AU_ArenaBlock *blk = AU_AR_TakeBlock(ar);
+  if (!blk) {
+    return AU_ERR_XMALLOC;
+  }
+  AU_AR_PushBlock(ar, blk);
+
+  if (parent) {
+    ar->next_sibling = parent->children;
+    if (parent->children) {
+      parent->children->prev_sibling = ar;
+    }
+    parent->children = ar;
+  }
+  ASSERT_VALID_AR(ar);
+  return 0;
+}
+
+int
+AU_AR_Setup(AU_Arena *ar, size_t block_size) {
+  assert(ar);
+  assert(block_size > 0);
+
+  return AU_AR_Init(ar, 0, block_size);
+}
+
+int
+AU_AR_SetupChild(AU_Arena *child, AU_Arena *parent) {
+  assert(child);
+  ASSERT_VALID_AR(parent);
+
+  return AU_AR_Init(child, parent, parent->block_size);
+}
+
+/*
+ * Allocations that don't fit in what's left of the current block. Large ones
+ * get a block of their own, which goes right after the current block so the
+ * current block keeps being bumped.
+ */
+static void *
+AU_AR_AllocSlow(AU_Arena *ar, size_t size) {
+  if (size > ar->block_size) {
+    if (size > SIZE_MAX - ARENA_HEADER_SIZE) {
+      ISSUE_ERROR(AU_ERR_OVERFLOW);
+      return 0;
+    }
+    struct AU_ArenaBlock *blk = xmalloc(ARENA_HEADER_SIZE + size);
+    if (!blk) {
+      ISSUE_ERROR(AU_ERR_XMALLOC);
+      return 0;
+    }
+    blk->size = size;
+    blk->next = ar->blocks->next;
+    ar->blocks->next = blk;
+    return AU_AR_BlockData(blk);
+  }
+
+  struct AU_ArenaBlock *blk = AU_AR_TakeBlock(ar);
+  if (!blk) {
+    return 0;
+  }
+  AU_AR_PushBlock(ar, blk);
+  void *out = ar->top;
+  ar->top += size;
+  return out;
+}
+
+void *
+AU_AR_Alloc(AU_Arena *ar, size_t size) {
+  ASSERT_VALID_AR(ar);
+  assert(size > 0);
+
+  char *p = AU_AR_AlignedTop(ar);
+  if (size <= (size_t)(ar->end - p)) {
+    ar->top = p + size;
+    return p;
+  }
+  return AU_AR_AllocSlow(ar, size);
+}
+
+int
+AU_AR_AddCleanup(AU_Arena *ar, void (*fn)(void *data), void *data) {
+  ASSERT_VALID_AR(ar);
+  assert(fn);
+
+  struct AU_ArenaCleanup *c = AU_AR_Alloc(ar, sizeof *c);
+  if (!c) {
+    return AU_ERR_XMALLOC;
+  }
+  c->fn = fn;
+  c->data = data;
+  c->next = ar->cleanups;
+  ar->cleanups = c;
+  return 0;
+}
+
+/*
+ * Standard sized blocks go to the parent's cache, or back to xfree for root
+ * arenas. Blocks of large allocations are always given back to xfree.
+ */
+static void
+AU_AR_RecycleBlocks(AU_Arena *ar, struct AU_ArenaBlock *blk) {
+  while (blk) {
+    struct AU_ArenaBlock *next = blk->next;
+    if (ar->parent && blk->size == ar->block_size) {
+      blk->next = ar->parent->free_blocks;
+      ar->parent->free_blocks = blk;
+    } else {
+      xfree(blk);
+    }
+    blk = next;
+  }
+}
+
+void
+AU_AR_Destroy(AU_Arena *ar) {
+  ASSERT_VALID_AR(ar);
+
+  // Children unlink themselves from ar as they go.
+  while (ar->children) {
+    AU_AR_Destroy(ar->children);
+  }
+
+  for (struct AU_ArenaCleanup *c = ar->cleanups; c; c = c->next) {
+    c->fn(c->data);
+  }
+
+  if (ar->parent) {
+    if (ar->prev_sibling) {
+      ar->prev_sibling->next_sibling = ar->next_sibling;
+    } else {
+      ar->parent->children = ar->next_sibling;
+    }
+    if (ar->next_sibling) {
+      ar->next_sibling->prev_sibling = ar->prev_sibling;
+    }
+  }
+
+  AU_AR_RecycleBlocks(ar, ar->blocks);
+  AU_AR_RecycleBlocks(ar, ar->free_blocks);
+  ar->blocks = 0;
+  ar->free_blocks = 0;
+}
+
+///////////////////////
+//// Arena Builder ////
+///////////////////////
+
+#ifndef NDEBUG
+
+#define ASSERT_VALID_ARB(ab) \
+  do { \
+    assert(ab); \
+    ASSERT_VALID_AR((ab)->ar); \
+    assert((ab)->mem); \
+    assert((ab)->used <= (ab)->cap); \
+  } while (0)
+
+#else
+
+#define ASSERT_VALID_ARB(ab)
+
+#endif
+
+// Whether the builder's memory is the arena's most recent allocation.
+static inline int
+AU_ARB_IsArenaTop(const AU_ArenaBuilder *ab) {
+  AU_Arena *ar = ab->ar;
+  return ab->mem >= AU_AR_BlockData(ar->blocks)
+         && ab->mem + ab->cap == ar->top;
+}
+
+int
+AU_ARB_Setup(AU_ArenaBuilder *ab, AU_Arena *ar, size_t cap) {
+  assert(ab);
+  ASSERT_VALID_AR(ar);
+  assert(cap > 0);
+
+  ab->ar = ar;
+  ab->used = 0;
+  ab->cap = cap;
+  ab->mem = AU_AR_Alloc(ar, cap);
+  if (!ab->mem) {
+    return AU_ERR_XMALLOC;
+  }
+  return 0;
+}
+
+/*
+ * Makes sure size more bytes fit. In place if the builder is at the top of
+ * the arena and the arena's current block has room (for doubling, or else
+ * for just what's needed). Otherwise, relocating within the arena.
+ */
+static int
+AU_ARB_EnsureRoom(AU_ArenaBuilder *ab, size_t size) {
+  if (ab->used > SIZE_MAX - size) {
+    ISSUE_ERROR(AU_ERR_OVERFLOW);
+    return AU_ERR_OVERFLOW;
+  }
+  size_t needed = ab->used + size;
+  if (needed <= ab->cap) {
+    return 0;
+  }
+  size_t new_cap = ab->cap > SIZE_MAX/2 ? SIZE_MAX : maxsz(ab->cap*2, needed);
+
+  AU_Arena *ar = ab->ar;
+  if (AU_ARB_IsArenaTop(ab)) {
+    size_t room = ab->cap + (size_t)(ar->end - ar->top);
+    if (room >= needed) {
+      new_cap = new_cap <= room ? new_cap : needed;
+      ar->top = ab->mem + new_cap;
+      ab->cap = new_cap;
+      return 0;
+    }
+  }
+
+  char *p = AU_AR_Alloc(ar, new_cap);
+  if (!p) {
+    return AU_ERR_XMALLOC;
+  }
+  memcpy(p, ab->mem, ab->used);
+  ab->mem = p;
+  ab->cap = new_cap;
+  return 0;
+}
+
+int
+AU_ARB_Append(AU_ArenaBuilder *ab, const void *mem, size_t size) {
+  ASSERT_VALID_ARB(ab);
+  assert(mem);
+
+  int res = AU_ARB_EnsureRoom(ab, size);
+  if (res < 0) {
+    return res;
+  }
+  memcpy(ab->mem + ab->used, mem, size);
+  ab->used += size;
+  return 0;
+}
+
+void *
+AU_ARB_AppendForSetup(AU_ArenaBuilder *ab, size_t size) {
+  ASSERT_VALID_ARB(ab);
+
+  if (AU_ARB_EnsureRoom(ab, size) < 0) {
+    return 0;
+  }
+  void *out_addr = ab->mem + ab->used;
+  ab->used += size;
+  return out_addr;
+}
+
+void *
+AU_ARB_GetMemory(const AU_ArenaBuilder *ab) {
+  ASSERT_VALID_ARB(ab);
+
+  return ab->mem;
+}
+
+void
+AU_ARB_DiscardAppends(AU_ArenaBuilder *ab) {
+  ASSERT_VALID_ARB(ab);
+
+  ab->used = 0;
+}
+
+void
+AU_ARB_DiscardLastBytes(AU_ArenaBuilder *ab, size_t n) {
+  ASSERT_VALID_ARB(ab);
+  assert(ab->used >= n);
+
+  ab->used -= n;
+}
+
+size_t
+AU_ARB_GetUsedCount(const AU_ArenaBuilder *ab) {
+  return ab->used;
+}
+
+void
+AU_ARB_Trim(AU_ArenaBuilder *ab) {
+  ASSERT_VALID_ARB(ab);
+
+  // Keeping at least a byte, so the builder still has some memory.
+  if (AU_ARB_IsArenaTop(ab) && ab->used > 0) {
+    ab->ar->top = ab->mem + ab->used;
+    ab->cap = ab->used;
+  }
+}
+
+////////////////////////
+//// Column Builder ////
+////////////////////////
+
+#ifndef NDEBUG
+
+#define ASSERT_VALID_COL(cb) \
+  do { \
+    assert(cb); \
+    assert((cb)->mem); \
+    assert((cb)->cols); \
+    assert((cb)->ncols > 0); \
+    assert((cb)->used <= (cb)->cap); \
+    assert((cb)->cap > 0); \
+  } while (0)
+
+#else
+
+#define ASSERT_VALID_COL(cb)
+
+#endif
+
+/*
+ * Lays out the columns for cap rows, storing their offsets, and returns the
+ * bytes they take (0 on overflow).
+ */
+static size_t
+AU_COL_Layout(struct AU_Column *cols, size_t ncols, size_t cap) {
+  size_t total = 0;
+  for (size_t i = 0; i < ncols; i++) {
+    if (cap > (SIZE_MAX - AU_COL_ALIGN)/cols[i].elt_size) {
+      return 0;
+    }
+    size_t bytes = AlignSize(cap*cols[i].elt_size, AU_COL_ALIGN);
+    if (bytes > SIZE_MAX - AU_COL_ALIGN - total) {
+      return 0;
+    }
+    cols[i].offset = total;
+    total += bytes;
+  }
+  return total;
+}
+
+/*
+ * Allocates memory for cap rows, with the columns aligned, and moves the used
+ * rows there.
+ */
+static int
+AU_COL_Resize(AU_ColumnBuilder *cb, size_t cap) {
+  struct AU_Column *old_cols = cb->cols + cb->ncols;
+  memcpy(old_cols, cb->cols, cb->ncols * sizeof *cb->cols);
+
+  size_t total = AU_COL_Layout(cb->cols, cb->ncols, cap);
+  if (total == 0) {
+    memcpy(cb->cols, old_cols, cb->ncols * sizeof *cb->cols);
+    ISSUE_ERROR(AU_ERR_OVERFLOW);
+    return AU_ERR_OVERFLOW;
+  }
+  void *mem = xmalloc(total + AU_COL_ALIGN - 1);
+  if (!mem) {
+    memcpy(cb->cols, old_cols, cb->ncols * sizeof *cb->cols);
+    ISSUE_ERROR(AU_ERR_XMALLOC);
+    return AU_ERR_XMALLOC;
+  }
+  char *base = (char*)mem
+               + (AU_COL_ALIGN - (uintptr_t)mem % AU_COL_ALIGN) % AU_COL_ALIGN;
+
+  if (cb->mem) {
+    for (size_t i = 0; i < cb->ncols; i++) {
+      memcpy(base + cb->cols[i].offset, cb->base + old_cols[i].offset,
+             cb->used*cb->cols[i].elt_size);
+    }
+    xfree(cb->mem);
+  }
+  cb->mem = mem;
+  cb->base = base;
+  cb->cap = cap;
+  return 0;
+}
+
+int
+AU_COL_Setup(AU_ColumnBuilder *cb,
+             const size_t *elt_sizes,
+             size_t ncols,
+             size_t cap) {
+  assert(cb);
+  assert(elt_sizes);
+  assert(ncols > 0);
+  assert(cap > 0);
+
+  // Twice the columns: the second half keeps the old layout while resizing.
+  if (ncols > SIZE_MAX/2/sizeof *cb->cols) {
+    ISSUE_ERROR(AU_ERR_OVERFLOW);
+    return AU_ERR_OVERFLOW;
+  }
+  cb->cols = xmalloc(2*ncols * sizeof *cb->cols);
+  if (!cb->cols) {
+    ISSUE_ERROR(AU_ERR_XMALLOC);
+    return AU_ERR_XMALLOC;
+  }
+  for (size_t i = 0; i < ncols; i++) {
+    assert(elt_sizes[i] > 0);
+    cb->cols[i].elt_size = elt_sizes[i];
+  }
+  cb->ncols = ncols;
+  cb->mem = 0;
+  cb->base = 0;
+  cb->used = 0;
+  cb->cap = 0;
+
+  int res = AU_COL_Resize(cb, cap);
+  if (res < 0) {
+    xfree(cb->cols);
+    return res;
+  }
+  ASSERT_VALID_COL(cb);
+  return 0;
+}
+
+/*
+ * Makes sure n more rows fit. All columns grow together, at least doubling.
+ */
+static int
+AU_COL_EnsureRoom(AU_ColumnBuilder *cb, size_t n) {
+  if (n <= cb->cap - cb->used) {
+    return 0;
+  }
+  if (cb->used > SIZE_MAX - n) {
+    ISSUE_ERROR(AU_ERR_OVERFLOW);
+    return AU_ERR_OVERFLOW;
+  }
+  size_t cap = cb->cap > SIZE_MAX/2
+               ? SIZE_MAX
+               : maxsz(cb->cap*2, cb->used + n);
+  return AU_COL_Resize(cb, cap);
+}
+
+int
+AU_COL_AppendRow(AU_ColumnBuilder *cb, const void *const *fields) {
+  ASSERT_VALID_COL(cb);
+  assert(fields);
+
+  int res = AU_COL_EnsureRoom(cb, 1);
+  if (res < 0) {
+    return res;
+  }
+  for (size_t i = 0; i < cb->ncols; i++) {
+    size_t elt_size = cb->cols[i].elt_size;
+    memcpy(cb->base + cb->cols[i].offset + cb->used*elt_size, fields[i],
+           elt_size);
+  }
+  cb->used++;
+  return 0;
+}
+
+int
+AU_COL_AppendColumns(AU_ColumnBuilder *cb, const void *const *cols, size_t n) {
+  ASSERT_VALID_COL(cb);
+  assert(cols);
+
+  int res = AU_COL_EnsureRoom(cb, n);
+  if (res < 0) {
+    return res;
+  }
+  for (size_t i = 0; i < cb->ncols; i++) {
+    size_t elt_size = cb->cols[i].elt_size;
+    memcpy(cb->base + cb->cols[i].offset + cb->used*elt_size, cols[i],
+           n*elt_size);
+  }
+  cb->used += n;
+  return 0;
+}
+
+int
+AU_COL_AppendForSetup(AU_ColumnBuilder *cb, size_t n, size_t *first) {
+  ASSERT_VALID_COL(cb);
+  assert(first);
+
+  int res = AU_COL_EnsureRoom(cb, n);
+  if (res < 0) {
+    return res;
+  }
+  *first = cb->used;
+  cb->used += n;
+  return 0;
+}
+
+void *
+AU_COL_GetColumn(const AU_ColumnBuilder *cb, size_t col) {
+  ASSERT_VALID_COL(cb);
+  assert(col < cb->ncols);
+
+  return cb->base + cb->cols[col].offset;
+}
+
+size_t
+AU_COL_GetUsedCount(const AU_ColumnBuilder *cb) {
+  return cb->used;
+}
+
+void
+AU_COL_DiscardAppends(AU_ColumnBuilder *cb) {
+  ASSERT_VALID_COL(cb);
+
+  cb->used = 0;
+}
+
+void
+AU_COL_DiscardLastRows(AU_ColumnBuilder *cb, size_t n) {
+  ASSERT_VALID_COL(cb);
+  assert(n <= cb->used);
 
-static inline size_t
-AlignSize(size_t n, size_t boundary) {
-  assert(boundary > 1);
-  assert(n <= SIZE_MAX - boundary + 1);
-  assert(n > 0);
-  return ((n - 1) + boundary)/boundary * boundary;
+  cb->used -= n;
 }
 
-#define PTR_SIZE_ALIGN AlignSize(sizeof (void*), ALIGNMENT_BOUNDARY)
+void
+AU_COL_Destroy(AU_ColumnBuilder *cb) {
+  ASSERT_VALID_COL(cb);
 
-static inline size_t
-maxsz(size_t a, size_t b) {
-  return a < b ? b : a;
+  xfree(cb->mem);
+  xfree(cb->cols);
+  cb->mem = 0;
+  cb->cols = 0;
 }
 
-//////////////////////
-//// BYTE Builder ////
-//////////////////////
+/////////////////////
+//// Paged Array ////
+/////////////////////
+
+enum {
+  // How many page addresses the directory starts with.
+  PA_INITIAL_PAGES = 8
+};
 
 #ifndef NDEBUG
 
-#define ASSERT_VALID_B1(b1) \
+#define ASSERT_VALID_PA(pa) \
   do { \
-    assert(b1); \
-    assert((b1)->mem); \
-    assert((b1)->used <= (b1)->cap); \
-    assert((b1)->cap > 0); \
+    assert(pa); \
+    assert((pa)->elt_size > 0); \
+    assert((pa)->used <= AU_PA_GetPageCount(pa) << (pa)->page_shift); \
   } while (0)
 
 #else
 
-#define ASSERT_VALID_B1(b1)
+#define ASSERT_VALID_PA(pa)
 
 #endif
 
 int
-AU_B1_Setup(AU_ByteBuilder *b1, size_t cap) {
-  assert(cap > 0);
+AU_PA_Setup(AU_PagedArray *pa, size_t elt_size, size_t page_cap) {
+  assert(pa);
+  assert(elt_size > 0);
+  assert(page_cap > 0 && (page_cap & (page_cap - 1)) == 0);
 
-  b1->cap = cap;
-  b1->used = 0;
-  b1->mem = xmalloc(cap);
-  if (!b1->mem) {
-    ISSUE_ERROR(AU_ERR_XMALLOC);
-    return AU_ERR_XMALLOC;
+  if (page_cap > SIZE_MAX/elt_size) {
+    ISSUE_ERROR(AU_ERR_OVERFLOW);
+    return AU_ERR_OVERFLOW;
+  }
+  int res = AU_FSB_Setup(&pa->dir, sizeof (void*), PA_INITIAL_PAGES);
+  if (res < 0) {
+    return res;
+  }
+  pa->elt_size = elt_size;
+  pa->used = 0;
+  pa->page_shift = FloorLog2(page_cap);
+  ASSERT_VALID_PA(pa);
+  return 0;
+}
+
+/*
+ * Makes sure there are pages for the next n elements (n > 0). Pages that were
+ * added before a failure stay, past the used elements, for later appends.
+ */
+static int
+AU_PA_EnsurePages(AU_PagedArray *pa, size_t n) {
+  size_t needed = ((pa->used + n - 1) >> pa->page_shift) + 1;
+  for (size_t npages = AU_PA_GetPageCount(pa); npages < needed; npages++) {
+    void *page = xmalloc(pa->elt_size << pa->page_shift);
+    if (!page) {
+      ISSUE_ERROR(AU_ERR_XMALLOC);
+      return AU_ERR_XMALLOC;
+    }
+    int res = AU_FSB_Append(&pa->dir, &page, 1);
+    if (res < 0) {
+      xfree(page);
+      return res;
+    }
+    AU_PROBE3(pa__page, pa, npages, page);
   }
-  ASSERT_VALID_B1(b1);
   return 0;
 }
 
 int
-AU_B1_Append(AU_ByteBuilder *b1, const void *mem, size_t size) {
-  ASSERT_VALID_B1(b1);
-  assert(mem);
+AU_PA_Append(AU_PagedArray *pa, const void *mem, size_t n) {
+  ASSERT_VALID_PA(pa);
+  assert(mem || n == 0);
 
-  void *out_addr = AU_B1_AppendForSetup(b1, size);
-  if (!out_addr) {
-    return -1;
+  if (n == 0) {
+    return 0;
+  }
+  if (n > SIZE_MAX - pa->used) {
+    ISSUE_ERROR(AU_ERR_OVERFLOW);
+    return AU_ERR_OVERFLOW;
+  }
+  // All the pages first, so it's all or nothing.
+  int res = AU_PA_EnsurePages(pa, n);
+  if (res < 0) {
+    return res;
+  }
+  const char *src = mem;
+  size_t page_cap = (size_t)1 << pa->page_shift;
+  while (n > 0) {
+    size_t in_page = pa->used & (page_cap - 1);
+    size_t k = page_cap - in_page < n ? page_cap - in_page : n;
+    memcpy(AU_PA_Get(pa, pa->used), src, k*pa->elt_size);
+    src += k*pa->elt_size;
+    pa->used += k;
+    n -= k;
   }
-  memcpy(out_addr, mem, size);
   return 0;
 }
 
 void *
-AU_B1_AppendForSetup(AU_ByteBuilder *b1, size_t size) {
-  ASSERT_VALID_B1(b1);
+AU_PA_AppendForSetup(AU_PagedArray *pa) {
+  ASSERT_VALID_PA(pa);
 
-  if (b1->used > SIZE_MAX - size) {
+  if (pa->used == SIZE_MAX) {
     ISSUE_ERROR(AU_ERR_OVERFLOW);
     return 0;
   }
-  if (b1->used + size > b1->cap) {
-    if (b1->cap == SIZE_MAX || b1->cap > SIZE_MAX - size) {
-      // This seems so absurd...
-      ISSUE_ERROR(AU_ERR_OVERFLOW);
-      return 0;
-    }
-    size_t new_cap = b1->cap > SIZE_MAX/2
-                     ? SIZE_MAX
-                     : maxsz(b1->cap*2, size);
-    void *p = xrealloc(b1->mem, new_cap);
-    if (!p) {
-      ISSUE_ERROR(AU_ERR_XREALLOC);
-      return 0;
-    }
-    b1->mem = p;
-    b1->cap = new_cap;
+  if (AU_PA_EnsurePages(pa, 1) < 0) {
+    return 0;
   }
-  void *out_addr = (char*)b1->mem + b1->used;
-  b1->used += size;
-  return out_addr;
+  return AU_PA_Get(pa, pa->used++);
 }
 
 void *
-AU_B1_GetMemory(const AU_ByteBuilder *b1) {
-  ASSERT_VALID_B1(b1);
+AU_PA_GetPage(const AU_PagedArray *pa, size_t k, size_t *count) {
+  ASSERT_VALID_PA(pa);
+  assert(k < AU_PA_GetPageCount(pa));
+  assert(count);
+
+  size_t first = k << pa->page_shift;
+  size_t page_cap = (size_t)1 << pa->page_shift;
+  *count = pa->used <= first ? 0
+           : pa->used - first < page_cap ? pa->used - first
+           : page_cap;
+  return ((void**)pa->dir.b1.mem)[k];
+}
 
-  return b1->mem;
+size_t
+AU_PA_GetPageCount(const AU_PagedArray *pa) {
+  return pa->dir.b1.used / sizeof (void*);
+}
+
+size_t
+AU_PA_GetUsedCount(const AU_PagedArray *pa) {
+  return pa->used;
 }
 
 void
-AU_B1_DiscardAppends(AU_ByteBuilder *b1) {
-  ASSERT_VALID_B1(b1);
+AU_PA_DiscardAppends(AU_PagedArray *pa) {
+  ASSERT_VALID_PA(pa);
 
-  b1->used = 0;
+  pa->used = 0;
 }
 
 void
-AU_B1_DiscardLastBytes(AU_ByteBuilder *b1, size_t n) {
-  ASSERT_VALID_B1(b1);
-  assert(b1->used >= n);
+AU_PA_DiscardLastAppends(AU_PagedArray *pa, size_t n) {
+  ASSERT_VALID_PA(pa);
+  assert(n <= pa->used);
 
-  b1->used -= n;
+  pa->used -= n;
 }
 
-size_t
-AU_B1_GetUsedCount(AU_ByteBuilder *b1) {
-  return b1->used;
+void
+AU_PA_Destroy(AU_PagedArray *pa) {
+  ASSERT_VALID_PA(pa);
+
+  void **pages = AU_FSB_GetMemory(&pa->dir);
+  size_t npages = AU_PA_GetPageCount(pa);
+  for (size_t k = 0; k < npages; k++) {
+    xfree(pages[k]);
+  }
+  AU_FSB_Destroy(&pa->dir);
 }
 
-////////////////////////////
-//// Fixed Size Builder ////
-////////////////////////////
+////////////////////
+//// Record Log ////
+////////////////////
+
+// Marks the checkpoints of groups kept in the wide offsets.
+static const uint64_t RL_WIDE = (uint64_t)1 << 63;
+
+enum {
+  RL_GROUP_MASK = AU_RL_GROUP - 1,
+  RL_MAX_DELTA = UINT16_MAX
+};
 
 #ifndef NDEBUG
 
-#define ASSERT_VALID_FSB(fsb) \
+#define ASSERT_VALID_RL(rl) \
   do { \
-    assert(fsb); \
-    assert((fsb)->elt_size > 0); \
-    assert((fsb)->elt_size <= SIZE_MAX / (fsb)->b1.cap); \
-    ASSERT_VALID_B1(&(fsb)->b1); \
+    assert(rl); \
+    assert((rl)->index == AU_RL_INDEX_U32 \
+           || (rl)->index == AU_RL_INDEX_U64 \
+           || (rl)->index == AU_RL_INDEX_DELTA); \
   } while (0)
 
 #else
 
-#define ASSERT_VALID_FSB(fsb)
+#define ASSERT_VALID_RL(rl)
 
 #endif
 
-int
-AU_FSB_Setup(AU_FixedSizeBuilder *fsb, size_t elt_size, size_t cap) {
-  assert(cap > 0);
-  assert(elt_size > 0);
-  assert(cap <= SIZE_MAX/elt_size);
-
-  int b1_res = AU_B1_Setup(&fsb->b1, elt_size*cap);
-  if (b1_res < 0) {
-    return b1_res;
+/*
+ * The offset where record i starts, for i up to the record count (which gives
+ * the end of the last record).
+ */
+static inline uint64_t
+AU_RL_Start(const AU_RecordLog *rl, size_t i) {
+  const void *offsets = rl->offsets.b1.mem;
+  switch (rl->index) {
+  case AU_RL_INDEX_U32:
+    return ((const uint32_t*)offsets)[i];
+  case AU_RL_INDEX_U64:
+    return ((const uint64_t*)offsets)[i];
+  default:
+    break;
   }
-  fsb->elt_size = elt_size;
+  if (i == rl->count) {
+    return rl->data.used;
+  }
+  uint64_t cp = ((const uint64_t*)offsets)[i >> AU_RL_GROUP_SHIFT];
+  if (cp & RL_WIDE) {
+    const uint64_t *wide = rl->wide.b1.mem;
+    return wide[(cp & ~RL_WIDE) + (i & RL_GROUP_MASK)];
+  }
+  return cp + ((const uint16_t*)rl->deltas.b1.mem)[i];
+}
 
-  ASSERT_VALID_FSB(fsb);
+/*
+ * Indexes a new record, which takes [start, end) in the data. Either it's
+ * indexed, or nothing changes.
+ */
+static int
+AU_RL_AddRecord(AU_RecordLog *rl, uint64_t start, uint64_t end) {
+  if (rl->index == AU_RL_INDEX_U32) {
+    if (end > UINT32_MAX) {
+      ISSUE_ERROR(AU_ERR_OVERFLOW);
+      return AU_ERR_OVERFLOW;
+    }
+    uint32_t off = (uint32_t)end;
+    int res = AU_FSB_Append(&rl->offsets, &off, 1);
+    if (res < 0) {
+      return res;
+    }
+    rl->count++;
+    return 0;
+  }
+  if (rl->index == AU_RL_INDEX_U64) {
+    int res = AU_FSB_Append(&rl->offsets, &end, 1);
+    if (res < 0) {
+      return res;
+    }
+    rl->count++;
+    return 0;
+  }
 
+  // All the room that may be needed is made first, so that nothing can fail
+  // once changes begin.
+  size_t j = rl->count & RL_GROUP_MASK;
+  int res = AU_FSB_MakeRoom(&rl->deltas, 1);
+  if (res < 0) {
+    return res;
+  }
+  uint16_t delta = 0;
+  if (j == 0) {
+    res = AU_FSB_Append(&rl->offsets, &start, 1);
+    if (res < 0) {
+      return res;
+    }
+  } else {
+    uint64_t *cp = (uint64_t*)AU_FSB_GetMemory(&rl->offsets)
+                   + (rl->count >> AU_RL_GROUP_SHIFT);
+    if (*cp & RL_WIDE) {
+      uint64_t *wide = AU_FSB_GetMemory(&rl->wide);
+      wide[(*cp & ~RL_WIDE) + j] = start;
+    } else if (start - *cp <= RL_MAX_DELTA) {
+      delta = (uint16_t)(start - *cp);
+    } else {
+      // The group outgrew its deltas: it moves to the wide offsets.
+      res = AU_FSB_MakeRoom(&rl->wide, AU_RL_GROUP);
+      if (res < 0) {
+        return res;
+      }
+      size_t w = AU_FSB_GetUsedCount(&rl->wide);
+      uint64_t *wide = AU_FSB_AppendForSetup(&rl->wide, AU_RL_GROUP);
+      const uint16_t *deltas = AU_FSB_GetMemory(&rl->deltas);
+      for (size_t k = 0; k < j; k++) {
+        wide[k] = *cp + deltas[rl->count - j + k];
+      }
+      wide[j] = start;
+      *cp = (uint64_t)w | RL_WIDE;
+    }
+  }
+  AU_FSB_Append(&rl->deltas, &delta, 1);
+  rl->count++;
   return 0;
 }
 
 int
-AU_FSB_Append(AU_FixedSizeBuilder *fsb, const void *mem, size_t n) {
-  ASSERT_VALID_FSB(fsb);
-  assert(mem);
+AU_RL_Setup(AU_RecordLog *rl,
+            enum AU_RecordIndex index,
+            size_t cap,
+            size_t nrecs) {
+  assert(rl);
+  assert(cap > 0);
+  assert(nrecs > 0);
 
-  if (n != 0 && fsb->elt_size > SIZE_MAX/n) {
-    ISSUE_ERROR(AU_ERR_OVERFLOW);
-    return AU_ERR_OVERFLOW;
+  rl->index = index;
+  rl->count = 0;
+  int res = AU_B1_Setup(&rl->data, cap);
+  if (res < 0) {
+    return res;
+  }
+  if (index != AU_RL_INDEX_DELTA) {
+    size_t elt_size = index == AU_RL_INDEX_U32 ? 4 : 8;
+    uint64_t zero64 = 0;
+    uint32_t zero32 = 0;
+    res = AU_FSB_Setup(&rl->offsets, elt_size, nrecs + 1);
+    if (res == 0) {
+      res = AU_FSB_Append(&rl->offsets,
+                          elt_size == 4 ? (void*)&zero32 : (void*)&zero64,
+                          1);
+      if (res < 0) {
+        AU_FSB_Destroy(&rl->offsets);
+      }
+    }
+  } else {
+    res = AU_FSB_Setup(&rl->offsets, 8, nrecs/AU_RL_GROUP + 1);
+    if (res == 0) {
+      res = AU_FSB_Setup(&rl->deltas, 2, nrecs);
+      if (res < 0) {
+        AU_FSB_Destroy(&rl->offsets);
+      }
+    }
+    if (res == 0) {
+      res = AU_FSB_Setup(&rl->wide, 8, AU_RL_GROUP);
+      if (res < 0) {
+        AU_FSB_Destroy(&rl->offsets);
+        AU_FSB_Destroy(&rl->deltas);
+      }
+    }
   }
-
-  int res = AU_B1_Append(&fsb->b1, mem, n*fsb->elt_size);
   if (res < 0) {
+    AU_B1_Destroy(&rl->data);
     return res;
   }
+  ASSERT_VALID_RL(rl);
   return 0;
 }
 
-void *
-AU_FSB_AppendForSetup(AU_FixedSizeBuilder *fsb, size_t n) {
-  ASSERT_VALID_FSB(fsb);
-
-  if (n != 0 && fsb->elt_size > SIZE_MAX/n) {
-    ISSUE_ERROR(AU_ERR_OVERFLOW);
-    return 0;
+/*
+ * Appends and indexes a record of len bytes, storing its address in *rec.
+ */
+static int
+AU_RL_Push(AU_RecordLog *rl, size_t len, void **rec) {
+  int res = AU_B1_MakeRoom(&rl->data, len);
+  if (res < 0) {
+    return res;
   }
-  void *mem = AU_B1_AppendForSetup(&fsb->b1, n*fsb->elt_size);
-  if (!mem) {
-    return 0;
+  size_t start = rl->data.used;
+  *rec = AU_B1_AppendForSetup(&rl->data, len);
+  res = AU_RL_AddRecord(rl, start, (uint64_t)start + len);
+  if (res < 0) {
+    AU_B1_DiscardLastBytes(&rl->data, len);
   }
-  return mem;
+  return res;
 }
 
-void *
-AU_FSB_GetMemory(AU_FixedSizeBuilder *fsb) {
-  ASSERT_VALID_FSB(fsb);
+int
+AU_RL_Append(AU_RecordLog *rl, const void *rec, size_t len) {
+  ASSERT_VALID_RL(rl);
+  assert(rec || len == 0);
 
-  return AU_B1_GetMemory(&fsb->b1);
+  void *p;
+  int res = AU_RL_Push(rl, len, &p);
+  if (res < 0) {
+    return res;
+  }
+  memcpy(p, rec, len);
+  return 0;
 }
 
-void
-AU_FSB_DiscardAppends(AU_FixedSizeBuilder *fsb) {
-  ASSERT_VALID_FSB(fsb);
+void *
+AU_RL_AppendForSetup(AU_RecordLog *rl, size_t len) {
+  ASSERT_VALID_RL(rl);
 
-  AU_B1_DiscardAppends(&fsb->b1);
+  void *rec;
+  return AU_RL_Push(rl, len, &rec) < 0 ? 0 : rec;
 }
 
-void
-AU_FSB_DiscardLastAppends(AU_FixedSizeBuilder *fsb, size_t n) {
-  ASSERT_VALID_FSB(fsb);
-  assert(n == 0 || fsb->elt_size <= SIZE_MAX/n);
-  assert(fsb->b1.used/fsb->elt_size >= n);
+int
+AU_RL_AppendBatch(AU_RecordLog *rl,
+                  const void *recs,
+                  const size_t *lens,
+                  size_t n) {
+  ASSERT_VALID_RL(rl);
+  assert(lens || n == 0);
+
+  size_t total = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (lens[i] > SIZE_MAX - total) {
+      ISSUE_ERROR(AU_ERR_OVERFLOW);
+      return AU_ERR_OVERFLOW;
+    }
+    total += lens[i];
+  }
+  int res = AU_B1_MakeRoom(&rl->data, total);
+  if (res < 0) {
+    return res;
+  }
+  if (rl->index == AU_RL_INDEX_DELTA) {
+    res = AU_FSB_MakeRoom(&rl->deltas, n);
+    if (res == 0) {
+      res = AU_FSB_MakeRoom(&rl->offsets, n/AU_RL_GROUP + 1);
+    }
+  } else {
+    res = AU_FSB_MakeRoom(&rl->offsets, n);
+  }
+  if (res < 0) {
+    return res;
+  }
 
-  AU_B1_DiscardLastBytes(&fsb->b1, n*fsb->elt_size);
+  const char *src = recs;
+  for (size_t i = 0; i < n; i++) {
+    void *rec;
+    res = AU_RL_Push(rl, lens[i], &rec);
+    if (res < 0) {
+      AU_RL_DiscardLastRecords(rl, i);
+      return res;
+    }
+    memcpy(rec, src, lens[i]);
+    src += lens[i];
+  }
+  return 0;
 }
 
-size_t
-AU_FSB_GetUsedCount(AU_FixedSizeBuilder *fsb) {
-  return fsb->b1.used/fsb->elt_size;
+void *
+AU_RL_Get(const AU_RecordLog *rl, size_t i, size_t *len) {
+  ASSERT_VALID_RL(rl);
+  assert(i < rl->count);
+  assert(len);
+
+  uint64_t start = AU_RL_Start(rl, i);
+  *len = (size_t)(AU_RL_Start(rl, i + 1) - start);
+  return (char*)rl->data.mem + start;
 }
 
-///////////////////////////////
-//// Variable Size Builder ////
-///////////////////////////////
-
-int
-AU_VSB_Setup(AU_VarSizeBuilder *vsb, size_t cap, size_t align) {
-  vsb->align = align == AU_ALIGN_CONSERVATIVE ? ALIGNMENT_BOUNDARY : align;
-  return AU_B1_Setup(&vsb->b1, AlignSize(cap, vsb->align));
+size_t
+AU_RL_GetCount(const AU_RecordLog *rl) {
+  return rl->count;
 }
 
-int
-AU_VSB_Append(AU_VarSizeBuilder *vsb, const void *mem, size_t n) {
-  return AU_B1_Append(&vsb->b1, mem, AlignSize(n, vsb->align));
+size_t
+AU_RL_GetDataSize(const AU_RecordLog *rl) {
+  return rl->data.used;
 }
 
-void *
-AU_VSB_AppendForSetup(AU_VarSizeBuilder *vsb, size_t n) {
-  return AU_B1_AppendForSetup(&vsb->b1, AlignSize(n, vsb->align));
+size_t
+AU_RL_GetIndexSize(const AU_RecordLog *rl) {
+  ASSERT_VALID_RL(rl);
+
+  size_t size = rl->offsets.b1.used;
+  if (rl->index == AU_RL_INDEX_DELTA) {
+    size += rl->deltas.b1.used + rl->wide.b1.used;
+  }
+  return size;
 }
 
-void *
-AU_VSB_GetMemory(AU_VarSizeBuilder *vsb) {
-  return AU_B1_GetMemory(&vsb->b1);
+void
+AU_RL_DiscardAppends(AU_RecordLog *rl) {
+  ASSERT_VALID_RL(rl);
+
+  AU_RL_DiscardLastRecords(rl, rl->count);
 }
 
 void
-AU_VSB_DiscardAppends(AU_VarSizeBuilder *vsb) {
-  AU_B1_DiscardAppends(&vsb->b1);
+AU_RL_DiscardLastRecords(AU_RecordLog *rl, size_t n) {
+  ASSERT_VALID_RL(rl);
+  assert(n <= rl->count);
+
+  size_t count = rl->count - n;
+  AU_B1_DiscardLastBytes(&rl->data,
+                         rl->data.used - (size_t)AU_RL_Start(rl, count));
+  if (rl->index != AU_RL_INDEX_DELTA) {
+    AU_FSB_DiscardLastAppends(&rl->offsets, n);
+    rl->count = count;
+    return;
+  }
+
+  // Wide groups are in group order, so the first wide group discarded marks
+  // where the wide offsets of the groups kept end.
+  size_t groups = (count + RL_GROUP_MASK) >> AU_RL_GROUP_SHIFT;
+  size_t old_groups = AU_FSB_GetUsedCount(&rl->offsets);
+  const uint64_t *cps = AU_FSB_GetMemory(&rl->offsets);
+  for (size_t g = groups; g < old_groups; g++) {
+    if (cps[g] & RL_WIDE) {
+      size_t w = (size_t)(cps[g] & ~RL_WIDE);
+      AU_FSB_DiscardLastAppends(&rl->wide, AU_FSB_GetUsedCount(&rl->wide) - w);
+      break;
+    }
+  }
+  AU_FSB_DiscardLastAppends(&rl->offsets, old_groups - groups);
+  AU_FSB_DiscardLastAppends(&rl->deltas, n);
+  rl->count = count;
 }
 
-size_t
-AU_VSB_GetUsedCount(AU_VarSizeBuilder *vsb) {
-  return AU_B1_GetUsedCount(&vsb->b1);
+void
+AU_RL_Destroy(AU_RecordLog *rl) {
+  ASSERT_VALID_RL(rl);
+
+  AU_B1_Destroy(&rl->data);
+  AU_FSB_Destroy(&rl->offsets);
+  if (rl->index == AU_RL_INDEX_DELTA) {
+    AU_FSB_Destroy(&rl->deltas);
+    AU_FSB_Destroy(&rl->wide);
+  }
 }
 
 //////////////////////////////
@@ -327,19 +2358,29 @@ AU_FSA_Expand(AU_FixedSizeAllocator *fsa, size_t new_cap) {
     return AU_ERR_OVERFLOW;
   }
 
-  char *mem = xmalloc(node_alsize*new_cap);
+  size_t region_bytes = node_alsize*new_cap;
+  int res = AU_BL_Charge(&fsa->bl, region_bytes);
+  if (res < 0) {
+    return res;
+  }
+
+  char *mem = xmalloc(region_bytes);
   if (!mem) {
+    AU_BL_Refund(&fsa->bl, region_bytes);
     ISSUE_ERROR(AU_ERR_XMALLOC);
     return AU_ERR_XMALLOC;
   }
+  AU_PROBE4(fsa__expand, fsa, new_cap, region_bytes, mem);
 
   // Appending the pointer into fsb_base_ptrs so we remember it later when
   // we need to destroy this allocator.
-  int res = AU_FSB_Append(&fsa->fsb_base_ptrs, &mem, 1);
+  res = AU_FSB_Append(&fsa->fsb_base_ptrs, &mem, 1);
   if (res < 0) {
     xfree(mem);
+    AU_BL_Refund(&fsa->bl, region_bytes);
     return res;
   }
+  fsa->region_bytes += region_bytes;
 
   // Set up the free list. Make each node point to the next. Last node will
   // point to the old head.
@@ -357,6 +2398,7 @@ AU_FSA_Expand(AU_FixedSizeAllocator *fsa, size_t new_cap) {
 
 int
 AU_FSA_Setup(AU_FixedSizeAllocator *fsa, size_t elt_size, size_t cap) {
+  assert(PTR_SIZE_ALIGN == AU_FSA_NODE_HEADER);
   assert(cap > 0);
   assert(elt_size > 0);
   assert(cap <= SIZE_MAX/elt_size);
@@ -365,6 +2407,9 @@ AU_FSA_Setup(AU_FixedSizeAllocator *fsa, size_t elt_size, size_t cap) {
   fsa->total_cap = 0;
   fsa->elt_size = elt_size;
   fsa->free_head = 0;
+  fsa->region_bytes = 0;
+  AU_BL_Init(&fsa->bl);
+  AU_PROBE3(fsa__setup, fsa, elt_size, cap);
 
   int res = AU_FSB_Setup(&fsa->fsb_base_ptrs,
                          sizeof (void*),
@@ -392,11 +2437,13 @@ AU_FSA_Alloc(AU_FixedSizeAllocator *fsa) {
   void *new_free_head = *(void**)free_head;
   void *out = free_head + PTR_SIZE_ALIGN;
   fsa->free_head = new_free_head;
+  AU_PROBE2(fsa__alloc, fsa, out);
   return out;
 }
 
 void
 AU_FSA_Free(AU_FixedSizeAllocator *fsa, void *mem) {
+  AU_PROBE2(fsa__free, fsa, mem);
   void *node = (char*)mem - PTR_SIZE_ALIGN;
   *(void**)node = fsa->free_head;
   fsa->free_head = node;
@@ -406,8 +2453,15 @@ void
 AU_FSA_Destroy(AU_FixedSizeAllocator *fsa) {
   void **regions = AU_FSB_GetMemory(&fsa->fsb_base_ptrs);
   size_t used = AU_FSB_GetUsedCount(&fsa->fsb_base_ptrs);
+  AU_PROBE3(fsa__destroy, fsa, fsa->total_cap, used);
   for (size_t i = 0; i < used; i++) {
     xfree(regions[i]);
   }
   xfree(regions);
+  AU_BL_Release(&fsa->bl);
+}
+
+int
+AU_FSA_SetBudget(AU_FixedSizeAllocator *fsa, AU_Budget *bdg) {
+  return AU_BL_Attach(&fsa->bl, bdg, fsa->region_bytes);
 }
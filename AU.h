@@ -14,19 +14,174 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include <limits.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 enum {
   AU_ERR_XMALLOC = INT_MIN,
   AU_ERR_XREALLOC,
   AU_ERR_XCALLOC,
-  AU_ERR_OVERFLOW
+  AU_ERR_OVERFLOW,
+  AU_ERR_BUDGET,
+  AU_ERR_DECODE,
+  AU_ERR_SPILL,
+  AU_ERR_IO,
+  AU_ERR_ELT_SIZE
 };
 
 enum {
   AU_ALIGN_CONSERVATIVE = 0
 };
 
+// From <sys/uio.h>, for the scatter/gather appends.
+struct iovec;
+
+// From AUChecksum.h, for builders with checksums attached.
+struct AU_Checksum;
+
+/*
+ * The conservative alignment boundary is the size of this union (check the
+ * README). It's only here for the type specialized functions at the end of
+ * this file, which need to know the FSA node layout.
+ */
+union AU_AlignmentType {
+  int i;
+  long l;
+  long long ll;
+  void *vp;
+  void (*funp)(void);
+  float f;
+  double d;
+  long double ld;
+  float *fp;
+  double *dp;
+  long double *ldp;
+};
+
+////////////////
+//// Budget ////
+////////////////
+
+typedef struct AU_Budget AU_Budget;
+
+/**
+ * A pressure callback is called when growing an instance would go over its
+ * budget. The needed parameter tells how many bytes the growth is short of.
+ *
+ * Return non zero if you gave memory back to the budget (e.g. trimmed a cache,
+ * destroyed some allocator attached to it), in which case the growth is tried
+ * again. Return 0 to let it fail with AU_ERR_BUDGET.
+ *
+ * Instances attached to the same budget can live in different threads, so
+ * the callback may be called from any of them, concurrently.
+ */
+typedef int (*AU_PressureFn)(AU_Budget *bdg, size_t needed, void *ctx);
+
+struct AU_Budget {
+  size_t limit;
+
+  // Bytes charged against the limit. Updated atomically, since instances in
+  // different threads can share a budget.
+  size_t used;
+
+  // How much an instance takes from the budget at once to build up its
+  // credit.
+  size_t credit_chunk;
+
+  AU_PressureFn pressure;
+  void *ctx;
+};
+
+/*
+ * Instances attached to a budget take bytes from it in chunks, and keep what
+ * they didn't use yet as credit. Most growths are then paid from the credit,
+ * and only touch the (shared) budget when the credit runs out.
+ */
+struct AU_BudgetLink {
+  AU_Budget *bdg;
+
+  // Bytes taken from bdg that the instance is holding, used or not.
+  size_t charged;
+
+  // The part of charged not backing any memory yet.
+  size_t credit;
+};
+
+/**
+ * Sets up a budget of limit bytes. The pressure callback is optional (pass a
+ * null pointer). ctx is handed to it as is.
+ */
+int
+AU_BDG_Setup(AU_Budget *bdg,
+             size_t limit,
+             AU_PressureFn pressure,
+             void *ctx);
+
+/**
+ * Gives n bytes back to the budget. Meant for pressure callbacks and for
+ * users who charged the budget on their own.
+ */
+void
+AU_BDG_Return(AU_Budget *bdg, size_t n);
+
+/**
+ * Takes n bytes from the budget, calling the pressure callback if needed.
+ * Returns AU_ERR_BUDGET if they're not available.
+ */
+int
+AU_BDG_Charge(AU_Budget *bdg, size_t n);
+
+size_t
+AU_BDG_GetUsed(AU_Budget *bdg);
+
+////////////////////
+//// Size Hints ////
+////////////////////
+
+/**
+ * A size hint learns what capacity builders set up from one place in your
+ * code (a call site) end up needing. Define one per call site, with static
+ * storage duration:
+ *
+ *   static AU_SizeHint hint = AU_SIZE_HINT_INIT;
+ *   AU_B1_SetupHinted(&b1, &hint, 64);
+ *   ... appends ...
+ *   AU_B1_RecordHint(&hint, &b1);
+ *
+ * The hint keeps a running estimate of the 90th percentile of the recorded
+ * sizes, which adapts as they change. So most builders from that call site
+ * never grow, and the few large ones don't inflate all the others.
+ *
+ * Hints can be shared by threads. Concurrent records may get lost, which only
+ * makes the hint learn a bit slower.
+ */
+struct AU_SizeHint {
+  // Estimated size, in bytes. Zero until something is recorded.
+  size_t estimate;
+};
+
+typedef struct AU_SizeHint AU_SizeHint;
+
+#define AU_SIZE_HINT_INIT {0}
+
+/**
+ * The capacity in bytes to set up with: the hint's estimate, or fallback if
+ * nothing was recorded yet.
+ */
+size_t
+AU_SH_Suggest(const AU_SizeHint *hint, size_t fallback);
+
+/**
+ * Records the final size in bytes of something set up after this hint.
+ */
+void
+AU_SH_Record(AU_SizeHint *hint, size_t size);
+
 //////////////////////
 //// BYTE Builder ////
 //////////////////////
@@ -34,6 +189,9 @@ enum {
 struct AU_ByteBuilder {
   void *mem;
   size_t used, cap;
+  struct AU_BudgetLink bl;
+  struct AU_Checksum *sum;
+  struct AU_Spill *spill;
 };
 
 typedef struct AU_ByteBuilder AU_ByteBuilder;
@@ -59,6 +217,177 @@ AU_B1_DiscardLastBytes(AU_ByteBuilder *b1, size_t n);
 size_t
 AU_B1_GetUsedCount(AU_ByteBuilder *b1);
 
+/**
+ * Attaches the builder to a budget. The memory the builder currently holds is
+ * charged right away, and growing it from then on is charged as well. If that
+ * isn't possible, AU_ERR_BUDGET is returned and nothing changes.
+ *
+ * The budget isn't told when you free the builder's memory (you're the one
+ * doing it). Call AU_B1_ReleaseBudget before freeing it, or before handing
+ * the memory over to whatever will free it.
+ */
+int
+AU_B1_SetBudget(AU_ByteBuilder *b1, AU_Budget *bdg);
+
+/**
+ * Gives back to the budget everything the builder has charged to it and
+ * detaches the builder from it.
+ */
+void
+AU_B1_ReleaseBudget(AU_ByteBuilder *b1);
+
+/**
+ * Each thread keeps a small cache (the pool) of retired builder buffers,
+ * bucketed by power of two capacities.
+ *
+ * AU_B1_SetupFromPool works like AU_B1_Setup, but takes a buffer of at least
+ * cap bytes from the calling thread's pool if there is one, and only calls
+ * xmalloc otherwise.
+ *
+ * AU_B1_Release gives the builder's memory back to the calling thread's pool
+ * (or to xfree, if its bucket is full), instead of you calling free on it.
+ * Any builder can be released, set up from the pool or not, and its budget
+ * (if any) is released as well. The builder has to be set up again to be used
+ * after that.
+ *
+ * AU_B1_TrimPool frees all the buffers in the calling thread's pool. Call it
+ * before threads that used the pool exit, or their buffers leak.
+ */
+int
+AU_B1_SetupFromPool(AU_ByteBuilder *b1, size_t cap);
+
+void
+AU_B1_Release(AU_ByteBuilder *b1);
+
+void
+AU_B1_TrimPool(void);
+
+/**
+ * Appends n fragments at once, as if appending each one in turn. The capacity
+ * is checked (and grown) once for all of them.
+ */
+int
+AU_B1_AppendV(AU_ByteBuilder *b1, const struct iovec *iov, int n);
+
+/**
+ * Back patching, for when something you have to write before some data (e.g.
+ * a length prefix) is only known after that data is written.
+ *
+ * AU_B1_Reserve appends n bytes to be filled in later, and stores their offset
+ * in *offset. Offsets stay valid across appends, unlike addresses. Fill them
+ * in with the Patch calls, which write little endian integers at an offset.
+ */
+int
+AU_B1_Reserve(AU_ByteBuilder *b1, size_t n, size_t *offset);
+
+void
+AU_B1_PatchU32(AU_ByteBuilder *b1, size_t offset, uint32_t v);
+
+void
+AU_B1_PatchU64(AU_ByteBuilder *b1, size_t offset, uint64_t v);
+
+/**
+ * Varint (unsigned LEB128) length prefixes. Begin before appending the body,
+ * keeping the mark it gives you, and End after it. End then puts the length
+ * of everything appended in between in front of it, as a varint.
+ *
+ * A byte is reserved at Begin, so bodies shorter than 128 bytes don't move.
+ * Longer ones are moved once, at End, by the extra bytes of the prefix.
+ * Prefixes can be nested, as long as the inner ones are ended first. If End
+ * fails to make room for a longer prefix, nothing changes.
+ */
+int
+AU_B1_BeginVarintPrefix(AU_ByteBuilder *b1, size_t *mark);
+
+int
+AU_B1_EndVarintPrefix(AU_ByteBuilder *b1, size_t mark);
+
+/**
+ * AU_B1_Setup with the capacity the hint suggests, cap being what to use
+ * until the hint has learned something. Record the size the builder ended up
+ * with through AU_B1_RecordHint (before you free it).
+ */
+int
+AU_B1_SetupHinted(AU_ByteBuilder *b1, AU_SizeHint *hint, size_t cap);
+
+void
+AU_B1_RecordHint(AU_SizeHint *hint, AU_ByteBuilder *b1);
+
+/**
+ * Grows the builder, if needed, so that appending n more bytes won't have to.
+ */
+int
+AU_B1_MakeRoom(AU_ByteBuilder *b1, size_t n);
+
+/**
+ * Attaches a checksum (set up through AU_CK_Setup, from AUChecksum.h) to the
+ * builder, or detaches it if ck is null. From then on, AU_B1_GetChecksum gives
+ * the checksum of the builder's whole contents, without a pass over them of
+ * its own: appends keep the checksum up to date as they go, while the data is
+ * still in cache. A checksum is attached to at most one builder at a time.
+ *
+ * Appends hash what was appended before them too, so bytes you get through
+ * AppendForSetup are hashed at the next append (or at GetChecksum), and can
+ * be written until then. Bytes reserved through AU_B1_Reserve (and varint
+ * prefixes) aren't hashed until they're patched.
+ *
+ * Discarding or patching bytes that were hashed already is handled by starting
+ * over, which does mean another pass over the builder's contents. That's also
+ * the case for changing bytes in any other way after they're hashed, but then
+ * nothing can tell, so don't.
+ */
+void
+AU_B1_SetChecksum(AU_ByteBuilder *b1, struct AU_Checksum *ck);
+
+uint64_t
+AU_B1_GetChecksum(AU_ByteBuilder *b1);
+
+/**
+ * Spilling to disk, for builders that may not fit in memory.
+ *
+ * With a spill attached (AU_B1_SetSpill), a growth that would take the
+ * builder's capacity past limit bytes, or that its budget (if it has one)
+ * can't pay for, moves the contents to a file backed mapping instead of
+ * failing. The file is created in the directory dir and unlinked right away,
+ * so it goes away with the builder (or the process). From then on, the
+ * builder grows by extending the file (ftruncate) and mapping it again, and
+ * its memory doesn't count against the budget anymore.
+ *
+ * Nothing else changes: appends, GetMemory, discards and so on work the same,
+ * the memory is just paged in and out by the kernel. The mapping is advised
+ * as sequential (POSIX_MADV_SEQUENTIAL), for appending and then scanning it.
+ *
+ * Pass SIZE_MAX as limit to only spill over the budget. dir and the AU_Spill
+ * have to outlive the builder.
+ *
+ * The memory of a spilled builder can't be given to xfree. Free the builder
+ * with AU_B1_Destroy instead, which works for any builder. If spilling itself
+ * fails (the file can't be created, or the disk is full), the growth fails
+ * with AU_ERR_SPILL.
+ */
+struct AU_Spill {
+  const char *dir;
+  size_t limit;
+
+  // The file's descriptor, -1 until the builder spills.
+  int fd;
+};
+
+typedef struct AU_Spill AU_Spill;
+
+void
+AU_B1_SetSpill(AU_ByteBuilder *b1, AU_Spill *sp, const char *dir, size_t limit);
+
+int
+AU_B1_IsSpilled(const AU_ByteBuilder *b1);
+
+/**
+ * Frees the builder's memory (unmapping it, if spilled) and releases its
+ * budget.
+ */
+void
+AU_B1_Destroy(AU_ByteBuilder *b1);
+
 ////////////////////////////
 //// Fixed Size Builder ////
 ////////////////////////////
@@ -101,6 +430,59 @@ AU_FSB_DiscardLastAppends(AU_FixedSizeBuilder *fsb, size_t n);
 size_t
 AU_FSB_GetUsedCount(AU_FixedSizeBuilder *fsa);
 
+/**
+ * Like AU_B1_AppendV. The iov_len of each fragment is in elements, as all
+ * other FSB sizes are.
+ */
+int
+AU_FSB_AppendV(AU_FixedSizeBuilder *fsb, const struct iovec *iov, int n);
+
+int
+AU_FSB_SetBudget(AU_FixedSizeBuilder *fsb, AU_Budget *bdg);
+
+void
+AU_FSB_ReleaseBudget(AU_FixedSizeBuilder *fsb);
+
+/**
+ * Same as the AU_B1_ versions. cap is in elements, as usual, but hints are
+ * kept in bytes.
+ */
+int
+AU_FSB_SetupHinted(AU_FixedSizeBuilder *fsb,
+                   size_t elt_size,
+                   AU_SizeHint *hint,
+                   size_t cap);
+
+void
+AU_FSB_RecordHint(AU_SizeHint *hint, AU_FixedSizeBuilder *fsb);
+
+/**
+ * Same as the AU_B1_ versions, with n in elements.
+ */
+int
+AU_FSB_MakeRoom(AU_FixedSizeBuilder *fsb, size_t n);
+
+void
+AU_FSB_SetChecksum(AU_FixedSizeBuilder *fsb, struct AU_Checksum *ck);
+
+uint64_t
+AU_FSB_GetChecksum(AU_FixedSizeBuilder *fsb);
+
+/**
+ * Same as the AU_B1_ versions. limit is in bytes.
+ */
+void
+AU_FSB_SetSpill(AU_FixedSizeBuilder *fsb,
+                AU_Spill *sp,
+                const char *dir,
+                size_t limit);
+
+int
+AU_FSB_IsSpilled(const AU_FixedSizeBuilder *fsb);
+
+void
+AU_FSB_Destroy(AU_FixedSizeBuilder *fsb);
+
 ///////////////////////////////
 //// Variable Size Builder ////
 ///////////////////////////////
@@ -143,10 +525,431 @@ AU_VSB_DiscardAppends(AU_VarSizeBuilder *vsb);
 size_t
 AU_VSB_GetUsedCount(AU_VarSizeBuilder *vsa);
 
+int
+AU_VSB_SetBudget(AU_VarSizeBuilder *vsb, AU_Budget *bdg);
+
+void
+AU_VSB_ReleaseBudget(AU_VarSizeBuilder *vsb);
+
 /////////////////////////
 //// Stack Allocator ////
 /////////////////////////
 
+///////////////
+//// Arena ////
+///////////////
+
+struct AU_ArenaBlock;
+struct AU_ArenaCleanup;
+
+struct AU_Arena {
+  // Blocks this arena is using, most recent first. Allocations are bumped off
+  // the first one, from top to end.
+  struct AU_ArenaBlock *blocks;
+  char *top, *end;
+
+  // Blocks no longer in use, kept for reuse by this arena and its children.
+  struct AU_ArenaBlock *free_blocks;
+
+  // Cleanup callbacks, most recently registered first.
+  struct AU_ArenaCleanup *cleanups;
+
+  struct AU_Arena *parent;
+  struct AU_Arena *children;
+  struct AU_Arena *prev_sibling, *next_sibling;
+
+  size_t block_size;
+};
+
+/**
+ * As with all other other builder/allocator types, the representation of an
+ * AU_Arena shouldn't be relied upon (check the other comment in the beginning
+ * of this file).
+ *
+ * An arena hands out memory by bumping a pointer through blocks of block_size
+ * bytes, and only gives it back all at once, when the arena is destroyed.
+ *
+ * Arenas can be nested. A child arena gets its blocks from its ancestors'
+ * block caches when they have any, and gives them back to its parent's cache
+ * when destroyed. Destroying an arena destroys its children first. So a child
+ * arena should be used for each nested scope (e.g. a request, and then
+ * sub-scopes of it), and tearing one down costs a step per block, not per
+ * object.
+ *
+ * Cleanup callbacks can be registered on an arena for objects which own
+ * something besides their arena memory (files, sockets, ...). They're run in
+ * the reverse order they were registered, after the children are destroyed
+ * and before the arena's memory goes away.
+ *
+ * An arena and its descendants should only be used from one thread at a time.
+ */
+typedef struct AU_Arena AU_Arena;
+
+/**
+ * Sets up a root arena. Allocations larger than block_size get a block of
+ * their own.
+ */
+int
+AU_AR_Setup(AU_Arena *ar, size_t block_size);
+
+/**
+ * Sets up an arena as a child of parent. It uses the parent's block size.
+ */
+int
+AU_AR_SetupChild(AU_Arena *child, AU_Arena *parent);
+
+/**
+ * Allocates size bytes, aligned as conservatively as a VSB with
+ * AU_ALIGN_CONSERVATIVE would do.
+ */
+void *
+AU_AR_Alloc(AU_Arena *ar, size_t size);
+
+/**
+ * Registers fn to be called with data when the arena is destroyed.
+ */
+int
+AU_AR_AddCleanup(AU_Arena *ar, void (*fn)(void *data), void *data);
+
+/**
+ * Destroys the arena and all its descendants, runs the cleanup callbacks and
+ * gives its blocks back to its parent (or to xfree, if it's a root arena).
+ */
+void
+AU_AR_Destroy(AU_Arena *ar);
+
+///////////////////////
+//// Arena Builder ////
+///////////////////////
+
+struct AU_ArenaBuilder {
+  AU_Arena *ar;
+  char *mem;
+  size_t used, cap;
+};
+
+/**
+ * As with all other other builder/allocator types, the representation of an
+ * AU_ArenaBuilder shouldn't be relied upon (check the other comment in the
+ * beginning of this file).
+ *
+ * An arena builder is a byte builder whose memory comes from an arena. While
+ * the builder's memory is the arena's most recent allocation, growing it just
+ * bumps the arena's top, in place. Otherwise, it's moved to a new allocation
+ * in the arena. Either way, there is no freeing it: it goes away with the
+ * arena.
+ *
+ * Sizes and offsets are in bytes, as with byte builders. As with all other
+ * builders, appends may change the builder's base address.
+ */
+typedef struct AU_ArenaBuilder AU_ArenaBuilder;
+
+int
+AU_ARB_Setup(AU_ArenaBuilder *ab, AU_Arena *ar, size_t cap);
+
+int
+AU_ARB_Append(AU_ArenaBuilder *ab, const void *mem, size_t size);
+
+void *
+AU_ARB_AppendForSetup(AU_ArenaBuilder *ab, size_t size);
+
+void *
+AU_ARB_GetMemory(const AU_ArenaBuilder *ab);
+
+void
+AU_ARB_DiscardAppends(AU_ArenaBuilder *ab);
+
+void
+AU_ARB_DiscardLastBytes(AU_ArenaBuilder *ab, size_t n);
+
+size_t
+AU_ARB_GetUsedCount(const AU_ArenaBuilder *ab);
+
+/**
+ * Gives the builder's unused capacity back to the arena, if the builder's
+ * memory is still the arena's most recent allocation. Call it once you're done
+ * building, so the next allocations from the arena come right after it.
+ * Appending after that is still fine.
+ */
+void
+AU_ARB_Trim(AU_ArenaBuilder *ab);
+
+////////////////////////
+//// Column Builder ////
+////////////////////////
+
+enum {
+  // Columns start at multiples of this, and take multiples of it.
+  AU_COL_ALIGN = 64
+};
+
+struct AU_Column {
+  size_t elt_size;
+  size_t offset;
+};
+
+struct AU_ColumnBuilder {
+  void *mem;
+  char *base;
+  struct AU_Column *cols;
+  size_t ncols;
+  size_t used, cap;
+};
+
+/**
+ * As with all other other builder/allocator types, the representation of an
+ * AU_ColumnBuilder shouldn't be relied upon (check the other comment in the
+ * beginning of this file).
+ *
+ * A column builder builds a table a row at a time, storing it column by
+ * column (struct of arrays). It works like a set of fixed size builders, one
+ * per column, appended to in lockstep, except that all the columns are in one
+ * allocation, and grow together. Sizes and indices are in rows.
+ *
+ * Each column starts at a multiple of AU_COL_ALIGN bytes, and the memory it
+ * has is a multiple of AU_COL_ALIGN bytes long, so vector loops can load whole
+ * aligned vectors from it, even past the last row.
+ *
+ * Appends may change the columns' addresses. The builder owns its memory:
+ * AU_COL_Destroy frees it.
+ */
+typedef struct AU_ColumnBuilder AU_ColumnBuilder;
+
+/**
+ * Sets up a builder with ncols columns, column i holding elements of
+ * elt_sizes[i] bytes, with room for cap rows.
+ */
+int
+AU_COL_Setup(AU_ColumnBuilder *cb,
+             const size_t *elt_sizes,
+             size_t ncols,
+             size_t cap);
+
+/**
+ * Appends a row, given each of its fields: fields[i] is the address of the
+ * value for column i.
+ */
+int
+AU_COL_AppendRow(AU_ColumnBuilder *cb, const void *const *fields);
+
+/**
+ * Appends n rows, given each column's values: cols[i] is the address of n
+ * values for column i.
+ */
+int
+AU_COL_AppendColumns(AU_ColumnBuilder *cb, const void *const *cols, size_t n);
+
+/**
+ * Appends n rows, to be set up through the column addresses. The index of the
+ * first one is stored in *first.
+ */
+int
+AU_COL_AppendForSetup(AU_ColumnBuilder *cb, size_t n, size_t *first);
+
+void *
+AU_COL_GetColumn(const AU_ColumnBuilder *cb, size_t col);
+
+size_t
+AU_COL_GetUsedCount(const AU_ColumnBuilder *cb);
+
+void
+AU_COL_DiscardAppends(AU_ColumnBuilder *cb);
+
+void
+AU_COL_DiscardLastRows(AU_ColumnBuilder *cb, size_t n);
+
+void
+AU_COL_Destroy(AU_ColumnBuilder *cb);
+
+/////////////////////
+//// Paged Array ////
+/////////////////////
+
+struct AU_PagedArray {
+  // Addresses of the pages, in order. Pages are only added, never moved.
+  AU_FixedSizeBuilder dir;
+  size_t elt_size;
+  size_t used;
+  unsigned page_shift;
+};
+
+/**
+ * As with all other other builder/allocator types, the representation of an
+ * AU_PagedArray shouldn't be relied upon (check the other comment in the
+ * beginning of this file).
+ *
+ * A paged array is an indexable array whose elements never move. Elements are
+ * kept in pages of page_cap elements each (a power of two), which are
+ * allocated as needed and never reallocated, so addresses of elements stay
+ * valid for as long as they're in the array. Only the page directory grows
+ * like a builder.
+ *
+ * Getting the address of an element is two shifts, a mask and a load from the
+ * directory. To go over a lot of elements, AU_PA_GetPage is cheaper still: it
+ * gives a page's elements as a plain array.
+ *
+ * Sizes and indices are in elements. Discarding elements keeps their pages
+ * around for the next appends. AU_PA_Destroy frees everything.
+ */
+typedef struct AU_PagedArray AU_PagedArray;
+
+int
+AU_PA_Setup(AU_PagedArray *pa, size_t elt_size, size_t page_cap);
+
+int
+AU_PA_Append(AU_PagedArray *pa, const void *mem, size_t n);
+
+/**
+ * Appends a single element, to be set up through the returned address.
+ * Unlike with builders, it's one element only, because consecutive elements
+ * aren't contiguous across pages.
+ */
+void *
+AU_PA_AppendForSetup(AU_PagedArray *pa);
+
+/**
+ * The address of element i, which has to be in the array.
+ */
+static inline void *
+AU_PA_Get(const AU_PagedArray *pa, size_t i) {
+  char *const *pages = (char *const *)pa->dir.b1.mem;
+  size_t in_page = i & (((size_t)1 << pa->page_shift) - 1);
+  return pages[i >> pa->page_shift] + in_page*pa->elt_size;
+}
+
+/**
+ * The address of page k, storing the number of elements in it in *count.
+ * Pages past the last element have a count of 0.
+ */
+void *
+AU_PA_GetPage(const AU_PagedArray *pa, size_t k, size_t *count);
+
+size_t
+AU_PA_GetPageCount(const AU_PagedArray *pa);
+
+size_t
+AU_PA_GetUsedCount(const AU_PagedArray *pa);
+
+void
+AU_PA_DiscardAppends(AU_PagedArray *pa);
+
+void
+AU_PA_DiscardLastAppends(AU_PagedArray *pa, size_t n);
+
+void
+AU_PA_Destroy(AU_PagedArray *pa);
+
+////////////////////
+//// Record Log ////
+////////////////////
+
+/**
+ * How a record log indexes its records.
+ *
+ *   - AU_RL_INDEX_U32: 4 byte offsets. Records can't go past 4 GiB in total.
+ *   - AU_RL_INDEX_U64: 8 byte offsets.
+ *   - AU_RL_INDEX_DELTA: an 8 byte checkpoint every AU_RL_GROUP records, and
+ *     2 byte offsets from it for each record, so about 2.5 bytes per record.
+ *     Groups whose records span 64 KiB or more fall back to 8 byte offsets.
+ */
+enum AU_RecordIndex {
+  AU_RL_INDEX_U32,
+  AU_RL_INDEX_U64,
+  AU_RL_INDEX_DELTA
+};
+
+enum {
+  AU_RL_GROUP_SHIFT = 4,
+  AU_RL_GROUP = 1 << AU_RL_GROUP_SHIFT
+};
+
+struct AU_RecordLog {
+  // The records, back to back.
+  AU_ByteBuilder data;
+
+  // The start offset of each record, and the end of the last one (u32 or
+  // u64). With AU_RL_INDEX_DELTA, a checkpoint per group instead (u64), which
+  // is the start offset of its first record, or, if its top bit is set, the
+  // index in wide of the group's start offsets.
+  AU_FixedSizeBuilder offsets;
+
+  // For AU_RL_INDEX_DELTA, each record's start offset minus its group's
+  // checkpoint (u16), and the start offsets of wide groups (u64), a group's
+  // worth each.
+  AU_FixedSizeBuilder deltas;
+  AU_FixedSizeBuilder wide;
+
+  enum AU_RecordIndex index;
+  size_t count;
+};
+
+/**
+ * As with all other other builder/allocator types, the representation of an
+ * AU_RecordLog shouldn't be relied upon (check the other comment in the
+ * beginning of this file).
+ *
+ * A record log keeps variable sized records (byte strings) back to back in a
+ * byte builder, and an index of where each one starts, so that record i can
+ * be found in constant time. Records are just bytes, so there is no alignment
+ * (use a VSB, and keep your own index, if you need it).
+ *
+ * Record addresses are good until the next append, as with any builder.
+ * Setup takes capacities for bytes and records.
+ */
+typedef struct AU_RecordLog AU_RecordLog;
+
+int
+AU_RL_Setup(AU_RecordLog *rl,
+            enum AU_RecordIndex index,
+            size_t cap,
+            size_t nrecs);
+
+int
+AU_RL_Append(AU_RecordLog *rl, const void *rec, size_t len);
+
+/**
+ * Appends a record of len bytes, to be set up through the returned address.
+ */
+void *
+AU_RL_AppendForSetup(AU_RecordLog *rl, size_t len);
+
+/**
+ * Appends n records, whose lengths are in lens, and which are back to back
+ * at recs. Room for all of them (bytes and index) is made at once.
+ */
+int
+AU_RL_AppendBatch(AU_RecordLog *rl,
+                  const void *recs,
+                  const size_t *lens,
+                  size_t n);
+
+/**
+ * Record i, storing its length in *len.
+ */
+void *
+AU_RL_Get(const AU_RecordLog *rl, size_t i, size_t *len);
+
+size_t
+AU_RL_GetCount(const AU_RecordLog *rl);
+
+/**
+ * Bytes taken by the records, and by the index.
+ */
+size_t
+AU_RL_GetDataSize(const AU_RecordLog *rl);
+
+size_t
+AU_RL_GetIndexSize(const AU_RecordLog *rl);
+
+void
+AU_RL_DiscardAppends(AU_RecordLog *rl);
+
+void
+AU_RL_DiscardLastRecords(AU_RecordLog *rl, size_t n);
+
+void
+AU_RL_Destroy(AU_RecordLog *rl);
+
 //////////////////////////////
 //// Fixed Size Allocator ////
 //////////////////////////////
@@ -165,6 +968,11 @@ struct AU_FixedSizeAllocator {
   // Total capacity. Used to know how much to allocate on the next round as
   // soon as free_head becomes null.
   size_t total_cap;
+
+  // Bytes in the regions, which is what a budget gets charged for.
+  size_t region_bytes;
+
+  struct AU_BudgetLink bl;
 };
 
 /**
@@ -186,7 +994,166 @@ AU_FSA_Alloc(AU_FixedSizeAllocator *fsa);
 void
 AU_FSA_Free(AU_FixedSizeAllocator *fsa, void *mem);
 
+/*
+ * Bytes before the element in a FSA node. They hold the free list pointer.
+ */
+enum {
+  AU_FSA_NODE_HEADER = sizeof (union AU_AlignmentType)
+};
+
+/**
+ * Destroying the allocator gives back to its budget (if any) everything it
+ * charged.
+ */
 void
 AU_FSA_Destroy(AU_FixedSizeAllocator *fsa);
 
+/**
+ * Attaches the allocator to a budget, charging its current regions. Expansions
+ * from then on are charged as well, and fail with AU_ERR_BUDGET if the budget
+ * (after calling its pressure callback) can't afford them. Only the element
+ * regions are accounted for, not the small bookkeeping of the allocator.
+ */
+int
+AU_FSA_SetBudget(AU_FixedSizeAllocator *fsa, AU_Budget *bdg);
+
+////////////////////////////////////
+//// Type Specialized Functions ////
+////////////////////////////////////
+
+/**
+ * C doesn't have templates, but these macros get you most of the way. Given a
+ * name and an element type, they define a struct type with that name, and
+ * static inline functions on it named after it. For example:
+ *
+ *   AU_DEFINE_FSA(NodePool, struct node)
+ *   AU_DEFINE_FSB(IntVec, int)
+ *
+ * defines NodePool_Setup, NodePool_Alloc (returning a struct node*), ...,
+ * IntVec_Setup, IntVec_Append (taking a const int*), and so on.
+ *
+ * The element size is a compile time constant in those functions, so
+ * multiplications and overflow checks on it are folded by the compiler, and
+ * their common cases (free list isn't empty, there is spare capacity) are
+ * done inline. The uncommon ones go to the regular AU_FSA_ and AU_FSB_
+ * functions. You also get type checking on the elements.
+ *
+ * The wrapped instance is the member named fsa (or fsb), in case you need to
+ * use a function with no specialized version on it.
+ *
+ * Functions defined by AU_DEFINE_FSA(Name, T):
+ *
+ *   int Name_Setup(Name *a, size_t cap);
+ *   T *Name_Alloc(Name *a);
+ *   void Name_Free(Name *a, T *p);
+ *   void Name_Destroy(Name *a);
+ *
+ * Functions defined by AU_DEFINE_FSB(Name, T), with sizes in elements:
+ *
+ *   int Name_Setup(Name *b, size_t cap);
+ *   int Name_Append(Name *b, const T *elts, size_t n);
+ *   int Name_Push(Name *b, T elt);
+ *   T *Name_AppendForSetup(Name *b, size_t n);
+ *   T *Name_GetMemory(Name *b);
+ *   size_t Name_GetUsedCount(Name *b);
+ *   void Name_DiscardAppends(Name *b);
+ *   void Name_DiscardLastAppends(Name *b, size_t n);
+ *
+ * Elements can't need stricter alignment than the conservative alignment
+ * boundary.
+ */
+
+#define AU_DEFINE_FSA(Name, T) \
+  typedef struct Name { \
+    AU_FixedSizeAllocator fsa; \
+  } Name; \
+  \
+  static inline int \
+  Name##_Setup(Name *a, size_t cap) { \
+    return AU_FSA_Setup(&a->fsa, sizeof (T), cap); \
+  } \
+  \
+  static inline T * \
+  Name##_Alloc(Name *a) { \
+    char *node = (char*)a->fsa.free_head; \
+    if (!node) { \
+      return (T*)AU_FSA_Alloc(&a->fsa); \
+    } \
+    a->fsa.free_head = *(void**)node; \
+    return (T*)(void*)(node + AU_FSA_NODE_HEADER); \
+  } \
+  \
+  static inline void \
+  Name##_Free(Name *a, T *p) { \
+    void *node = (char*)p - AU_FSA_NODE_HEADER; \
+    *(void**)node = a->fsa.free_head; \
+    a->fsa.free_head = node; \
+  } \
+  \
+  static inline void \
+  Name##_Destroy(Name *a) { \
+    AU_FSA_Destroy(&a->fsa); \
+  }
+
+#define AU_DEFINE_FSB(Name, T) \
+  typedef struct Name { \
+    AU_FixedSizeBuilder fsb; \
+  } Name; \
+  \
+  static inline int \
+  Name##_Setup(Name *b, size_t cap) { \
+    return AU_FSB_Setup(&b->fsb, sizeof (T), cap); \
+  } \
+  \
+  static inline int \
+  Name##_Append(Name *b, const T *elts, size_t n) { \
+    AU_ByteBuilder *b1 = &b->fsb.b1; \
+    if (!b1->sum && n <= (b1->cap - b1->used)/sizeof (T)) { \
+      memcpy((char*)b1->mem + b1->used, elts, n*sizeof (T)); \
+      b1->used += n*sizeof (T); \
+      return 0; \
+    } \
+    return AU_FSB_Append(&b->fsb, elts, n); \
+  } \
+  \
+  static inline int \
+  Name##_Push(Name *b, T elt) { \
+    return Name##_Append(b, &elt, 1); \
+  } \
+  \
+  static inline T * \
+  Name##_AppendForSetup(Name *b, size_t n) { \
+    AU_ByteBuilder *b1 = &b->fsb.b1; \
+    if (!b1->sum && n <= (b1->cap - b1->used)/sizeof (T)) { \
+      void *out = (char*)b1->mem + b1->used; \
+      b1->used += n*sizeof (T); \
+      return (T*)out; \
+    } \
+    return (T*)AU_FSB_AppendForSetup(&b->fsb, n); \
+  } \
+  \
+  static inline T * \
+  Name##_GetMemory(Name *b) { \
+    return (T*)b->fsb.b1.mem; \
+  } \
+  \
+  static inline size_t \
+  Name##_GetUsedCount(Name *b) { \
+    return b->fsb.b1.used/sizeof (T); \
+  } \
+  \
+  static inline void \
+  Name##_DiscardAppends(Name *b) { \
+    AU_FSB_DiscardAppends(&b->fsb); \
+  } \
+  \
+  static inline void \
+  Name##_DiscardLastAppends(Name *b, size_t n) { \
+    AU_FSB_DiscardLastAppends(&b->fsb, n); \
+  }
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,702 @@
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include "AUBTree.h"
+
+// 64 bit only: the AVX2 search extracts 64 bit lanes.
+#if defined(__GNUC__) && defined(__x86_64__)
+#define AU_X86_DISPATCH 1
+#include <immintrin.h>
+#endif
+
+enum {
+  // Deeper than any tree that fits in memory: 32^15 leaves.
+  BT_MAX_HEIGHT = 16,
+
+  // Nodes splits can take at most: one per level, and a new root.
+  BT_MAX_SPLIT_NODES = BT_MAX_HEIGHT + 1
+};
+
+/*
+ * Both node kinds are AU_BT_NODE_SIZE bytes on 64 bit targets. Key slots past
+ * n hold UINT64_MAX.
+ */
+struct BTLeaf {
+  uint32_t n;
+  struct BTLeaf *next;
+  uint64_t keys[AU_BT_LEAF_CAP];
+  uint64_t vals[AU_BT_LEAF_CAP];
+};
+
+/*
+ * Child i holds the keys from keys[i - 1] (included) up to keys[i] (not
+ * included), the first and last children being unbounded below and above.
+ */
+struct BTInner {
+  uint32_t n;
+  uint64_t keys[AU_BT_INNER_CAP];
+  void *kids[AU_BT_INNER_CAP + 1];
+};
+
+#ifndef NDEBUG
+
+#define ASSERT_VALID_BT(bt) \
+  do { \
+    assert(bt); \
+    assert(((bt)->height == 0) == !(bt)->root); \
+    assert((bt)->height <= BT_MAX_HEIGHT); \
+  } while (0)
+
+#else
+
+#define ASSERT_VALID_BT(bt)
+
+#endif
+
+////////////////////////
+//// In Node Search ////
+////////////////////////
+
+/*
+ * How many of a node's keys are below k. Unused slots hold UINT64_MAX, which
+ * is never below anything, so all slots are compared, whatever n is: there
+ * are no branches on the keys and the loops have a fixed trip count.
+ */
+
+static unsigned
+BTCountLessScalar(const uint64_t *keys, uint64_t k) {
+  unsigned c = 0;
+  for (int i = 0; i < AU_BT_LEAF_CAP; i++) {
+    c += keys[i] < k;
+  }
+  return c;
+}
+
+#ifdef AU_X86_DISPATCH
+
+static int
+HasAVX2(void) {
+  return __builtin_cpu_supports("avx2");
+}
+
+/*
+ * AVX2 only compares signed 64 bit integers, so both sides get their sign
+ * bit flipped first. Lanes that compare true are -1, and subtracting them
+ * counts them.
+ */
+__attribute__((target("avx2")))
+static unsigned
+BTCountLessAVX2(const uint64_t *keys, uint64_t k) {
+  const __m256i flip = _mm256_set1_epi64x(INT64_MIN);
+  __m256i kv = _mm256_xor_si256(_mm256_set1_epi64x((long long)k), flip);
+  __m256i acc = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + 4 <= AU_BT_LEAF_CAP; i += 4) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(const void*)(keys + i));
+    v = _mm256_xor_si256(v, flip);
+    acc = _mm256_sub_epi64(acc, _mm256_cmpgt_epi64(kv, v));
+  }
+  __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(acc),
+                              _mm256_extracti128_si256(acc, 1));
+  unsigned c = (unsigned)(_mm_cvtsi128_si64(sum)
+                          + _mm_extract_epi64(sum, 1));
+  for (; i < AU_BT_LEAF_CAP; i++) {
+    c += keys[i] < k;
+  }
+  return c;
+}
+
+#endif
+
+static unsigned
+BTCountLess(const uint64_t *keys, uint64_t k) {
+#ifdef AU_X86_DISPATCH
+  if (HasAVX2()) {
+    return BTCountLessAVX2(keys, k);
+  }
+#endif
+  return BTCountLessScalar(keys, k);
+}
+
+/*
+ * The child of in that holds k: the number of separators k isn't below.
+ */
+static unsigned
+BTChildIndex(const struct BTInner *in, uint64_t k) {
+  return k == UINT64_MAX ? in->n : BTCountLess(in->keys, k + 1);
+}
+
+/*
+ * The leaf that holds k, or would.
+ */
+static struct BTLeaf *
+BTFindLeaf(const AU_BTree *bt, uint64_t k) {
+  void *node = bt->root;
+  for (unsigned h = bt->height; h > 1; h--) {
+    const struct BTInner *in = node;
+    node = in->kids[BTChildIndex(in, k)];
+  }
+  return node;
+}
+
+///////////////
+//// Nodes ////
+///////////////
+
+static struct BTLeaf *
+BTNewLeaf(AU_BTree *bt) {
+  struct BTLeaf *leaf = AU_FSA_Alloc(&bt->leaves);
+  if (!leaf) {
+    return 0;
+  }
+  leaf->n = 0;
+  leaf->next = 0;
+  for (int i = 0; i < AU_BT_LEAF_CAP; i++) {
+    leaf->keys[i] = UINT64_MAX;
+  }
+  bt->leaf_count++;
+  return leaf;
+}
+
+static struct BTInner *
+BTNewInner(AU_BTree *bt) {
+  struct BTInner *in = AU_FSA_Alloc(&bt->inners);
+  if (!in) {
+    return 0;
+  }
+  in->n = 0;
+  for (int i = 0; i < AU_BT_INNER_CAP; i++) {
+    in->keys[i] = UINT64_MAX;
+  }
+  bt->inner_count++;
+  return in;
+}
+
+static void
+BTFreeLeaf(AU_BTree *bt, struct BTLeaf *leaf) {
+  AU_FSA_Free(&bt->leaves, leaf);
+  bt->leaf_count--;
+}
+
+static void
+BTFreeInner(AU_BTree *bt, struct BTInner *in) {
+  AU_FSA_Free(&bt->inners, in);
+  bt->inner_count--;
+}
+
+/*
+ * Frees node and everything under it. height is 1 for leaves.
+ */
+static void
+BTFreeSubtree(AU_BTree *bt, void *node, unsigned height) {
+  if (height == 1) {
+    BTFreeLeaf(bt, node);
+    return;
+  }
+  struct BTInner *in = node;
+  for (unsigned i = 0; i <= in->n; i++) {
+    BTFreeSubtree(bt, in->kids[i], height - 1);
+  }
+  BTFreeInner(bt, in);
+}
+
+//////////////////
+//// B+-Trees ////
+//////////////////
+
+int
+AU_BT_Setup(AU_BTree *bt, size_t cap) {
+  size_t leaves = cap/AU_BT_LEAF_CAP + 1;
+  size_t inners = leaves/AU_BT_INNER_CAP + 1;
+
+  int res = AU_FSA_Setup(&bt->leaves, sizeof (struct BTLeaf), leaves);
+  if (res < 0) {
+    return res;
+  }
+  res = AU_FSA_Setup(&bt->inners, sizeof (struct BTInner), inners);
+  if (res < 0) {
+    AU_FSA_Destroy(&bt->leaves);
+    return res;
+  }
+  bt->root = 0;
+  bt->height = 0;
+  bt->count = 0;
+  bt->leaf_count = 0;
+  bt->inner_count = 0;
+  return 0;
+}
+
+/*
+ * A node of the level a bulk load is building, with the smallest key under
+ * it, which is its separator in the level above.
+ */
+struct BTLoadItem {
+  void *node;
+  uint64_t min;
+};
+
+/*
+ * Frees the nodes of a bulk load level from item i on, with everything under
+ * them.
+ */
+static void
+BTFreeLevel(AU_BTree *bt,
+            AU_FixedSizeBuilder *level,
+            size_t i,
+            unsigned height) {
+  struct BTLoadItem *items = AU_FSB_GetMemory(level);
+  size_t n = AU_FSB_GetUsedCount(level);
+  for (; i < n; i++) {
+    BTFreeSubtree(bt, items[i].node, height);
+  }
+}
+
+/*
+ * Builds the leaves of a bulk load, adding each to level.
+ */
+static int
+BTLoadLeaves(AU_BTree *bt,
+             const AU_BTEntry *entries,
+             size_t n,
+             AU_FixedSizeBuilder *level) {
+  size_t nodes = n/AU_BT_LEAF_CAP + (n % AU_BT_LEAF_CAP != 0);
+  struct BTLeaf *prev = 0;
+  for (size_t j = 0; j < nodes; j++) {
+    // The entries are spread evenly: the first n % nodes leaves get one more.
+    size_t take = n/nodes + (j < n % nodes);
+    struct BTLeaf *leaf = BTNewLeaf(bt);
+    if (!leaf) {
+      return AU_ERR_XMALLOC;
+    }
+    for (size_t i = 0; i < take; i++) {
+      leaf->keys[i] = entries[i].key;
+      leaf->vals[i] = entries[i].value;
+    }
+    leaf->n = (uint32_t)take;
+    struct BTLoadItem item = {leaf, entries[0].key};
+    int res = AU_FSB_Append(level, &item, 1);
+    if (res < 0) {
+      BTFreeLeaf(bt, leaf);
+      return res;
+    }
+    if (prev) {
+      prev->next = leaf;
+    }
+    prev = leaf;
+    entries += take;
+  }
+  return 0;
+}
+
+/*
+ * Builds the level of inner nodes above the nodes in kids into level. *taken
+ * is how many of kids the new nodes got, so if it fails, freeing level and
+ * the kids from *taken on frees everything.
+ */
+static int
+BTLoadInners(AU_BTree *bt,
+             AU_FixedSizeBuilder *kids,
+             AU_FixedSizeBuilder *level,
+             size_t *taken) {
+  struct BTLoadItem *items = AU_FSB_GetMemory(kids);
+  size_t n = AU_FSB_GetUsedCount(kids);
+  size_t nodes = n/(AU_BT_INNER_CAP + 1) + (n % (AU_BT_INNER_CAP + 1) != 0);
+
+  *taken = 0;
+  for (size_t j = 0; j < nodes; j++) {
+    size_t take = n/nodes + (j < n % nodes);
+    struct BTInner *in = BTNewInner(bt);
+    if (!in) {
+      return AU_ERR_XMALLOC;
+    }
+    struct BTLoadItem item = {in, items[*taken].min};
+    int res = AU_FSB_Append(level, &item, 1);
+    if (res < 0) {
+      BTFreeInner(bt, in);
+      return res;
+    }
+    in->kids[0] = items[*taken].node;
+    for (size_t i = 1; i < take; i++) {
+      in->keys[i - 1] = items[*taken + i].min;
+      in->kids[i] = items[*taken + i].node;
+    }
+    in->n = (uint32_t)(take - 1);
+    *taken += take;
+  }
+  return 0;
+}
+
+int
+AU_BT_BulkLoad(AU_BTree *bt, AU_FixedSizeBuilder *fsb) {
+  ASSERT_VALID_BT(bt);
+  assert(bt->count == 0 && bt->height == 0);
+  assert(fsb->elt_size == sizeof (AU_BTEntry));
+
+  const AU_BTEntry *entries = AU_FSB_GetMemory(fsb);
+  size_t n = AU_FSB_GetUsedCount(fsb);
+  if (n == 0) {
+    return 0;
+  }
+#ifndef NDEBUG
+  for (size_t i = 1; i < n; i++) {
+    assert(entries[i - 1].key < entries[i].key);
+  }
+#endif
+
+  // Each level is built from the one below it, which is then dropped.
+  AU_FixedSizeBuilder levels[2];
+  size_t leaves = n/AU_BT_LEAF_CAP + 1;
+  int res = AU_FSB_Setup(&levels[0], sizeof (struct BTLoadItem), leaves);
+  if (res < 0) {
+    return res;
+  }
+  res = AU_FSB_Setup(&levels[1],
+                     sizeof (struct BTLoadItem),
+                     leaves/AU_BT_INNER_CAP + 1);
+  if (res < 0) {
+    AU_FSB_Destroy(&levels[0]);
+    return res;
+  }
+
+  AU_FixedSizeBuilder *cur = &levels[0], *next = &levels[1];
+  unsigned height = 1;
+  res = BTLoadLeaves(bt, entries, n, cur);
+  while (res == 0 && AU_FSB_GetUsedCount(cur) > 1) {
+    size_t taken;
+    AU_FSB_DiscardAppends(next);
+    res = BTLoadInners(bt, cur, next, &taken);
+    if (res < 0) {
+      BTFreeLevel(bt, next, 0, height + 1);
+      BTFreeLevel(bt, cur, taken, height);
+      AU_FSB_DiscardAppends(cur);
+      break;
+    }
+    AU_FixedSizeBuilder *t = cur;
+    cur = next;
+    next = t;
+    height++;
+  }
+
+  if (res < 0) {
+    BTFreeLevel(bt, cur, 0, height);
+  } else {
+    struct BTLoadItem *top = AU_FSB_GetMemory(cur);
+    bt->root = top[0].node;
+    bt->height = height;
+    bt->count = n;
+  }
+  AU_FSB_Destroy(&levels[0]);
+  AU_FSB_Destroy(&levels[1]);
+  return res;
+}
+
+/*
+ * Puts an entry at pos in a leaf with room for it.
+ */
+static void
+BTLeafInsertAt(struct BTLeaf *leaf, unsigned pos, uint64_t k, uint64_t v) {
+  assert(leaf->n < AU_BT_LEAF_CAP);
+
+  size_t moved = leaf->n - pos;
+  memmove(leaf->keys + pos + 1, leaf->keys + pos, moved * sizeof (uint64_t));
+  memmove(leaf->vals + pos + 1, leaf->vals + pos, moved * sizeof (uint64_t));
+  leaf->keys[pos] = k;
+  leaf->vals[pos] = v;
+  leaf->n++;
+}
+
+/*
+ * Puts separator k at i in an inner node with room for it, with kid to its
+ * right.
+ */
+static void
+BTInnerInsertAt(struct BTInner *in, unsigned i, uint64_t k, void *kid) {
+  assert(in->n < AU_BT_INNER_CAP);
+
+  size_t moved = in->n - i;
+  memmove(in->keys + i + 1, in->keys + i, moved * sizeof (uint64_t));
+  memmove(in->kids + i + 2, in->kids + i + 1, moved * sizeof (void*));
+  in->keys[i] = k;
+  in->kids[i + 1] = kid;
+  in->n++;
+}
+
+/*
+ * Splits a full leaf, with the entry that didn't fit at pos, into it and the
+ * empty leaf right (half each). Gives right's separator.
+ */
+static uint64_t
+BTSplitLeaf(struct BTLeaf *leaf,
+            struct BTLeaf *right,
+            unsigned pos,
+            uint64_t k,
+            uint64_t v) {
+  enum { TOTAL = AU_BT_LEAF_CAP + 1, LEFT = TOTAL/2 };
+  uint64_t keys[TOTAL], vals[TOTAL];
+
+  memcpy(keys, leaf->keys, pos * sizeof (uint64_t));
+  memcpy(vals, leaf->vals, pos * sizeof (uint64_t));
+  keys[pos] = k;
+  vals[pos] = v;
+  memcpy(keys + pos + 1, leaf->keys + pos,
+         (AU_BT_LEAF_CAP - pos) * sizeof (uint64_t));
+  memcpy(vals + pos + 1, leaf->vals + pos,
+         (AU_BT_LEAF_CAP - pos) * sizeof (uint64_t));
+
+  memcpy(leaf->keys, keys, LEFT * sizeof (uint64_t));
+  memcpy(leaf->vals, vals, LEFT * sizeof (uint64_t));
+  for (int i = LEFT; i < AU_BT_LEAF_CAP; i++) {
+    leaf->keys[i] = UINT64_MAX;
+  }
+  leaf->n = LEFT;
+  memcpy(right->keys, keys + LEFT, (TOTAL - LEFT) * sizeof (uint64_t));
+  memcpy(right->vals, vals + LEFT, (TOTAL - LEFT) * sizeof (uint64_t));
+  right->n = TOTAL - LEFT;
+
+  right->next = leaf->next;
+  leaf->next = right;
+  return right->keys[0];
+}
+
+/*
+ * Splits a full inner node, with the separator k and kid that didn't fit at
+ * i, into it and the empty node right. Gives the separator that goes up
+ * (which neither of them keeps).
+ */
+static uint64_t
+BTSplitInner(struct BTInner *in,
+             struct BTInner *right,
+             unsigned i,
+             uint64_t k,
+             void *kid) {
+  enum { TOTAL = AU_BT_INNER_CAP + 1, LEFT = TOTAL/2 };
+  uint64_t keys[TOTAL];
+  void *kids[TOTAL + 1];
+
+  memcpy(keys, in->keys, i * sizeof (uint64_t));
+  keys[i] = k;
+  memcpy(keys + i + 1, in->keys + i,
+         (AU_BT_INNER_CAP - i) * sizeof (uint64_t));
+  memcpy(kids, in->kids, (i + 1) * sizeof (void*));
+  kids[i + 1] = kid;
+  memcpy(kids + i + 2, in->kids + i + 1,
+         (AU_BT_INNER_CAP - i) * sizeof (void*));
+
+  memcpy(in->keys, keys, LEFT * sizeof (uint64_t));
+  memcpy(in->kids, kids, (LEFT + 1) * sizeof (void*));
+  for (int j = LEFT; j < AU_BT_INNER_CAP; j++) {
+    in->keys[j] = UINT64_MAX;
+  }
+  in->n = LEFT;
+  memcpy(right->keys, keys + LEFT + 1,
+         (TOTAL - LEFT - 1) * sizeof (uint64_t));
+  memcpy(right->kids, kids + LEFT + 1, (TOTAL - LEFT) * sizeof (void*));
+  right->n = TOTAL - LEFT - 1;
+  return keys[LEFT];
+}
+
+/*
+ * Allocates the nodes an insert's splits take: a leaf, then need - 1 inner
+ * nodes. All or nothing.
+ */
+static int
+BTAllocSplitNodes(AU_BTree *bt, void **fresh, unsigned need) {
+  fresh[0] = BTNewLeaf(bt);
+  if (!fresh[0]) {
+    return AU_ERR_XMALLOC;
+  }
+  for (unsigned i = 1; i < need; i++) {
+    fresh[i] = BTNewInner(bt);
+    if (!fresh[i]) {
+      while (--i > 0) {
+        BTFreeInner(bt, fresh[i]);
+      }
+      BTFreeLeaf(bt, fresh[0]);
+      return AU_ERR_XMALLOC;
+    }
+  }
+  return 0;
+}
+
+int
+AU_BT_Insert(AU_BTree *bt, uint64_t key, uint64_t value) {
+  ASSERT_VALID_BT(bt);
+
+  if (!bt->root) {
+    struct BTLeaf *leaf = BTNewLeaf(bt);
+    if (!leaf) {
+      return AU_ERR_XMALLOC;
+    }
+    bt->root = leaf;
+    bt->height = 1;
+  }
+
+  // The way down, for splits to go back up.
+  struct BTInner *path[BT_MAX_HEIGHT];
+  unsigned idx[BT_MAX_HEIGHT];
+  unsigned depth = 0;
+  void *node = bt->root;
+  for (unsigned h = bt->height; h > 1; h--) {
+    struct BTInner *in = node;
+    path[depth] = in;
+    idx[depth] = BTChildIndex(in, key);
+    node = in->kids[idx[depth]];
+    depth++;
+  }
+
+  struct BTLeaf *leaf = node;
+  unsigned pos = BTCountLess(leaf->keys, key);
+  if (pos < leaf->n && leaf->keys[pos] == key) {
+    leaf->vals[pos] = value;
+    return 0;
+  }
+  if (leaf->n < AU_BT_LEAF_CAP) {
+    BTLeafInsertAt(leaf, pos, key, value);
+    bt->count++;
+    return 0;
+  }
+
+  // The leaf splits, and so does each full inner node above it. If they're
+  // all full, so is the root, and the tree grows a level.
+  unsigned need = 1, d = depth;
+  while (d > 0 && path[d - 1]->n == AU_BT_INNER_CAP) {
+    need++;
+    d--;
+  }
+  if (d == 0) {
+    assert(bt->height < BT_MAX_HEIGHT);
+    need++;
+  }
+  void *fresh[BT_MAX_SPLIT_NODES];
+  int res = BTAllocSplitNodes(bt, fresh, need);
+  if (res < 0) {
+    return res;
+  }
+
+  uint64_t sep = BTSplitLeaf(leaf, fresh[0], pos, key, value);
+  void *kid = fresh[0];
+  unsigned used = 1;
+  for (d = depth; d > 0; d--) {
+    struct BTInner *in = path[d - 1];
+    if (in->n < AU_BT_INNER_CAP) {
+      BTInnerInsertAt(in, idx[d - 1], sep, kid);
+      break;
+    }
+    sep = BTSplitInner(in, fresh[used], idx[d - 1], sep, kid);
+    kid = fresh[used++];
+  }
+  if (d == 0) {
+    struct BTInner *root = fresh[used++];
+    root->keys[0] = sep;
+    root->kids[0] = bt->root;
+    root->kids[1] = kid;
+    root->n = 1;
+    bt->root = root;
+    bt->height++;
+  }
+  assert(used == need);
+  bt->count++;
+  return 0;
+}
+
+int
+AU_BT_Find(const AU_BTree *bt, uint64_t key, uint64_t *value) {
+  ASSERT_VALID_BT(bt);
+
+  if (!bt->root) {
+    return 0;
+  }
+  const struct BTLeaf *leaf = BTFindLeaf(bt, key);
+  unsigned pos = BTCountLess(leaf->keys, key);
+  if (pos == leaf->n || leaf->keys[pos] != key) {
+    return 0;
+  }
+  if (value) {
+    *value = leaf->vals[pos];
+  }
+  return 1;
+}
+
+int
+AU_BT_Delete(AU_BTree *bt, uint64_t key) {
+  ASSERT_VALID_BT(bt);
+
+  if (!bt->root) {
+    return 0;
+  }
+  struct BTLeaf *leaf = BTFindLeaf(bt, key);
+  unsigned pos = BTCountLess(leaf->keys, key);
+  if (pos == leaf->n || leaf->keys[pos] != key) {
+    return 0;
+  }
+
+  // No merging: separators above stay good bounds for what's left.
+  size_t moved = leaf->n - pos - 1;
+  memmove(leaf->keys + pos, leaf->keys + pos + 1, moved * sizeof (uint64_t));
+  memmove(leaf->vals + pos, leaf->vals + pos + 1, moved * sizeof (uint64_t));
+  leaf->n--;
+  leaf->keys[leaf->n] = UINT64_MAX;
+  bt->count--;
+  return 1;
+}
+
+void
+AU_BT_Seek(const AU_BTree *bt, uint64_t key, AU_BTCursor *cur) {
+  ASSERT_VALID_BT(bt);
+
+  if (!bt->root) {
+    cur->leaf = 0;
+    cur->pos = 0;
+    return;
+  }
+  const struct BTLeaf *leaf = BTFindLeaf(bt, key);
+  cur->leaf = leaf;
+  cur->pos = BTCountLess(leaf->keys, key);
+}
+
+int
+AU_BT_Next(AU_BTCursor *cur, uint64_t *key, uint64_t *value) {
+  const struct BTLeaf *leaf = cur->leaf;
+
+  // Past the end of a leaf, or in an empty one.
+  while (leaf && cur->pos >= leaf->n) {
+    leaf = leaf->next;
+    cur->pos = 0;
+  }
+  cur->leaf = leaf;
+  if (!leaf) {
+    return 0;
+  }
+  if (key) {
+    *key = leaf->keys[cur->pos];
+  }
+  if (value) {
+    *value = leaf->vals[cur->pos];
+  }
+  cur->pos++;
+  return 1;
+}
+
+size_t
+AU_BT_GetCount(const AU_BTree *bt) {
+  ASSERT_VALID_BT(bt);
+
+  return bt->count;
+}
+
+size_t
+AU_BT_GetMemoryUsage(const AU_BTree *bt) {
+  ASSERT_VALID_BT(bt);
+
+  return bt->leaf_count * (sizeof (struct BTLeaf) + AU_FSA_NODE_HEADER)
+         + bt->inner_count * (sizeof (struct BTInner) + AU_FSA_NODE_HEADER);
+}
+
+void
+AU_BT_Destroy(AU_BTree *bt) {
+  ASSERT_VALID_BT(bt);
+
+  AU_FSA_Destroy(&bt->leaves);
+  AU_FSA_Destroy(&bt->inners);
+}
@@ -0,0 +1,142 @@
+#ifndef ALLOC_UTILS_BTREE_H
+#define ALLOC_UTILS_BTREE_H
+
+/**
+ * B+-trees of 64 bit keys and values, for large ordered indexes in memory.
+ *
+ * Nodes are AU_BT_NODE_SIZE bytes (a multiple of the cache line) and come from
+ * two fixed size allocators, one for leaves and one for inner nodes. A node
+ * keeps its keys in one array and its values (or children) in another, so
+ * looking for a key only touches the key array. That search counts the keys
+ * below the one you're looking for, without branching on them, 4 keys at a
+ * time with AVX2 when the processor has it. Unused key slots hold UINT64_MAX
+ * so every node is searched the same way.
+ *
+ * Leaves are linked to the next one, for range scans. Entries take about 17
+ * bytes each in full leaves, plus a few percent for the inner nodes, against
+ * 48 for a red-black tree node holding the same entry (64 after malloc's
+ * overhead), and a lookup goes through a node per level (3 levels for tens of
+ * thousands of entries, 5 for tens of millions) instead of one per bit of the
+ * entry count.
+ *
+ * Deletes are lazy: the entry is taken out of its leaf, but leaves are never
+ * merged, and empty ones stay in the tree. Trees that shrink a lot are better
+ * rebuilt with a bulk load.
+ */
+
+#include "AU.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum {
+  AU_BT_NODE_SIZE = 512,
+
+  // Entries per leaf, and keys per inner node (which has one more child).
+  AU_BT_LEAF_CAP = 31,
+  AU_BT_INNER_CAP = 31
+};
+
+/**
+ * What bulk loads take, in a fixed size builder whose element size is
+ * sizeof (AU_BTEntry).
+ */
+typedef struct AU_BTEntry {
+  uint64_t key;
+  uint64_t value;
+} AU_BTEntry;
+
+struct AU_BTree {
+  AU_FixedSizeAllocator leaves;
+  AU_FixedSizeAllocator inners;
+
+  // A leaf if height is 1, an inner node otherwise. Null while height is 0.
+  void *root;
+  unsigned height;
+
+  size_t count;
+  size_t leaf_count;
+  size_t inner_count;
+};
+
+/**
+ * As with all other other builder/allocator types, the representation of an
+ * AU_BTree shouldn't be relied upon (check the other comment in the beginning
+ * of AU.h).
+ */
+typedef struct AU_BTree AU_BTree;
+
+/**
+ * A position in a tree, for range scans. Changing the tree invalidates its
+ * cursors.
+ */
+typedef struct AU_BTCursor {
+  const void *leaf;
+  unsigned pos;
+} AU_BTCursor;
+
+/**
+ * Sets up an empty tree, with its allocators sized for cap entries.
+ */
+int
+AU_BT_Setup(AU_BTree *bt, size_t cap);
+
+/**
+ * Loads the entries in fsb into bt, which has to be empty, in linear time.
+ * Keys have to be strictly increasing. Leaves are filled up (the entries are
+ * spread evenly among as few leaves as can hold them), which is what you want
+ * for an index that's mostly read. If it fails, the tree is left empty.
+ */
+int
+AU_BT_BulkLoad(AU_BTree *bt, AU_FixedSizeBuilder *fsb);
+
+/**
+ * Inserts key with value, or replaces the value if key is in the tree
+ * already. Nodes are split as needed. If that takes more nodes than can be
+ * allocated, nothing changes.
+ */
+int
+AU_BT_Insert(AU_BTree *bt, uint64_t key, uint64_t value);
+
+/**
+ * 1 if key is in the tree, storing its value in *value (if value isn't null),
+ * 0 otherwise.
+ */
+int
+AU_BT_Find(const AU_BTree *bt, uint64_t key, uint64_t *value);
+
+/**
+ * Takes key out of the tree. 1 if it was there, 0 otherwise.
+ */
+int
+AU_BT_Delete(AU_BTree *bt, uint64_t key);
+
+/**
+ * Positions cur at the first entry whose key is key or larger. Then each
+ * AU_BT_Next stores that entry's key and value (either can be null) and moves
+ * on, or gives 0 when there are no more entries.
+ */
+void
+AU_BT_Seek(const AU_BTree *bt, uint64_t key, AU_BTCursor *cur);
+
+int
+AU_BT_Next(AU_BTCursor *cur, uint64_t *key, uint64_t *value);
+
+size_t
+AU_BT_GetCount(const AU_BTree *bt);
+
+/**
+ * Bytes taken by the tree's nodes, FSA node headers included.
+ */
+size_t
+AU_BT_GetMemoryUsage(const AU_BTree *bt);
+
+void
+AU_BT_Destroy(AU_BTree *bt);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,1397 @@
+/*
+ * Benchmark runner for the allocation utilities.
+ *
+ * Each benchmark is timed with the monotonic clock and, when the kernel lets
+ * us, with hardware performance counters (perf_event_open). Counters that
+ * can't be opened (no PMU in a VM, perf_event_paranoid, non Linux systems)
+ * are reported as "-" and don't stop the other numbers from being reported.
+ *
+ * Usage: AUBench [filter [max_threads]]
+ *
+ * Only benchmarks whose names contain the filter string are run. The
+ * multithreaded benchmarks are run with 1, 2, 4, ... threads up to max_threads
+ * (by default, the number of online processors).
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <search.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "AU.h"
+#include "AUCodec.h"
+#include "AUChecksum.h"
+#include "AUBTree.h"
+
+enum {
+  // Operations per benchmark run.
+  BENCH_OPS = 1 << 20,
+
+  // Elements live at once in the allocator benchmarks.
+  BENCH_LIVE = 1 << 16,
+
+  // Operations per thread in the multithreaded benchmarks.
+  BENCH_MT_OPS = 1 << 20,
+
+  // Upper bound on the threads the multithreaded benchmarks will use.
+  BENCH_MAX_THREADS = 256,
+
+  // Entries in the ordered index benchmarks: more than the caches hold.
+  BENCH_TREE_KEYS = 1 << 20
+};
+
+// Written to at the end of benchmarks so their work can't be optimized out.
+static volatile uintptr_t bench_sink;
+
+//////////////////////////
+//// Hardware Counters ///
+//////////////////////////
+
+struct Counter {
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+  int fd;
+};
+
+#ifdef __linux__
+
+#define HW_CACHE_MISS(cache) \
+  ((cache) \
+   | (PERF_COUNT_HW_CACHE_OP_READ << 8) \
+   | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static struct Counter counters[] = {
+  {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1},
+  {"instrs", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, -1},
+  {"L1d-miss", PERF_TYPE_HW_CACHE, HW_CACHE_MISS(PERF_COUNT_HW_CACHE_L1D), -1},
+  {"LLC-miss", PERF_TYPE_HW_CACHE, HW_CACHE_MISS(PERF_COUNT_HW_CACHE_LL), -1},
+  {"dTLB-miss", PERF_TYPE_HW_CACHE,
+   HW_CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB), -1},
+  {"faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, -1}
+};
+
+/*
+ * Counters are opened one by one instead of as a group. A group is scheduled
+ * all or nothing, so one event the hardware doesn't have would take the
+ * others with it.
+ */
+static void
+OpenCounters(void) {
+  for (size_t i = 0; i < sizeof counters / sizeof counters[0]; i++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof attr);
+    attr.size = sizeof attr;
+    attr.type = counters[i].type;
+    attr.config = counters[i].config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    // Threads created while the counter is open get counted as well.
+    attr.inherit = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+                       | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    counters[i].fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+}
+
+static void
+CloseCounters(void) {
+  for (size_t i = 0; i < sizeof counters / sizeof counters[0]; i++) {
+    if (counters[i].fd >= 0) {
+      close(counters[i].fd);
+      counters[i].fd = -1;
+    }
+  }
+}
+
+static void
+StartCounters(void) {
+  for (size_t i = 0; i < sizeof counters / sizeof counters[0]; i++) {
+    if (counters[i].fd >= 0) {
+      ioctl(counters[i].fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(counters[i].fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+}
+
+static void
+StopCounters(void) {
+  for (size_t i = 0; i < sizeof counters / sizeof counters[0]; i++) {
+    if (counters[i].fd >= 0) {
+      ioctl(counters[i].fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+  }
+}
+
+/*
+ * Reads a counter, scaling it up if the kernel had to multiplex it with other
+ * events. Returns a negative value if it isn't available.
+ */
+static double
+ReadCounter(const struct Counter *c) {
+  uint64_t vals[3];
+  if (c->fd < 0 || read(c->fd, vals, sizeof vals) != sizeof vals) {
+    return -1;
+  }
+  if (vals[2] == 0) {
+    return vals[1] == 0 ? (double)vals[0] : -1;
+  }
+  return (double)vals[0] * ((double)vals[1] / (double)vals[2]);
+}
+
+#else
+
+static struct Counter counters[] = {
+  {"cycles", 0, 0, -1}
+};
+
+static void OpenCounters(void) {}
+static void CloseCounters(void) {}
+static void StartCounters(void) {}
+static void StopCounters(void) {}
+static double ReadCounter(const struct Counter *c) { (void)c; return -1; }
+
+#endif
+
+enum {
+  NUM_COUNTERS = sizeof counters / sizeof counters[0]
+};
+
+////////////////////
+//// Benchmarks ////
+////////////////////
+
+/*
+ * Each benchmark does its setup, runs its measured part between StartRun and
+ * StopRun, tears down, and returns how many operations the measured part did.
+ */
+
+static struct timespec run_start, run_stop;
+
+static void
+StartRun(void) {
+  StartCounters();
+  clock_gettime(CLOCK_MONOTONIC, &run_start);
+}
+
+static void
+StopRun(void) {
+  clock_gettime(CLOCK_MONOTONIC, &run_stop);
+  StopCounters();
+}
+
+// xorshift64, so the random patterns don't depend on the libc rand.
+static uint64_t
+NextRand(uint64_t *state) {
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+static void
+Shuffle(void **ptrs, size_t n, uint64_t seed) {
+  for (size_t i = n - 1; i > 0; i--) {
+    size_t j = NextRand(&seed) % (i + 1);
+    void *t = ptrs[i];
+    ptrs[i] = ptrs[j];
+    ptrs[j] = t;
+  }
+}
+
+// LIFO alloc/free pairs: the free list head stays hot.
+static size_t
+BenchFSAAllocFree(void) {
+  AU_FixedSizeAllocator fsa;
+  if (AU_FSA_Setup(&fsa, 32, BENCH_LIVE) < 0) {
+    return 0;
+  }
+  uintptr_t acc = 0;
+  StartRun();
+  for (size_t i = 0; i < BENCH_OPS; i++) {
+    void *p = AU_FSA_Alloc(&fsa);
+    acc += (uintptr_t)p;
+    AU_FSA_Free(&fsa, p);
+  }
+  StopRun();
+  AU_FSA_Destroy(&fsa);
+  bench_sink = acc;
+  return BENCH_OPS;
+}
+
+// Allocate BENCH_LIVE elements, free them all, repeat.
+static size_t
+BenchFSABatch(void) {
+  AU_FixedSizeAllocator fsa;
+  void **ptrs = malloc(BENCH_LIVE * sizeof *ptrs);
+  if (!ptrs || AU_FSA_Setup(&fsa, 32, BENCH_LIVE) < 0) {
+    free(ptrs);
+    return 0;
+  }
+  StartRun();
+  for (size_t r = 0; r < BENCH_OPS / BENCH_LIVE; r++) {
+    for (size_t i = 0; i < BENCH_LIVE; i++) {
+      ptrs[i] = AU_FSA_Alloc(&fsa);
+    }
+    for (size_t i = 0; i < BENCH_LIVE; i++) {
+      AU_FSA_Free(&fsa, ptrs[i]);
+    }
+  }
+  StopRun();
+  AU_FSA_Destroy(&fsa);
+  free(ptrs);
+  return BENCH_OPS;
+}
+
+/*
+ * Free list traversal after a random free order: the free list then hops all
+ * over the regions, which is what a long running FSA ends up looking like.
+ * Every allocated element gets written so the misses show up.
+ */
+static size_t
+BenchFSAScattered(void) {
+  AU_FixedSizeAllocator fsa;
+  void **ptrs = malloc(BENCH_LIVE * sizeof *ptrs);
+  if (!ptrs || AU_FSA_Setup(&fsa, 32, BENCH_LIVE) < 0) {
+    free(ptrs);
+    return 0;
+  }
+  for (size_t i = 0; i < BENCH_LIVE; i++) {
+    ptrs[i] = AU_FSA_Alloc(&fsa);
+  }
+  Shuffle(ptrs, BENCH_LIVE, 0x9e3779b97f4a7c15u);
+  for (size_t i = 0; i < BENCH_LIVE; i++) {
+    AU_FSA_Free(&fsa, ptrs[i]);
+  }
+  StartRun();
+  for (size_t r = 0; r < BENCH_OPS / BENCH_LIVE; r++) {
+    for (size_t i = 0; i < BENCH_LIVE; i++) {
+      ptrs[i] = AU_FSA_Alloc(&fsa);
+      memset(ptrs[i], (int)i, 32);
+    }
+    // Freeing in reverse makes the next round hop through the same order.
+    for (size_t i = BENCH_LIVE; i > 0; i--) {
+      AU_FSA_Free(&fsa, ptrs[i - 1]);
+    }
+  }
+  StopRun();
+  AU_FSA_Destroy(&fsa);
+  free(ptrs);
+  return BENCH_OPS;
+}
+
+// Small appends into a byte builder starting from a tiny capacity.
+static size_t
+BenchB1Append(void) {
+  static const char chunk[13] = "hello, world";
+  AU_ByteBuilder b1;
+  if (AU_B1_Setup(&b1, 16) < 0) {
+    return 0;
+  }
+  StartRun();
+  for (size_t i = 0; i < BENCH_OPS; i++) {
+    if (AU_B1_Append(&b1, chunk, sizeof chunk) < 0) {
+      break;
+    }
+  }
+  StopRun();
+  bench_sink = AU_B1_GetUsedCount(&b1);
+  free(AU_B1_GetMemory(&b1));
+  return BENCH_OPS;
+}
+
+// The same, with a CRC32C attached to the builder.
+static size_t
+BenchB1AppendCRC(void) {
+  static const char chunk[13] = "hello, world";
+  AU_ByteBuilder b1;
+  AU_Checksum ck;
+  if (AU_B1_Setup(&b1, 16) < 0) {
+    return 0;
+  }
+  AU_CK_Setup(&ck, AU_CK_CRC32C, 0);
+  AU_B1_SetChecksum(&b1, &ck);
+  StartRun();
+  for (size_t i = 0; i < BENCH_OPS; i++) {
+    if (AU_B1_Append(&b1, chunk, sizeof chunk) < 0) {
+      break;
+    }
+  }
+  bench_sink = AU_B1_GetChecksum(&b1);
+  StopRun();
+  free(AU_B1_GetMemory(&b1));
+  return BENCH_OPS;
+}
+
+/*
+ * Builder churn, like a request loop: set up a builder, append a few hundred
+ * bytes to it, and get rid of it. Once with xmalloc/xfree, once with the
+ * buffer pool.
+ */
+
+enum {
+  CHURN_APPENDS = 24
+};
+
+static size_t
+BenchB1Churn(void) {
+  static const char chunk[16] = "0123456789abcde";
+  StartRun();
+  for (size_t i = 0; i < BENCH_OPS / CHURN_APPENDS; i++) {
+    AU_ByteBuilder b1;
+    if (AU_B1_Setup(&b1, 64) < 0) {
+      break;
+    }
+    for (int j = 0; j < CHURN_APPENDS; j++) {
+      AU_B1_Append(&b1, chunk, sizeof chunk);
+    }
+    bench_sink = AU_B1_GetUsedCount(&b1);
+    free(AU_B1_GetMemory(&b1));
+  }
+  StopRun();
+  return BENCH_OPS / CHURN_APPENDS;
+}
+
+static size_t
+BenchB1PoolChurn(void) {
+  static const char chunk[16] = "0123456789abcde";
+  StartRun();
+  for (size_t i = 0; i < BENCH_OPS / CHURN_APPENDS; i++) {
+    AU_ByteBuilder b1;
+    if (AU_B1_SetupFromPool(&b1, 64) < 0) {
+      break;
+    }
+    for (int j = 0; j < CHURN_APPENDS; j++) {
+      AU_B1_Append(&b1, chunk, sizeof chunk);
+    }
+    bench_sink = AU_B1_GetUsedCount(&b1);
+    AU_B1_Release(&b1);
+  }
+  StopRun();
+  AU_B1_TrimPool();
+  return BENCH_OPS / CHURN_APPENDS;
+}
+
+// Single element appends into a fixed size builder.
+static size_t
+BenchFSBAppend(void) {
+  AU_FixedSizeBuilder fsb;
+  if (AU_FSB_Setup(&fsb, sizeof (uint64_t), 16) < 0) {
+    return 0;
+  }
+  StartRun();
+  for (uint64_t i = 0; i < BENCH_OPS; i++) {
+    if (AU_FSB_Append(&fsb, &i, 1) < 0) {
+      break;
+    }
+  }
+  StopRun();
+  bench_sink = AU_FSB_GetUsedCount(&fsb);
+  free(AU_FSB_GetMemory(&fsb));
+  return BENCH_OPS;
+}
+
+/////////////////////////////////////
+//// Multithreaded Benchmarks ///////
+/////////////////////////////////////
+
+/*
+ * AU instances aren't shared between threads. Each thread gets its own set of
+ * allocators, which is how a concurrent program is expected to use AU today.
+ *
+ * A node from one FSA can be freed into any other FSA with the same element
+ * size, since node layouts are the same. That's what makes cross thread frees
+ * possible here without locks: the memory migrates to the freeing thread's
+ * allocator. Because of that, no allocator is destroyed until every thread is
+ * done.
+ *
+ * The size classes are just an array of FSAs with power of two element sizes.
+ */
+
+enum {
+  SC_MIN_SHIFT = 4,
+  SC_COUNT = 5,
+  SC_MAX_SIZE = 1 << (SC_MIN_SHIFT + SC_COUNT - 1),
+
+  SC_INITIAL_CAP = 1024
+};
+
+struct SizeClasses {
+  AU_FixedSizeAllocator fsa[SC_COUNT];
+};
+
+static int
+SCSetup(struct SizeClasses *sc) {
+  for (int i = 0; i < SC_COUNT; i++) {
+    if (AU_FSA_Setup(&sc->fsa[i], (size_t)1 << (SC_MIN_SHIFT + i),
+                     SC_INITIAL_CAP) < 0) {
+      while (i-- > 0) {
+        AU_FSA_Destroy(&sc->fsa[i]);
+      }
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void
+SCDestroy(struct SizeClasses *sc) {
+  for (int i = 0; i < SC_COUNT; i++) {
+    AU_FSA_Destroy(&sc->fsa[i]);
+  }
+}
+
+static int
+SCClass(size_t size) {
+  int c = 0;
+  while (((size_t)1 << (SC_MIN_SHIFT + c)) < size) {
+    c++;
+  }
+  return c;
+}
+
+static void *
+SCAlloc(struct SizeClasses *sc, size_t size) {
+  return AU_FSA_Alloc(&sc->fsa[SCClass(size)]);
+}
+
+static void
+SCFree(struct SizeClasses *sc, void *p, size_t size) {
+  AU_FSA_Free(&sc->fsa[SCClass(size)], p);
+}
+
+struct MTContext;
+
+struct MTThread {
+  struct MTContext *ctx;
+  int id;
+  pthread_t tid;
+  struct SizeClasses sc;
+  uint64_t rng;
+  void *data;
+  size_t ops;
+};
+
+struct MTContext {
+  int nthreads;
+  pthread_barrier_t barrier;
+  pthread_barrier_t round_barrier;
+  struct MTThread threads[BENCH_MAX_THREADS];
+  void *(*body)(void *);
+  void *shared;
+};
+
+/*
+ * Sets up a size class set per thread, runs body on nthreads threads and
+ * measures from the moment all of them are ready to go until the last one is
+ * joined. Returns the total operations, or 0 on failure.
+ */
+static size_t
+RunThreads(struct MTContext *ctx, int nthreads, void *(*body)(void *)) {
+  int ready = 0;
+  size_t ops = 0;
+
+  ctx->nthreads = nthreads;
+  ctx->body = body;
+  if (pthread_barrier_init(&ctx->barrier, 0, (unsigned)nthreads + 1) != 0) {
+    return 0;
+  }
+  for (; ready < nthreads; ready++) {
+    struct MTThread *t = &ctx->threads[ready];
+    t->ctx = ctx;
+    t->id = ready;
+    t->rng = 0x2545f4914f6cdd1du * (uint64_t)(ready + 1);
+    t->ops = 0;
+    if (SCSetup(&t->sc) < 0) {
+      break;
+    }
+  }
+  if (ready < nthreads) {
+    goto out;
+  }
+  int started = 0;
+  for (; started < nthreads; started++) {
+    struct MTThread *t = &ctx->threads[started];
+    if (pthread_create(&t->tid, 0, body, t) != 0) {
+      break;
+    }
+  }
+  if (started < nthreads) {
+    // The barrier can't be passed anymore. There is no good way out.
+    fprintf(stderr, "AUBench: pthread_create failed\n");
+    exit(EXIT_FAILURE);
+  }
+  pthread_barrier_wait(&ctx->barrier);
+  StartRun();
+  for (int i = 0; i < nthreads; i++) {
+    pthread_join(ctx->threads[i].tid, 0);
+    ops += ctx->threads[i].ops;
+  }
+  StopRun();
+
+out:
+  for (int i = 0; i < ready; i++) {
+    SCDestroy(&ctx->threads[i].sc);
+  }
+  pthread_barrier_destroy(&ctx->barrier);
+  return ops;
+}
+
+static size_t
+RandomSize(uint64_t *rng) {
+  return 8 + NextRand(rng) % (SC_MAX_SIZE - 8 + 1);
+}
+
+/*
+ * Larson server simulation. Every thread owns an array of slots and keeps
+ * replacing a random one: free what's there, allocate a block of a random
+ * size. After each round, slot arrays are handed over to the next thread, so
+ * most frees are of memory some other thread allocated.
+ */
+
+enum {
+  LARSON_SLOTS = 1024,
+  LARSON_ROUNDS = 16
+};
+
+struct LarsonSlot {
+  void *p;
+  size_t size;
+};
+
+static void *
+LarsonThread(void *arg) {
+  struct MTThread *t = arg;
+  struct MTContext *ctx = t->ctx;
+  size_t per_round = BENCH_MT_OPS / LARSON_ROUNDS;
+
+  pthread_barrier_wait(&ctx->barrier);
+  for (int r = 0; r < LARSON_ROUNDS; r++) {
+    struct LarsonSlot *slots = ctx->threads[(t->id + r) % ctx->nthreads].data;
+    for (size_t i = 0; i < per_round; i++) {
+      struct LarsonSlot *s = &slots[NextRand(&t->rng) % LARSON_SLOTS];
+      if (s->p) {
+        SCFree(&t->sc, s->p, s->size);
+      }
+      s->size = RandomSize(&t->rng);
+      s->p = SCAlloc(&t->sc, s->size);
+      memset(s->p, 0, 8);
+    }
+    t->ops += per_round;
+    pthread_barrier_wait(&ctx->round_barrier);
+  }
+  return 0;
+}
+
+static size_t
+BenchLarson(struct MTContext *ctx, int nthreads) {
+  // Slots start out empty and get filled by the threads themselves, so every
+  // block comes from some thread's own allocators.
+  struct LarsonSlot *slots = calloc((size_t)nthreads * LARSON_SLOTS,
+                                    sizeof *slots);
+  if (!slots) {
+    return 0;
+  }
+  if (pthread_barrier_init(&ctx->round_barrier, 0, (unsigned)nthreads) != 0) {
+    free(slots);
+    return 0;
+  }
+  for (int i = 0; i < nthreads; i++) {
+    ctx->threads[i].data = slots + (size_t)i * LARSON_SLOTS;
+  }
+  size_t ops = RunThreads(ctx, nthreads, LarsonThread);
+  pthread_barrier_destroy(&ctx->round_barrier);
+  free(slots);
+  return ops;
+}
+
+/*
+ * threadtest: every thread allocates a batch of blocks and frees them all,
+ * over and over. No memory crosses threads, so this is pure scalability.
+ */
+
+enum {
+  THREADTEST_BATCH = 4096
+};
+
+static void *
+ThreadtestThread(void *arg) {
+  struct MTThread *t = arg;
+  void **ptrs = t->data;
+
+  pthread_barrier_wait(&t->ctx->barrier);
+  for (size_t r = 0; r < BENCH_MT_OPS / THREADTEST_BATCH; r++) {
+    for (size_t i = 0; i < THREADTEST_BATCH; i++) {
+      ptrs[i] = SCAlloc(&t->sc, 64);
+      memset(ptrs[i], 0, 8);
+    }
+    for (size_t i = 0; i < THREADTEST_BATCH; i++) {
+      SCFree(&t->sc, ptrs[i], 64);
+    }
+    t->ops += THREADTEST_BATCH;
+  }
+  return 0;
+}
+
+static size_t
+BenchThreadtest(struct MTContext *ctx, int nthreads) {
+  void **ptrs = malloc((size_t)nthreads * THREADTEST_BATCH * sizeof *ptrs);
+  if (!ptrs) {
+    return 0;
+  }
+  for (int i = 0; i < nthreads; i++) {
+    ctx->threads[i].data = ptrs + (size_t)i * THREADTEST_BATCH;
+  }
+  size_t ops = RunThreads(ctx, nthreads, ThreadtestThread);
+  free(ptrs);
+  return ops;
+}
+
+/*
+ * Producer/consumer: thread i allocates blocks and passes them through a
+ * single producer single consumer ring to thread i+1, which frees them. The
+ * memory flows around the ring of threads, always freed by a thread other
+ * than the allocating one (with one thread, it passes blocks to itself).
+ */
+
+enum {
+  RING_SIZE = 1024,
+  CACHE_LINE = 64
+};
+
+struct Ring {
+  size_t head;
+  char pad0[CACHE_LINE - sizeof (size_t)];
+  size_t tail;
+  char pad1[CACHE_LINE - sizeof (size_t)];
+  void *slots[RING_SIZE];
+};
+
+static void *
+ProdConsThread(void *arg) {
+  struct MTThread *t = arg;
+  struct MTContext *ctx = t->ctx;
+  struct Ring *rings = ctx->shared;
+  struct Ring *out = &rings[t->id];
+  struct Ring *in = &rings[(t->id + ctx->nthreads - 1) % ctx->nthreads];
+  size_t produced = 0, consumed = 0;
+
+  pthread_barrier_wait(&ctx->barrier);
+  while (produced < BENCH_MT_OPS || consumed < BENCH_MT_OPS) {
+    size_t progress = produced + consumed;
+    size_t tail = __atomic_load_n(&out->tail, __ATOMIC_RELAXED);
+    size_t head = __atomic_load_n(&out->head, __ATOMIC_ACQUIRE);
+    while (produced < BENCH_MT_OPS && tail - head < RING_SIZE) {
+      void *p = SCAlloc(&t->sc, 64);
+      memset(p, 0, 8);
+      out->slots[tail % RING_SIZE] = p;
+      tail++;
+      produced++;
+    }
+    __atomic_store_n(&out->tail, tail, __ATOMIC_RELEASE);
+
+    head = __atomic_load_n(&in->head, __ATOMIC_RELAXED);
+    tail = __atomic_load_n(&in->tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+      SCFree(&t->sc, in->slots[head % RING_SIZE], 64);
+      head++;
+      consumed++;
+    }
+    __atomic_store_n(&in->head, head, __ATOMIC_RELEASE);
+
+    // Don't spin through the whole time slice when the neighbours are
+    // behind (e.g. more threads than processors).
+    if (produced + consumed == progress) {
+      sched_yield();
+    }
+  }
+  t->ops = produced;
+  return 0;
+}
+
+static size_t
+BenchProdCons(struct MTContext *ctx, int nthreads) {
+  struct Ring *rings = calloc((size_t)nthreads, sizeof *rings);
+  if (!rings) {
+    return 0;
+  }
+  ctx->shared = rings;
+  size_t ops = RunThreads(ctx, nthreads, ProdConsThread);
+  free(rings);
+  return ops;
+}
+
+/*
+ * cache-scratch (passive false sharing): the main thread allocates one small
+ * block per thread from a single allocator, so they're neighbours in memory,
+ * and hands them out. Each thread frees its block and then repeatedly
+ * allocates, writes and frees a block of the same size. An allocator that
+ * hands the freed block right back keeps threads writing to the same cache
+ * lines.
+ */
+
+enum {
+  SCRATCH_WRITES = 16
+};
+
+static void *
+ScratchThread(void *arg) {
+  struct MTThread *t = arg;
+
+  pthread_barrier_wait(&t->ctx->barrier);
+  SCFree(&t->sc, t->data, 16);
+  for (size_t i = 0; i < BENCH_MT_OPS; i++) {
+    volatile char *p = SCAlloc(&t->sc, 16);
+    for (int w = 0; w < SCRATCH_WRITES; w++) {
+      p[w % 16] = (char)(p[w % 16] + 1);
+    }
+    SCFree(&t->sc, (void*)p, 16);
+  }
+  t->ops = BENCH_MT_OPS;
+  return 0;
+}
+
+static size_t
+BenchScratch(struct MTContext *ctx, int nthreads) {
+  AU_FixedSizeAllocator shared;
+  if (AU_FSA_Setup(&shared, 16, (size_t)nthreads) < 0) {
+    return 0;
+  }
+  for (int i = 0; i < nthreads; i++) {
+    ctx->threads[i].data = AU_FSA_Alloc(&shared);
+  }
+  size_t ops = RunThreads(ctx, nthreads, ScratchThread);
+  AU_FSA_Destroy(&shared);
+  return ops;
+}
+
+// The same two, through the type specialized functions.
+
+struct BenchElt {
+  char bytes[32];
+};
+
+AU_DEFINE_FSA(BenchPool, struct BenchElt)
+AU_DEFINE_FSB(BenchVec, uint64_t)
+
+static size_t
+BenchFSATyped(void) {
+  BenchPool pool;
+  if (BenchPool_Setup(&pool, BENCH_LIVE) < 0) {
+    return 0;
+  }
+  uintptr_t acc = 0;
+  StartRun();
+  for (size_t i = 0; i < BENCH_OPS; i++) {
+    struct BenchElt *p = BenchPool_Alloc(&pool);
+    acc += (uintptr_t)p;
+    BenchPool_Free(&pool, p);
+  }
+  StopRun();
+  BenchPool_Destroy(&pool);
+  bench_sink = acc;
+  return BENCH_OPS;
+}
+
+static size_t
+BenchFSBTyped(void) {
+  BenchVec vec;
+  if (BenchVec_Setup(&vec, 16) < 0) {
+    return 0;
+  }
+  StartRun();
+  for (uint64_t i = 0; i < BENCH_OPS; i++) {
+    if (BenchVec_Push(&vec, i) < 0) {
+      break;
+    }
+  }
+  StopRun();
+  bench_sink = BenchVec_GetUsedCount(&vec);
+  free(BenchVec_GetMemory(&vec));
+  return BENCH_OPS;
+}
+
+/*
+ * Codecs: BENCH_LIVE values of mixed lengths (mostly short ones, as with
+ * lengths and deltas), encoded and decoded over and over.
+ */
+
+static uint32_t *
+CodecValues(void) {
+  uint32_t *vals = malloc(BENCH_LIVE * sizeof *vals);
+  if (vals) {
+    uint64_t seed = 0x2545f4914f6cdd1du;
+    for (size_t i = 0; i < BENCH_LIVE; i++) {
+      uint64_t r = NextRand(&seed);
+      vals[i] = (uint32_t)(r >> 32) >> (r % 32);
+    }
+  }
+  return vals;
+}
+
+static size_t
+BenchCodec(int (*encode)(AU_ByteBuilder*, const uint32_t*, size_t),
+           int (*decode)(AU_FixedSizeBuilder*, const void*, size_t, size_t,
+                         size_t*),
+           int measure_decode) {
+  uint32_t *vals = CodecValues();
+  AU_ByteBuilder b1;
+  AU_FixedSizeBuilder fsb;
+  if (!vals || AU_B1_Setup(&b1, BENCH_LIVE) < 0) {
+    free(vals);
+    return 0;
+  }
+  if (AU_FSB_Setup(&fsb, sizeof (uint32_t), BENCH_LIVE) < 0) {
+    free(AU_B1_GetMemory(&b1));
+    free(vals);
+    return 0;
+  }
+  if (measure_decode) {
+    encode(&b1, vals, BENCH_LIVE);
+  }
+  StartRun();
+  for (size_t r = 0; r < BENCH_OPS / BENCH_LIVE; r++) {
+    if (measure_decode) {
+      AU_FSB_DiscardAppends(&fsb);
+      decode(&fsb, AU_B1_GetMemory(&b1), AU_B1_GetUsedCount(&b1),
+             BENCH_LIVE, 0);
+    } else {
+      AU_B1_DiscardAppends(&b1);
+      encode(&b1, vals, BENCH_LIVE);
+    }
+  }
+  StopRun();
+  bench_sink = AU_B1_GetUsedCount(&b1) + AU_FSB_GetUsedCount(&fsb);
+  free(AU_FSB_GetMemory(&fsb));
+  free(AU_B1_GetMemory(&b1));
+  free(vals);
+  return BENCH_OPS / BENCH_LIVE * BENCH_LIVE;
+}
+
+static size_t
+BenchVarintEncode(void) {
+  return BenchCodec(AU_B1_AppendVarintsU32, AU_FSB_DecodeVarintsU32, 0);
+}
+
+static size_t
+BenchVarintDecode(void) {
+  return BenchCodec(AU_B1_AppendVarintsU32, AU_FSB_DecodeVarintsU32, 1);
+}
+
+static size_t
+BenchSVBEncode(void) {
+  return BenchCodec(AU_B1_AppendStreamVByte, AU_FSB_DecodeStreamVByte, 0);
+}
+
+static size_t
+BenchSVBDecode(void) {
+  return BenchCodec(AU_B1_AppendStreamVByte, AU_FSB_DecodeStreamVByte, 1);
+}
+
+/*
+ * Text encodings, over BENCH_LIVE bytes of mostly printable text at a time.
+ * Operations are input bytes.
+ */
+static size_t
+BenchText(int (*encode)(AU_ByteBuilder*, const void*, size_t)) {
+  unsigned char *text = malloc(BENCH_LIVE);
+  AU_ByteBuilder b1;
+  if (!text || AU_B1_Setup(&b1, BENCH_LIVE) < 0) {
+    free(text);
+    return 0;
+  }
+  uint64_t seed = 0x9e3779b97f4a7c15u;
+  for (size_t i = 0; i < BENCH_LIVE; i++) {
+    uint64_t r = NextRand(&seed);
+    text[i] = (unsigned char)(r % 64 == 0 ? '"' : ' ' + r % 95);
+  }
+  StartRun();
+  for (size_t r = 0; r < BENCH_OPS / BENCH_LIVE; r++) {
+    AU_B1_DiscardAppends(&b1);
+    encode(&b1, text, BENCH_LIVE);
+  }
+  StopRun();
+  bench_sink = AU_B1_GetUsedCount(&b1);
+  free(AU_B1_GetMemory(&b1));
+  free(text);
+  return BENCH_OPS / BENCH_LIVE * BENCH_LIVE;
+}
+
+static size_t
+BenchBase64Encode(void) {
+  return BenchText(AU_B1_AppendBase64);
+}
+
+static size_t
+BenchHexEncode(void) {
+  return BenchText(AU_B1_AppendHex);
+}
+
+static size_t
+BenchJSONEscape(void) {
+  return BenchText(AU_B1_AppendJSONEscaped);
+}
+
+/*
+ * LZ compression of BENCH_LIVE bytes of log-like lines at a time, and
+ * decompression of the result. Operations are uncompressed bytes.
+ */
+static size_t
+BenchLZ(int decode) {
+  char *text = malloc(BENCH_LIVE + 128);
+  AU_ByteBuilder packed, b1;
+  if (!text || AU_B1_Setup(&packed, BENCH_LIVE) < 0) {
+    free(text);
+    return 0;
+  }
+  if (AU_B1_Setup(&b1, BENCH_LIVE) < 0) {
+    free(AU_B1_GetMemory(&packed));
+    free(text);
+    return 0;
+  }
+  uint64_t seed = 0x9e3779b97f4a7c15u;
+  for (size_t n = 0; n < BENCH_LIVE; ) {
+    uint64_t r = NextRand(&seed);
+    n += (size_t)sprintf(text + n, "%02u:%02u:%02u INFO get /items/%u %s %u\n",
+                         (unsigned)(r % 24), (unsigned)(r >> 8) % 60,
+                         (unsigned)(r >> 16) % 60, (unsigned)(r >> 24) % 1000,
+                         r >> 40 & 1 ? "200" : "404",
+                         (unsigned)(r >> 42) % 100000);
+  }
+  AU_B1_AppendLZ(&packed, text, BENCH_LIVE);
+  StartRun();
+  for (size_t r = 0; r < BENCH_OPS / BENCH_LIVE; r++) {
+    if (decode) {
+      AU_B1_DiscardAppends(&b1);
+      AU_B1_DecodeLZ(&b1, AU_B1_GetMemory(&packed),
+                     AU_B1_GetUsedCount(&packed));
+    } else {
+      AU_B1_DiscardAppends(&packed);
+      AU_B1_AppendLZ(&packed, text, BENCH_LIVE);
+    }
+  }
+  StopRun();
+  bench_sink = AU_B1_GetUsedCount(&packed) + AU_B1_GetUsedCount(&b1);
+  free(AU_B1_GetMemory(&b1));
+  free(AU_B1_GetMemory(&packed));
+  free(text);
+  return BENCH_OPS / BENCH_LIVE * BENCH_LIVE;
+}
+
+static size_t
+BenchLZCompress(void) {
+  return BenchLZ(0);
+}
+
+static size_t
+BenchLZDecompress(void) {
+  return BenchLZ(1);
+}
+
+/*
+ * Summing one field of BENCH_LIVE rows of 4 fields, stored as an array of
+ * structs, and as columns. Operations are rows.
+ */
+
+struct BenchRow {
+  uint64_t id;
+  uint64_t ts;
+  uint32_t value;
+  uint32_t flags;
+};
+
+static size_t
+BenchRowScan(void) {
+  struct BenchRow *rows = malloc(BENCH_LIVE * sizeof *rows);
+  if (!rows) {
+    return 0;
+  }
+  for (size_t i = 0; i < BENCH_LIVE; i++) {
+    rows[i].id = i;
+    rows[i].ts = i*7;
+    rows[i].value = (uint32_t)i;
+    rows[i].flags = 0;
+  }
+  uint64_t sum = 0;
+  StartRun();
+  for (size_t r = 0; r < BENCH_OPS / BENCH_LIVE; r++) {
+    for (size_t i = 0; i < BENCH_LIVE; i++) {
+      sum += rows[i].value;
+    }
+  }
+  StopRun();
+  bench_sink = sum;
+  free(rows);
+  return BENCH_OPS / BENCH_LIVE * BENCH_LIVE;
+}
+
+static size_t
+BenchColumnScan(void) {
+  static const size_t sizes[4] = {8, 8, 4, 4};
+  AU_ColumnBuilder cb;
+  if (AU_COL_Setup(&cb, sizes, 4, 1024) < 0) {
+    return 0;
+  }
+  for (size_t i = 0; i < BENCH_LIVE; i++) {
+    uint64_t id = i, ts = i*7;
+    uint32_t value = (uint32_t)i, flags = 0;
+    const void *fields[4] = {&id, &ts, &value, &flags};
+    if (AU_COL_AppendRow(&cb, fields) < 0) {
+      AU_COL_Destroy(&cb);
+      return 0;
+    }
+  }
+  const uint32_t *values = AU_COL_GetColumn(&cb, 2);
+  uint64_t sum = 0;
+  StartRun();
+  for (size_t r = 0; r < BENCH_OPS / BENCH_LIVE; r++) {
+    for (size_t i = 0; i < BENCH_LIVE; i++) {
+      sum += values[i];
+    }
+  }
+  StopRun();
+  bench_sink = sum;
+  AU_COL_Destroy(&cb);
+  return BENCH_OPS / BENCH_LIVE * BENCH_LIVE;
+}
+
+/*
+ * Ordered indexes of BENCH_TREE_KEYS entries: the B+-tree against glibc's
+ * tsearch, which is a red-black tree (with one more pointer per entry, to the
+ * key, which is kept in an array here). Keys are i times an odd constant, so
+ * they're distinct and come in no particular order.
+ */
+
+static uint64_t
+TreeKey(size_t i) {
+  return (uint64_t)i * 0x9E3779B97F4A7C15u;
+}
+
+static int
+CompareU64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+static void
+FreeNothing(void *p) {
+  (void)p;
+}
+
+/*
+ * A bulk loaded tree of the keys. Values are the keys' indices.
+ */
+static int
+TreeSetupLoaded(AU_BTree *bt) {
+  AU_FixedSizeBuilder fsb;
+  if (AU_FSB_Setup(&fsb, sizeof (AU_BTEntry), BENCH_TREE_KEYS) < 0) {
+    return -1;
+  }
+  AU_BTEntry *entries = AU_FSB_AppendForSetup(&fsb, BENCH_TREE_KEYS);
+  for (size_t i = 0; i < BENCH_TREE_KEYS; i++) {
+    entries[i].key = TreeKey(i);
+    entries[i].value = i;
+  }
+  qsort(entries, BENCH_TREE_KEYS, sizeof *entries, CompareU64);
+  int res = AU_BT_Setup(bt, BENCH_TREE_KEYS);
+  if (res == 0) {
+    res = AU_BT_BulkLoad(bt, &fsb);
+    if (res < 0) {
+      AU_BT_Destroy(bt);
+    }
+  }
+  AU_FSB_Destroy(&fsb);
+  return res;
+}
+
+static size_t
+BenchBTBulkLoad(void) {
+  AU_FixedSizeBuilder fsb;
+  AU_BTree bt;
+  if (AU_FSB_Setup(&fsb, sizeof (AU_BTEntry), BENCH_TREE_KEYS) < 0) {
+    return 0;
+  }
+  AU_BTEntry *entries = AU_FSB_AppendForSetup(&fsb, BENCH_TREE_KEYS);
+  for (size_t i = 0; i < BENCH_TREE_KEYS; i++) {
+    entries[i].key = i;
+    entries[i].value = i;
+  }
+  if (AU_BT_Setup(&bt, BENCH_TREE_KEYS) < 0) {
+    AU_FSB_Destroy(&fsb);
+    return 0;
+  }
+  StartRun();
+  int res = AU_BT_BulkLoad(&bt, &fsb);
+  StopRun();
+  AU_BT_Destroy(&bt);
+  AU_FSB_Destroy(&fsb);
+  return res < 0 ? 0 : BENCH_TREE_KEYS;
+}
+
+static size_t
+BenchBTInsert(void) {
+  AU_BTree bt;
+  if (AU_BT_Setup(&bt, BENCH_TREE_KEYS) < 0) {
+    return 0;
+  }
+  int res = 0;
+  StartRun();
+  for (size_t i = 0; i < BENCH_TREE_KEYS && res == 0; i++) {
+    res = AU_BT_Insert(&bt, TreeKey(i), i);
+  }
+  StopRun();
+  AU_BT_Destroy(&bt);
+  return res < 0 ? 0 : BENCH_TREE_KEYS;
+}
+
+static size_t
+BenchBTFind(void) {
+  AU_BTree bt;
+  if (TreeSetupLoaded(&bt) < 0) {
+    return 0;
+  }
+  uint64_t seed = 88172645463325252u, acc = 0, v = 0;
+  StartRun();
+  for (size_t i = 0; i < BENCH_OPS; i++) {
+    size_t k = NextRand(&seed) % BENCH_TREE_KEYS;
+    acc += AU_BT_Find(&bt, TreeKey(k), &v);
+    acc += v;
+  }
+  StopRun();
+  AU_BT_Destroy(&bt);
+  bench_sink = acc;
+  return BENCH_OPS;
+}
+
+static size_t
+BenchBTScan(void) {
+  AU_BTree bt;
+  if (TreeSetupLoaded(&bt) < 0) {
+    return 0;
+  }
+  AU_BTCursor cur;
+  uint64_t acc = 0, v;
+  StartRun();
+  AU_BT_Seek(&bt, 0, &cur);
+  while (AU_BT_Next(&cur, 0, &v)) {
+    acc += v;
+  }
+  StopRun();
+  AU_BT_Destroy(&bt);
+  bench_sink = acc;
+  return BENCH_TREE_KEYS;
+}
+
+static size_t
+BenchRBInsert(void) {
+  uint64_t *keys = malloc(BENCH_TREE_KEYS * sizeof *keys);
+  if (!keys) {
+    return 0;
+  }
+  for (size_t i = 0; i < BENCH_TREE_KEYS; i++) {
+    keys[i] = TreeKey(i);
+  }
+  void *root = 0;
+  int ok = 1;
+  StartRun();
+  for (size_t i = 0; i < BENCH_TREE_KEYS && ok; i++) {
+    ok = tsearch(&keys[i], &root, CompareU64) != 0;
+  }
+  StopRun();
+  tdestroy(root, FreeNothing);
+  free(keys);
+  return ok ? BENCH_TREE_KEYS : 0;
+}
+
+static size_t
+BenchRBFind(void) {
+  uint64_t *keys = malloc(BENCH_TREE_KEYS * sizeof *keys);
+  if (!keys) {
+    return 0;
+  }
+  void *root = 0;
+  for (size_t i = 0; i < BENCH_TREE_KEYS; i++) {
+    keys[i] = TreeKey(i);
+    if (!tsearch(&keys[i], &root, CompareU64)) {
+      tdestroy(root, FreeNothing);
+      free(keys);
+      return 0;
+    }
+  }
+  uint64_t seed = 88172645463325252u, acc = 0;
+  StartRun();
+  for (size_t i = 0; i < BENCH_OPS; i++) {
+    uint64_t k = TreeKey(NextRand(&seed) % BENCH_TREE_KEYS);
+    void *node = tfind(&k, &root, CompareU64);
+    acc += node ? **(uint64_t**)node : 0;
+  }
+  StopRun();
+  tdestroy(root, FreeNothing);
+  free(keys);
+  bench_sink = acc;
+  return BENCH_OPS;
+}
+
+struct Benchmark {
+  const char *name;
+  size_t (*run)(void);
+  size_t (*run_mt)(struct MTContext *ctx, int nthreads);
+};
+
+static const struct Benchmark benchmarks[] = {
+  {"fsa_alloc_free", BenchFSAAllocFree, 0},
+  {"fsa_batch", BenchFSABatch, 0},
+  {"fsa_scattered", BenchFSAScattered, 0},
+  {"b1_append", BenchB1Append, 0},
+  {"b1_append_crc", BenchB1AppendCRC, 0},
+  {"fsb_append", BenchFSBAppend, 0},
+  {"b1_churn", BenchB1Churn, 0},
+  {"b1_pool_churn", BenchB1PoolChurn, 0},
+  {"fsa_typed", BenchFSATyped, 0},
+  {"fsb_typed", BenchFSBTyped, 0},
+  {"varint_encode", BenchVarintEncode, 0},
+  {"varint_decode", BenchVarintDecode, 0},
+  {"svb_encode", BenchSVBEncode, 0},
+  {"svb_decode", BenchSVBDecode, 0},
+  {"base64_encode", BenchBase64Encode, 0},
+  {"hex_encode", BenchHexEncode, 0},
+  {"json_escape", BenchJSONEscape, 0},
+  {"lz_compress", BenchLZCompress, 0},
+  {"lz_decompress", BenchLZDecompress, 0},
+  {"row_scan", BenchRowScan, 0},
+  {"column_scan", BenchColumnScan, 0},
+  {"bt_bulk_load", BenchBTBulkLoad, 0},
+  {"bt_insert", BenchBTInsert, 0},
+  {"bt_find", BenchBTFind, 0},
+  {"bt_scan", BenchBTScan, 0},
+  {"rb_insert", BenchRBInsert, 0},
+  {"rb_find", BenchRBFind, 0},
+  {"mt_larson", 0, BenchLarson},
+  {"mt_threadtest", 0, BenchThreadtest},
+  {"mt_prodcons", 0, BenchProdCons},
+  {"mt_scratch", 0, BenchScratch}
+};
+
+static double
+RunSeconds(void) {
+  return (double)(run_stop.tv_sec - run_start.tv_sec)
+         + (double)(run_stop.tv_nsec - run_start.tv_nsec) * 1e-9;
+}
+
+static void
+PrintHeader(void) {
+  printf("%-18s %10s", "benchmark", "ns/op");
+  for (size_t i = 0; i < NUM_COUNTERS; i++) {
+    printf(" %10s", counters[i].name);
+  }
+  printf("\n");
+}
+
+static void
+PrintCounters(size_t ops) {
+  for (size_t i = 0; i < NUM_COUNTERS; i++) {
+    double v = ReadCounter(&counters[i]);
+    if (v < 0) {
+      printf(" %10s", "-");
+    } else {
+      printf(" %10.3f", v / (double)ops);
+    }
+  }
+  printf("\n");
+}
+
+static void
+Report(const char *name, size_t ops) {
+  printf("%-18s %10.2f", name, RunSeconds() * 1e9 / (double)ops);
+  PrintCounters(ops);
+}
+
+/*
+ * Multithreaded results are throughput (operations of all threads together
+ * per second) and how it scaled relative to one thread. Counters are summed
+ * over the threads.
+ */
+static void
+PrintHeaderMT(void) {
+  printf("%-18s %7s %10s %7s", "benchmark", "threads", "Mops/s", "scaling");
+  for (size_t i = 0; i < NUM_COUNTERS; i++) {
+    printf(" %10s", counters[i].name);
+  }
+  printf("\n");
+}
+
+static void
+RunMT(const struct Benchmark *b, struct MTContext *ctx, int max_threads) {
+  double base = 0;
+  for (int n = 1; n <= max_threads; n = n < max_threads && n*2 > max_threads
+                                          ? max_threads
+                                          : n*2) {
+    size_t ops = b->run_mt(ctx, n);
+    if (ops == 0) {
+      printf("%-18s %7d failed\n", b->name, n);
+      return;
+    }
+    double mops = (double)ops / RunSeconds() * 1e-6;
+    if (n == 1) {
+      base = mops;
+    }
+    printf("%-18s %7d %10.2f %7.2f", b->name, n, mops, mops / base);
+    PrintCounters(ops);
+  }
+}
+
+int
+main(int argc, char **argv) {
+  const char *filter = argc > 1 ? argv[1] : "";
+  long max_threads = argc > 2 ? strtol(argv[2], 0, 10)
+                              : sysconf(_SC_NPROCESSORS_ONLN);
+  if (max_threads < 1) {
+    max_threads = 1;
+  }
+  if (max_threads > BENCH_MAX_THREADS) {
+    max_threads = BENCH_MAX_THREADS;
+  }
+
+  static struct MTContext ctx;
+  const size_t count = sizeof benchmarks / sizeof benchmarks[0];
+
+  OpenCounters();
+  printf("Counter values are per operation.\n\n");
+  PrintHeader();
+  for (size_t i = 0; i < count; i++) {
+    if (!benchmarks[i].run || !strstr(benchmarks[i].name, filter)) {
+      continue;
+    }
+    size_t ops = benchmarks[i].run();
+    if (ops == 0) {
+      printf("%-18s failed\n", benchmarks[i].name);
+      continue;
+    }
+    Report(benchmarks[i].name, ops);
+  }
+  printf("\n");
+  PrintHeaderMT();
+  for (size_t i = 0; i < count; i++) {
+    if (!benchmarks[i].run_mt || !strstr(benchmarks[i].name, filter)) {
+      continue;
+    }
+    RunMT(&benchmarks[i], &ctx, (int)max_threads);
+  }
+  CloseCounters();
+  return 0;
+}
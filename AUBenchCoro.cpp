@@ -0,0 +1,199 @@
+/*
+ * Coroutine frame allocation benchmarks, in C++20 (AUBench.c is C, so these
+ * live apart from it).
+ *
+ * Each benchmark spawns coroutines and runs them to completion, once with
+ * frames from the global operator new and once with frames from the
+ * au::pooled_frame pools, and reports the wall clock time per coroutine. The
+ * coroutines do next to nothing, so the difference is the allocator's.
+ *
+ * Usage: AUBenchCoro [filter]
+ */
+
+#include <coroutine>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include "AUCoro.hpp"
+
+enum {
+  // Coroutines per benchmark run.
+  BENCH_OPS = 1 << 22,
+
+  // Coroutines alive at once in the batch benchmarks.
+  BENCH_LIVE = 1 << 16
+};
+
+// Written to at the end of benchmarks so their work can't be optimized out.
+static volatile std::uintptr_t bench_sink;
+
+static struct timespec run_start, run_stop;
+
+static void
+StartRun() {
+  clock_gettime(CLOCK_MONOTONIC, &run_start);
+}
+
+static void
+StopRun() {
+  clock_gettime(CLOCK_MONOTONIC, &run_stop);
+}
+
+// xorshift64, as in AUBench.c.
+static std::uint64_t
+NextRand(std::uint64_t *state) {
+  std::uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+///////////////
+//// Tasks ////
+///////////////
+
+struct DefaultFrame {};
+
+/*
+ * A lazy task: it starts suspended, runs when resumed, and stays suspended at
+ * the end until it's destroyed, so its result can be read.
+ */
+template <typename Frame>
+struct Task {
+  struct promise_type : Frame {
+    std::uintptr_t value = 0;
+
+    Task get_return_object() {
+      return Task{std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    void return_value(std::uintptr_t v) noexcept { value = v; }
+    void unhandled_exception() { std::abort(); }
+  };
+
+  std::coroutine_handle<promise_type> h;
+
+  std::uintptr_t Finish() {
+    h.resume();
+    std::uintptr_t v = h.promise().value;
+    h.destroy();
+    return v;
+  }
+};
+
+// Some locals, so the frame is about the size of a small request handler's.
+template <typename Frame>
+static Task<Frame>
+Work(std::uintptr_t seed) {
+  std::uintptr_t buf[16];
+  for (int i = 0; i < 16; i++) {
+    buf[i] = seed * (std::uintptr_t)(i + 1);
+  }
+  co_return buf[seed & 15];
+}
+
+////////////////////
+//// Benchmarks ////
+////////////////////
+
+// Spawn and complete one at a time: the frame's free list head stays hot.
+template <typename Frame>
+static std::size_t
+BenchSpawn() {
+  std::uintptr_t acc = 0;
+  StartRun();
+  for (std::size_t i = 0; i < BENCH_OPS; i++) {
+    acc += Work<Frame>(i).Finish();
+  }
+  StopRun();
+  bench_sink = acc;
+  return BENCH_OPS;
+}
+
+/*
+ * Spawn BENCH_LIVE coroutines, then complete them in random order, like a
+ * server whose requests finish out of order.
+ */
+template <typename Frame>
+static std::size_t
+BenchBatch() {
+  Task<Frame> *tasks = static_cast<Task<Frame>*>(
+    std::malloc(BENCH_LIVE * sizeof *tasks));
+  std::uint32_t *order = static_cast<std::uint32_t*>(
+    std::malloc(BENCH_LIVE * sizeof *order));
+  if (!tasks || !order) {
+    std::free(tasks);
+    std::free(order);
+    return 0;
+  }
+  std::uint64_t seed = 88172645463325252u;
+  for (std::uint32_t i = 0; i < BENCH_LIVE; i++) {
+    order[i] = i;
+  }
+  for (std::size_t i = BENCH_LIVE - 1; i > 0; i--) {
+    std::size_t j = NextRand(&seed) % (i + 1);
+    std::uint32_t t = order[i];
+    order[i] = order[j];
+    order[j] = t;
+  }
+  std::uintptr_t acc = 0;
+  StartRun();
+  for (std::size_t r = 0; r < BENCH_OPS / BENCH_LIVE; r++) {
+    for (std::size_t i = 0; i < BENCH_LIVE; i++) {
+      tasks[i] = Work<Frame>(i);
+    }
+    for (std::size_t i = 0; i < BENCH_LIVE; i++) {
+      acc += tasks[order[i]].Finish();
+    }
+  }
+  StopRun();
+  std::free(tasks);
+  std::free(order);
+  bench_sink = acc;
+  return BENCH_OPS;
+}
+
+struct Benchmark {
+  const char *name;
+  std::size_t (*run)();
+};
+
+static const Benchmark benchmarks[] = {
+  {"coro_spawn_default", BenchSpawn<DefaultFrame>},
+  {"coro_spawn_pooled", BenchSpawn<au::pooled_frame>},
+  {"coro_batch_default", BenchBatch<DefaultFrame>},
+  {"coro_batch_pooled", BenchBatch<au::pooled_frame>}
+};
+
+static double
+RunSeconds() {
+  return (double)(run_stop.tv_sec - run_start.tv_sec)
+         + (double)(run_stop.tv_nsec - run_start.tv_nsec) * 1e-9;
+}
+
+int
+main(int argc, char **argv) {
+  const char *filter = argc > 1 ? argv[1] : "";
+
+  std::printf("%-18s %10s %10s\n", "benchmark", "ns/op", "Mops/s");
+  for (const Benchmark &b : benchmarks) {
+    if (!std::strstr(b.name, filter)) {
+      continue;
+    }
+    std::size_t ops = b.run();
+    if (ops == 0) {
+      std::printf("%-18s failed\n", b.name);
+      continue;
+    }
+    std::printf("%-18s %10.2f %10.2f\n", b.name,
+                RunSeconds() * 1e9 / (double)ops,
+                (double)ops / RunSeconds() * 1e-6);
+  }
+  au::destroy_frame_pools();
+  return 0;
+}
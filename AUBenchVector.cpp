@@ -0,0 +1,130 @@
+/*
+ * au::vector benchmarks, against std::vector, in C++ (AUBench.c is C, so these
+ * live apart from it).
+ *
+ * Each benchmark fills vectors from empty, without reserving, so the time
+ * goes to growth: std::vector's allocate, move and free against au::vector's
+ * realloc for element types memcpy can move, and against its own moves for
+ * the others.
+ *
+ * Usage: AUBenchVector [filter]
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include "AUVector.hpp"
+
+enum {
+  // Elements appended per benchmark run.
+  BENCH_OPS = 1 << 24,
+
+  // Elements per vector: some grow large enough for realloc to use mremap.
+  BENCH_ELTS = 1 << 22,
+
+  // Elements per vector in the string benchmarks.
+  BENCH_STR_ELTS = 1 << 10
+};
+
+// Written to at the end of benchmarks so their work can't be optimized out.
+static volatile std::uintptr_t bench_sink;
+
+static struct timespec run_start, run_stop;
+
+static void
+StartRun() {
+  clock_gettime(CLOCK_MONOTONIC, &run_start);
+}
+
+static void
+StopRun() {
+  clock_gettime(CLOCK_MONOTONIC, &run_stop);
+}
+
+// Trivially copyable, so au::vector grows it with realloc.
+struct Pair {
+  std::uint64_t key;
+  std::uint64_t value;
+};
+
+////////////////////
+//// Benchmarks ////
+////////////////////
+
+template <typename Vector>
+static std::size_t
+BenchPushPair() {
+  std::uintptr_t acc = 0;
+  StartRun();
+  for (std::size_t r = 0; r < BENCH_OPS / BENCH_ELTS; r++) {
+    Vector v;
+    for (std::uint64_t i = 0; i < BENCH_ELTS; i++) {
+      v.push_back(Pair{i, i ^ r});
+    }
+    acc += v[v.size() / 2].value;
+  }
+  StopRun();
+  bench_sink = acc;
+  return BENCH_OPS;
+}
+
+/*
+ * Strings are moved one by one on growth by both, and each resize fills in
+ * copies of an element of the vector itself.
+ */
+template <typename Vector>
+static std::size_t
+BenchResizeString() {
+  std::uintptr_t acc = 0;
+  StartRun();
+  for (std::size_t r = 0; r < BENCH_OPS / BENCH_STR_ELTS; r++) {
+    Vector v;
+    v.push_back(std::string(32, (char)('a' + r % 26)));
+    for (std::size_t n = 2; n <= BENCH_STR_ELTS; n *= 2) {
+      v.resize(n, v[0]);
+    }
+    acc += (std::uintptr_t)v.back()[31];
+  }
+  StopRun();
+  bench_sink = acc;
+  return BENCH_OPS;
+}
+
+struct Benchmark {
+  const char *name;
+  std::size_t (*run)();
+};
+
+static const Benchmark benchmarks[] = {
+  {"vec_push_pair_std", BenchPushPair<std::vector<Pair> >},
+  {"vec_push_pair_au", BenchPushPair<au::vector<Pair> >},
+  {"vec_resize_str_std", BenchResizeString<std::vector<std::string> >},
+  {"vec_resize_str_au", BenchResizeString<au::vector<std::string> >}
+};
+
+static double
+RunSeconds() {
+  return (double)(run_stop.tv_sec - run_start.tv_sec)
+         + (double)(run_stop.tv_nsec - run_start.tv_nsec) * 1e-9;
+}
+
+int
+main(int argc, char **argv) {
+  const char *filter = argc > 1 ? argv[1] : "";
+
+  std::printf("%-18s %10s %10s\n", "benchmark", "ns/op", "Mops/s");
+  for (const Benchmark &b : benchmarks) {
+    if (!std::strstr(b.name, filter)) {
+      continue;
+    }
+    std::size_t ops = b.run();
+    std::printf("%-18s %10.2f %10.2f\n", b.name,
+                RunSeconds() * 1e9 / (double)ops,
+                (double)ops / RunSeconds() * 1e-6);
+  }
+  return 0;
+}
@@ -0,0 +1,393 @@
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include "AUChecksum.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define AU_X86_DISPATCH 1
+#include <immintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define AU_LITTLE_ENDIAN 1
+#endif
+
+static inline uint64_t
+LoadU64LE(const unsigned char *p) {
+  uint64_t v;
+#ifdef AU_LITTLE_ENDIAN
+  memcpy(&v, p, sizeof v);
+#else
+  v = 0;
+  for (int i = 0; i < 8; i++) {
+    v |= (uint64_t)p[i] << 8*i;
+  }
+#endif
+  return v;
+}
+
+static inline uint32_t
+LoadU32LE(const unsigned char *p) {
+  uint32_t v;
+#ifdef AU_LITTLE_ENDIAN
+  memcpy(&v, p, sizeof v);
+#else
+  v = 0;
+  for (int i = 0; i < 4; i++) {
+    v |= (uint32_t)p[i] << 8*i;
+  }
+#endif
+  return v;
+}
+
+static inline uint64_t
+Rotl64(uint64_t v, unsigned k) {
+  return (v << k) | (v >> (64 - k));
+}
+
+////////////////
+//// CRC32C ////
+////////////////
+
+// Reflected, polynomial 0x82f63b78.
+static const uint32_t crc32c_table[256] = {
+  0x00000000u, 0xf26b8303u, 0xe13b70f7u, 0x1350f3f4u,
+  0xc79a971fu, 0x35f1141cu, 0x26a1e7e8u, 0xd4ca64ebu,
+  0x8ad958cfu, 0x78b2dbccu, 0x6be22838u, 0x9989ab3bu,
+  0x4d43cfd0u, 0xbf284cd3u, 0xac78bf27u, 0x5e133c24u,
+  0x105ec76fu, 0xe235446cu, 0xf165b798u, 0x030e349bu,
+  0xd7c45070u, 0x25afd373u, 0x36ff2087u, 0xc494a384u,
+  0x9a879fa0u, 0x68ec1ca3u, 0x7bbcef57u, 0x89d76c54u,
+  0x5d1d08bfu, 0xaf768bbcu, 0xbc267848u, 0x4e4dfb4bu,
+  0x20bd8edeu, 0xd2d60dddu, 0xc186fe29u, 0x33ed7d2au,
+  0xe72719c1u, 0x154c9ac2u, 0x061c6936u, 0xf477ea35u,
+  0xaa64d611u, 0x580f5512u, 0x4b5fa6e6u, 0xb93425e5u,
+  0x6dfe410eu, 0x9f95c20du, 0x8cc531f9u, 0x7eaeb2fau,
+  0x30e349b1u, 0xc288cab2u, 0xd1d83946u, 0x23b3ba45u,
+  0xf779deaeu, 0x05125dadu, 0x1642ae59u, 0xe4292d5au,
+  0xba3a117eu, 0x4851927du, 0x5b016189u, 0xa96ae28au,
+  0x7da08661u, 0x8fcb0562u, 0x9c9bf696u, 0x6ef07595u,
+  0x417b1dbcu, 0xb3109ebfu, 0xa0406d4bu, 0x522bee48u,
+  0x86e18aa3u, 0x748a09a0u, 0x67dafa54u, 0x95b17957u,
+  0xcba24573u, 0x39c9c670u, 0x2a993584u, 0xd8f2b687u,
+  0x0c38d26cu, 0xfe53516fu, 0xed03a29bu, 0x1f682198u,
+  0x5125dad3u, 0xa34e59d0u, 0xb01eaa24u, 0x42752927u,
+  0x96bf4dccu, 0x64d4cecfu, 0x77843d3bu, 0x85efbe38u,
+  0xdbfc821cu, 0x2997011fu, 0x3ac7f2ebu, 0xc8ac71e8u,
+  0x1c661503u, 0xee0d9600u, 0xfd5d65f4u, 0x0f36e6f7u,
+  0x61c69362u, 0x93ad1061u, 0x80fde395u, 0x72966096u,
+  0xa65c047du, 0x5437877eu, 0x4767748au, 0xb50cf789u,
+  0xeb1fcbadu, 0x197448aeu, 0x0a24bb5au, 0xf84f3859u,
+  0x2c855cb2u, 0xdeeedfb1u, 0xcdbe2c45u, 0x3fd5af46u,
+  0x7198540du, 0x83f3d70eu, 0x90a324fau, 0x62c8a7f9u,
+  0xb602c312u, 0x44694011u, 0x5739b3e5u, 0xa55230e6u,
+  0xfb410cc2u, 0x092a8fc1u, 0x1a7a7c35u, 0xe811ff36u,
+  0x3cdb9bddu, 0xceb018deu, 0xdde0eb2au, 0x2f8b6829u,
+  0x82f63b78u, 0x709db87bu, 0x63cd4b8fu, 0x91a6c88cu,
+  0x456cac67u, 0xb7072f64u, 0xa457dc90u, 0x563c5f93u,
+  0x082f63b7u, 0xfa44e0b4u, 0xe9141340u, 0x1b7f9043u,
+  0xcfb5f4a8u, 0x3dde77abu, 0x2e8e845fu, 0xdce5075cu,
+  0x92a8fc17u, 0x60c37f14u, 0x73938ce0u, 0x81f80fe3u,
+  0x55326b08u, 0xa759e80bu, 0xb4091bffu, 0x466298fcu,
+  0x1871a4d8u, 0xea1a27dbu, 0xf94ad42fu, 0x0b21572cu,
+  0xdfeb33c7u, 0x2d80b0c4u, 0x3ed04330u, 0xccbbc033u,
+  0xa24bb5a6u, 0x502036a5u, 0x4370c551u, 0xb11b4652u,
+  0x65d122b9u, 0x97baa1bau, 0x84ea524eu, 0x7681d14du,
+  0x2892ed69u, 0xdaf96e6au, 0xc9a99d9eu, 0x3bc21e9du,
+  0xef087a76u, 0x1d63f975u, 0x0e330a81u, 0xfc588982u,
+  0xb21572c9u, 0x407ef1cau, 0x532e023eu, 0xa145813du,
+  0x758fe5d6u, 0x87e466d5u, 0x94b49521u, 0x66df1622u,
+  0x38cc2a06u, 0xcaa7a905u, 0xd9f75af1u, 0x2b9cd9f2u,
+  0xff56bd19u, 0x0d3d3e1au, 0x1e6dcdeeu, 0xec064eedu,
+  0xc38d26c4u, 0x31e6a5c7u, 0x22b65633u, 0xd0ddd530u,
+  0x0417b1dbu, 0xf67c32d8u, 0xe52cc12cu, 0x1747422fu,
+  0x49547e0bu, 0xbb3ffd08u, 0xa86f0efcu, 0x5a048dffu,
+  0x8ecee914u, 0x7ca56a17u, 0x6ff599e3u, 0x9d9e1ae0u,
+  0xd3d3e1abu, 0x21b862a8u, 0x32e8915cu, 0xc083125fu,
+  0x144976b4u, 0xe622f5b7u, 0xf5720643u, 0x07198540u,
+  0x590ab964u, 0xab613a67u, 0xb831c993u, 0x4a5a4a90u,
+  0x9e902e7bu, 0x6cfbad78u, 0x7fab5e8cu, 0x8dc0dd8fu,
+  0xe330a81au, 0x115b2b19u, 0x020bd8edu, 0xf0605beeu,
+  0x24aa3f05u, 0xd6c1bc06u, 0xc5914ff2u, 0x37faccf1u,
+  0x69e9f0d5u, 0x9b8273d6u, 0x88d28022u, 0x7ab90321u,
+  0xae7367cau, 0x5c18e4c9u, 0x4f48173du, 0xbd23943eu,
+  0xf36e6f75u, 0x0105ec76u, 0x12551f82u, 0xe03e9c81u,
+  0x34f4f86au, 0xc69f7b69u, 0xd5cf889du, 0x27a40b9eu,
+  0x79b737bau, 0x8bdcb4b9u, 0x988c474du, 0x6ae7c44eu,
+  0xbe2da0a5u, 0x4c4623a6u, 0x5f16d052u, 0xad7d5351u
+};
+
+static uint32_t
+CRC32CTable(uint32_t crc, const unsigned char *p, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    crc = crc32c_table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+/*
+ * The crc32 instruction does 8 bytes at a time. Its latency is 3 cycles,
+ * which is what bounds this loop.
+ */
+#ifdef AU_X86_DISPATCH
+
+__attribute__((target("sse4.2")))
+static uint32_t
+CRC32CSSE42(uint32_t crc, const unsigned char *p, size_t size) {
+  uint64_t c = crc;
+  for (; size >= 8; size -= 8, p += 8) {
+    c = _mm_crc32_u64(c, LoadU64LE(p));
+  }
+  crc = (uint32_t)c;
+  for (; size > 0; size--, p++) {
+    crc = _mm_crc32_u8(crc, *p);
+  }
+  return crc;
+}
+
+#elif defined(__ARM_FEATURE_CRC32)
+
+static uint32_t
+CRC32CARM(uint32_t crc, const unsigned char *p, size_t size) {
+  for (; size >= 8; size -= 8, p += 8) {
+    crc = __crc32cd(crc, LoadU64LE(p));
+  }
+  for (; size > 0; size--, p++) {
+    crc = __crc32cb(crc, *p);
+  }
+  return crc;
+}
+
+#endif
+
+uint32_t
+AU_CRC32C(uint32_t crc, const void *mem, size_t size) {
+  assert(mem || size == 0);
+
+  const unsigned char *p = mem;
+  crc = ~crc;
+#ifdef AU_X86_DISPATCH
+  if (__builtin_cpu_supports("sse4.2")) {
+    return ~CRC32CSSE42(crc, p, size);
+  }
+#elif defined(__ARM_FEATURE_CRC32)
+  return ~CRC32CARM(crc, p, size);
+#endif
+  return ~CRC32CTable(crc, p, size);
+}
+
+///////////////
+//// XXH64 ////
+///////////////
+
+static const uint64_t XXH_P1 = 0x9e3779b185ebca87u;
+static const uint64_t XXH_P2 = 0xc2b2ae3d27d4eb4fu;
+static const uint64_t XXH_P3 = 0x165667b19e3779f9u;
+static const uint64_t XXH_P4 = 0x85ebca77c2b2ae63u;
+static const uint64_t XXH_P5 = 0x27d4eb2f165667c5u;
+
+static inline uint64_t
+XXHRound(uint64_t acc, uint64_t input) {
+  acc += input*XXH_P2;
+  return Rotl64(acc, 31)*XXH_P1;
+}
+
+static inline uint64_t
+XXHMerge(uint64_t h, uint64_t v) {
+  h ^= XXHRound(0, v);
+  return h*XXH_P1 + XXH_P4;
+}
+
+// Whole 32 byte stripes. Returns how many bytes it consumed.
+static size_t
+XXHStripes(uint64_t v[4], const unsigned char *p, size_t size) {
+  uint64_t v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3];
+  size_t done = 0;
+  for (; size - done >= 32; done += 32) {
+    v0 = XXHRound(v0, LoadU64LE(p + done));
+    v1 = XXHRound(v1, LoadU64LE(p + done + 8));
+    v2 = XXHRound(v2, LoadU64LE(p + done + 16));
+    v3 = XXHRound(v3, LoadU64LE(p + done + 24));
+  }
+  v[0] = v0;
+  v[1] = v1;
+  v[2] = v2;
+  v[3] = v3;
+  return done;
+}
+
+// The final mixing, given the state after the stripes and what's left.
+static uint64_t
+XXHFinish(const uint64_t v[4],
+          uint64_t seed,
+          uint64_t total,
+          const unsigned char *p,
+          size_t size) {
+  uint64_t h;
+  if (total >= 32) {
+    h = Rotl64(v[0], 1) + Rotl64(v[1], 7) + Rotl64(v[2], 12)
+        + Rotl64(v[3], 18);
+    for (int i = 0; i < 4; i++) {
+      h = XXHMerge(h, v[i]);
+    }
+  } else {
+    h = seed + XXH_P5;
+  }
+  h += total;
+
+  for (; size >= 8; size -= 8, p += 8) {
+    h ^= XXHRound(0, LoadU64LE(p));
+    h = Rotl64(h, 27)*XXH_P1 + XXH_P4;
+  }
+  if (size >= 4) {
+    h ^= (uint64_t)LoadU32LE(p)*XXH_P1;
+    h = Rotl64(h, 23)*XXH_P2 + XXH_P3;
+    size -= 4;
+    p += 4;
+  }
+  for (; size > 0; size--, p++) {
+    h ^= *p*XXH_P5;
+    h = Rotl64(h, 11)*XXH_P1;
+  }
+
+  h ^= h >> 33;
+  h *= XXH_P2;
+  h ^= h >> 29;
+  h *= XXH_P3;
+  h ^= h >> 32;
+  return h;
+}
+
+void
+AU_XXH64_Setup(AU_XXH64State *st, uint64_t seed) {
+  assert(st);
+
+  st->v[0] = seed + XXH_P1 + XXH_P2;
+  st->v[1] = seed + XXH_P2;
+  st->v[2] = seed;
+  st->v[3] = seed - XXH_P1;
+  st->seed = seed;
+  st->total = 0;
+  st->buf_used = 0;
+}
+
+void
+AU_XXH64_Update(AU_XXH64State *st, const void *mem, size_t size) {
+  assert(mem || size == 0);
+
+  const unsigned char *p = mem;
+  st->total += size;
+
+  if (st->buf_used > 0) {
+    size_t fill = sizeof st->buf - st->buf_used;
+    if (size < fill) {
+      memcpy(st->buf + st->buf_used, p, size);
+      st->buf_used += size;
+      return;
+    }
+    memcpy(st->buf + st->buf_used, p, fill);
+    XXHStripes(st->v, st->buf, sizeof st->buf);
+    st->buf_used = 0;
+    p += fill;
+    size -= fill;
+  }
+
+  size_t done = XXHStripes(st->v, p, size);
+  memcpy(st->buf, p + done, size - done);
+  st->buf_used = size - done;
+}
+
+uint64_t
+AU_XXH64_Digest(const AU_XXH64State *st) {
+  return XXHFinish(st->v, st->seed, st->total, st->buf, st->buf_used);
+}
+
+uint64_t
+AU_XXH64(const void *mem, size_t size, uint64_t seed) {
+  assert(mem || size == 0);
+
+  AU_XXH64State st;
+  AU_XXH64_Setup(&st, seed);
+  size_t done = XXHStripes(st.v, mem, size);
+  return XXHFinish(st.v, seed, size, (const unsigned char*)mem + done,
+                   size - done);
+}
+
+////////////////////////////
+//// Incremental States ////
+////////////////////////////
+
+void
+AU_CK_Setup(AU_Checksum *ck, enum AU_ChecksumKind kind, uint64_t seed) {
+  assert(ck);
+  assert(kind == AU_CK_CRC32C || kind == AU_CK_XXH64);
+
+  ck->kind = kind;
+  ck->seed = seed;
+  ck->hashed = 0;
+  ck->hold = SIZE_MAX;
+  ck->pending = 0;
+  AU_CK_Reset(ck);
+}
+
+void
+AU_CK_Reset(AU_Checksum *ck) {
+  if (ck->kind == AU_CK_CRC32C) {
+    ck->st.crc = (uint32_t)ck->seed;
+  } else {
+    AU_XXH64_Setup(&ck->st.xxh, ck->seed);
+  }
+}
+
+void
+AU_CK_Update(AU_Checksum *ck, const void *mem, size_t size) {
+  if (ck->kind == AU_CK_CRC32C) {
+    ck->st.crc = AU_CRC32C(ck->st.crc, mem, size);
+  } else {
+    AU_XXH64_Update(&ck->st.xxh, mem, size);
+  }
+}
+
+uint64_t
+AU_CK_Digest(const AU_Checksum *ck) {
+  if (ck->kind == AU_CK_CRC32C) {
+    return ck->st.crc;
+  }
+  return AU_XXH64_Digest(&ck->st.xxh);
+}
+
+////////////////////////////
+//// Ranges of Builders ////
+////////////////////////////
+
+uint64_t
+AU_B1_ChecksumRange(AU_ByteBuilder *b1,
+                    enum AU_ChecksumKind kind,
+                    uint64_t seed,
+                    size_t offset,
+                    size_t size) {
+  assert(offset <= AU_B1_GetUsedCount(b1));
+  assert(size <= AU_B1_GetUsedCount(b1) - offset);
+
+  const char *mem = (const char*)AU_B1_GetMemory(b1) + offset;
+  if (kind == AU_CK_CRC32C) {
+    return AU_CRC32C((uint32_t)seed, mem, size);
+  }
+  return AU_XXH64(mem, size, seed);
+}
+
+uint64_t
+AU_FSB_ChecksumRange(AU_FixedSizeBuilder *fsb,
+                     enum AU_ChecksumKind kind,
+                     uint64_t seed,
+                     size_t i,
+                     size_t n) {
+  assert(i <= AU_FSB_GetUsedCount(fsb));
+  assert(n <= AU_FSB_GetUsedCount(fsb) - i);
+
+  return AU_B1_ChecksumRange(&fsb->b1, kind, seed, i*fsb->elt_size,
+                             n*fsb->elt_size);
+}
@@ -0,0 +1,120 @@
+#ifndef ALLOC_UTILS_CHECKSUM_H
+#define ALLOC_UTILS_CHECKSUM_H
+
+/**
+ * Checksums: CRC32C (the Castagnoli CRC, as used by iSCSI, ext4, etc.) and
+ * XXH64 (xxHash's 64 bit hash).
+ *
+ * CRC32C uses the SSE4.2 crc32 instruction when the processor has it (checked
+ * at run time), or the ARMv8 CRC instructions when compiling for them. It's a
+ * table driven loop otherwise. XXH64 is portable C.
+ *
+ * Besides the plain functions on memory, there is AU_Checksum, an incremental
+ * checksum state which can be attached to a byte builder (or a fixed size
+ * builder), so that it's kept up to date as the builder is appended to. Check
+ * AU_B1_SetChecksum in AU.h.
+ */
+
+#include "AU.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum AU_ChecksumKind {
+  AU_CK_CRC32C,
+  AU_CK_XXH64
+};
+
+/**
+ * The CRC32C of size bytes at mem, continuing from crc: pass 0 for the first
+ * call, and the previous result to checksum data that follows.
+ */
+uint32_t
+AU_CRC32C(uint32_t crc, const void *mem, size_t size);
+
+uint64_t
+AU_XXH64(const void *mem, size_t size, uint64_t seed);
+
+/**
+ * Streaming XXH64. Update can be called with any sizes, and Digest doesn't
+ * change the state, so the hash can be taken at any point and updated on.
+ */
+typedef struct AU_XXH64State {
+  uint64_t v[4];
+  uint64_t seed;
+  uint64_t total;
+  unsigned char buf[32];
+  size_t buf_used;
+} AU_XXH64State;
+
+void
+AU_XXH64_Setup(AU_XXH64State *st, uint64_t seed);
+
+void
+AU_XXH64_Update(AU_XXH64State *st, const void *mem, size_t size);
+
+uint64_t
+AU_XXH64_Digest(const AU_XXH64State *st);
+
+/**
+ * Incremental checksum of either kind. For CRC32C, the seed is the CRC to
+ * continue from (0 normally). Digest gives the CRC32C zero extended, or the
+ * XXH64.
+ *
+ * The offsets are for the builder this is attached to, and are only used by
+ * the builder functions.
+ */
+typedef struct AU_Checksum {
+  enum AU_ChecksumKind kind;
+  uint64_t seed;
+  union {
+    uint32_t crc;
+    AU_XXH64State xxh;
+  } st;
+
+  // The builder's bytes before hashed have been checksummed. Hashing doesn't
+  // go past hold, where a reservation that's still to be patched starts.
+  // pending is how many reserved bytes haven't been patched yet.
+  size_t hashed, hold, pending;
+} AU_Checksum;
+
+void
+AU_CK_Setup(AU_Checksum *ck, enum AU_ChecksumKind kind, uint64_t seed);
+
+/**
+ * Starts over, as if just set up.
+ */
+void
+AU_CK_Reset(AU_Checksum *ck);
+
+void
+AU_CK_Update(AU_Checksum *ck, const void *mem, size_t size);
+
+uint64_t
+AU_CK_Digest(const AU_Checksum *ck);
+
+/**
+ * One shot checksums of a range of a builder's contents (size bytes from
+ * offset for byte builders, n elements from index i for fixed size builders),
+ * attached checksum or not.
+ */
+uint64_t
+AU_B1_ChecksumRange(AU_ByteBuilder *b1,
+                    enum AU_ChecksumKind kind,
+                    uint64_t seed,
+                    size_t offset,
+                    size_t size);
+
+uint64_t
+AU_FSB_ChecksumRange(AU_FixedSizeBuilder *fsb,
+                     enum AU_ChecksumKind kind,
+                     uint64_t seed,
+                     size_t i,
+                     size_t n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
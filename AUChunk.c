@@ -0,0 +1,610 @@
+// For MAP_ANONYMOUS, pwrite, etc., under -std=c99, and for vmsplice and
+// splice on Linux.
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "AUChunk.h"
+#include "AUCodec.h"
+#include "XMalloc.h"
+
+#define ISSUE_ERROR(err) xerror(err, # err)
+
+enum {
+  // How many chunk addresses the builder starts with room for.
+  CHB_INITIAL_CHUNKS = 8,
+
+  // How many dropped chunks are kept for reuse. The rest are unmapped.
+  CHB_MAX_SPARE = 4,
+
+  // Compressed chunks have to be at most this many eighths of their size.
+  CHB_MAX_PACKED_EIGHTHS = 7
+};
+
+#ifndef NDEBUG
+
+#define ASSERT_VALID_CHB(chb) \
+  do { \
+    assert(chb); \
+    assert((chb)->chunk_size > 0); \
+    assert((chb)->chunk_size % (chb)->block_size == 0); \
+    assert((chb)->sealed <= AU_CHB_GetChunkCount(chb)); \
+  } while (0)
+
+#else
+
+#define ASSERT_VALID_CHB(chb)
+
+#endif
+
+static inline struct AU_Chunk *
+AU_CHB_Chunks(const AU_ChunkBuilder *chb) {
+  return (struct AU_Chunk *)chb->chunks.b1.mem;
+}
+
+/*
+ * The chunk appends go to, or a null pointer if all chunks are sealed.
+ */
+static inline struct AU_Chunk *
+AU_CHB_OpenChunk(const AU_ChunkBuilder *chb) {
+  size_t n = AU_CHB_GetChunkCount(chb);
+  return n > chb->sealed ? &AU_CHB_Chunks(chb)[n - 1] : 0;
+}
+
+/*
+ * Keeps the memory of a dropped chunk for reuse, or unmaps it.
+ */
+static void
+AU_CHB_DropMemory(AU_ChunkBuilder *chb, void *mem) {
+  if (AU_FSB_GetUsedCount(&chb->spare) < CHB_MAX_SPARE) {
+    // The spare builder never grows past its setup capacity.
+    AU_FSB_Append(&chb->spare, &mem, 1);
+  } else {
+    munmap(mem, chb->chunk_size);
+  }
+}
+
+/*
+ * Memory for a chunk, spare or newly mapped.
+ */
+static void *
+AU_CHB_TakeMemory(AU_ChunkBuilder *chb) {
+  size_t nspare = AU_FSB_GetUsedCount(&chb->spare);
+  if (nspare > 0) {
+    void *mem = ((void**)AU_FSB_GetMemory(&chb->spare))[nspare - 1];
+    AU_FSB_DiscardLastAppends(&chb->spare, 1);
+    return mem;
+  }
+  void *mem = mmap(0, chb->chunk_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    ISSUE_ERROR(AU_ERR_XMALLOC);
+    return 0;
+  }
+  return mem;
+}
+
+/*
+ * Opens a new chunk, after sealing the open one, if any.
+ */
+static struct AU_Chunk *
+AU_CHB_NewChunk(AU_ChunkBuilder *chb) {
+  void *mem = AU_CHB_TakeMemory(chb);
+  if (!mem) {
+    return 0;
+  }
+
+  struct AU_Chunk chunk = {mem, 0, 0, 0};
+  if (AU_FSB_Append(&chb->chunks, &chunk, 1) < 0) {
+    AU_CHB_DropMemory(chb, mem);
+    return 0;
+  }
+  chb->sealed = AU_CHB_GetChunkCount(chb) - 1;
+  return AU_CHB_OpenChunk(chb);
+}
+
+/*
+ * Adds n empty chunks after the open one (or the last sealed one), for an
+ * append to fill. If any of them can't be had, none are added.
+ */
+static int
+AU_CHB_AddChunks(AU_ChunkBuilder *chb, size_t n) {
+  int res = AU_FSB_MakeRoom(&chb->chunks, n);
+  if (res < 0) {
+    return res;
+  }
+  for (size_t k = 0; k < n; k++) {
+    void *mem = AU_CHB_TakeMemory(chb);
+    if (!mem) {
+      struct AU_Chunk *added = AU_CHB_Chunks(chb) + AU_CHB_GetChunkCount(chb);
+      for (size_t j = 1; j <= k; j++) {
+        AU_CHB_DropMemory(chb, (added - j)->mem);
+      }
+      AU_FSB_DiscardLastAppends(&chb->chunks, k);
+      return AU_ERR_XMALLOC;
+    }
+    // There is room for it, so this doesn't fail.
+    struct AU_Chunk *chunk = AU_FSB_AppendForSetup(&chb->chunks, 1);
+    chunk->mem = mem;
+    chunk->used = 0;
+    chunk->packed = 0;
+    chunk->packed_size = 0;
+  }
+  return 0;
+}
+
+/*
+ * Full chunks are sealed right away, so they can be written out.
+ */
+static inline void
+AU_CHB_SealIfFull(AU_ChunkBuilder *chb, struct AU_Chunk *chunk) {
+  if (chunk->used == chb->chunk_size) {
+    chb->sealed = AU_CHB_GetChunkCount(chb);
+  }
+}
+
+/*
+ * Drops the n oldest chunks. Their memory is kept for reuse if reuse is non
+ * zero.
+ */
+static void
+AU_CHB_DropChunks(AU_ChunkBuilder *chb, size_t n, int reuse) {
+  assert(n <= chb->sealed);
+
+  struct AU_Chunk *chunks = AU_CHB_Chunks(chb);
+  size_t count = AU_CHB_GetChunkCount(chb);
+  for (size_t k = 0; k < n; k++) {
+    if (!chunks[k].mem) {
+      xfree(chunks[k].packed);
+    } else if (reuse) {
+      AU_CHB_DropMemory(chb, chunks[k].mem);
+    } else {
+      munmap(chunks[k].mem, chb->chunk_size);
+    }
+  }
+  memmove(chunks, chunks + n, (count - n)*sizeof *chunks);
+  AU_FSB_DiscardLastAppends(&chb->chunks, n);
+  chb->sealed -= n;
+  chb->cold = chb->cold > n ? chb->cold - n : 0;
+  chb->first_id += n;
+}
+
+int
+AU_CHB_Setup(AU_ChunkBuilder *chb, size_t chunk_size, size_t block_size) {
+  assert(chb);
+  assert(chunk_size > 0);
+  assert(block_size > 0 && (block_size & (block_size - 1)) == 0);
+
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  assert(block_size <= page_size);
+
+  if (chunk_size > SIZE_MAX - (page_size - 1)) {
+    ISSUE_ERROR(AU_ERR_OVERFLOW);
+    return AU_ERR_OVERFLOW;
+  }
+  int res = AU_FSB_Setup(&chb->chunks,
+                         sizeof (struct AU_Chunk),
+                         CHB_INITIAL_CHUNKS);
+  if (res < 0) {
+    return res;
+  }
+  res = AU_FSB_Setup(&chb->spare, sizeof (void*), CHB_MAX_SPARE);
+  if (res < 0) {
+    AU_FSB_Destroy(&chb->chunks);
+    return res;
+  }
+  chb->sealed = 0;
+  chb->chunk_size = (chunk_size + page_size - 1)/page_size*page_size;
+  chb->block_size = block_size;
+  chb->used = 0;
+  chb->cold = 0;
+  chb->first_id = 0;
+  for (int i = 0; i < AU_CHB_CACHE_SLOTS; i++) {
+    chb->cache[i].b1.mem = 0;
+  }
+  chb->cache_next = 0;
+  ASSERT_VALID_CHB(chb);
+  return 0;
+}
+
+int
+AU_CHB_Append(AU_ChunkBuilder *chb, const void *mem, size_t size) {
+  ASSERT_VALID_CHB(chb);
+  assert(mem || size == 0);
+
+  if (size > SIZE_MAX - chb->used) {
+    ISSUE_ERROR(AU_ERR_OVERFLOW);
+    return AU_ERR_OVERFLOW;
+  }
+  if (size == 0) {
+    return 0;
+  }
+
+  // All the chunks the bytes need are added before any is copied, so a
+  // failure leaves the builder as it was.
+  struct AU_Chunk *open = AU_CHB_OpenChunk(chb);
+  size_t room = open ? chb->chunk_size - open->used : 0;
+  if (size > room) {
+    int res = AU_CHB_AddChunks(chb, (size - room - 1)/chb->chunk_size + 1);
+    if (res < 0) {
+      return res;
+    }
+  }
+
+  // Every chunk from the first unsealed one on gets bytes, and all but the
+  // last one are filled up.
+  struct AU_Chunk *chunk = AU_CHB_Chunks(chb) + chb->sealed;
+  const char *src = mem;
+  chb->used += size;
+  for (;;) {
+    size_t k = chb->chunk_size - chunk->used;
+    k = k < size ? k : size;
+    memcpy((char*)chunk->mem + chunk->used, src, k);
+    chunk->used += k;
+    src += k;
+    size -= k;
+    if (size == 0) {
+      break;
+    }
+    chunk++;
+  }
+  chb->sealed = AU_CHB_GetChunkCount(chb) - 1;
+  AU_CHB_SealIfFull(chb, chunk);
+  return 0;
+}
+
+void *
+AU_CHB_AppendForSetup(AU_ChunkBuilder *chb, size_t size) {
+  ASSERT_VALID_CHB(chb);
+
+  if (size > chb->chunk_size || size > SIZE_MAX - chb->used) {
+    ISSUE_ERROR(AU_ERR_OVERFLOW);
+    return 0;
+  }
+  struct AU_Chunk *chunk = AU_CHB_OpenChunk(chb);
+  if (!chunk || chb->chunk_size - chunk->used < size) {
+    chunk = AU_CHB_NewChunk(chb);
+    if (!chunk) {
+      return 0;
+    }
+  }
+  void *p = (char*)chunk->mem + chunk->used;
+  chunk->used += size;
+  chb->used += size;
+  AU_CHB_SealIfFull(chb, chunk);
+  return p;
+}
+
+size_t
+AU_CHB_PadToBlock(AU_ChunkBuilder *chb, int byte) {
+  ASSERT_VALID_CHB(chb);
+
+  struct AU_Chunk *chunk = AU_CHB_OpenChunk(chb);
+  if (!chunk) {
+    return 0;
+  }
+  size_t pad = (chb->block_size - chunk->used % chb->block_size)
+               % chb->block_size;
+  memset((char*)chunk->mem + chunk->used, byte, pad);
+  chunk->used += pad;
+  chb->used += pad;
+  AU_CHB_SealIfFull(chb, chunk);
+  return pad;
+}
+
+void
+AU_CHB_Seal(AU_ChunkBuilder *chb) {
+  ASSERT_VALID_CHB(chb);
+
+  chb->sealed = AU_CHB_GetChunkCount(chb);
+}
+
+size_t
+AU_CHB_GetChunkCount(const AU_ChunkBuilder *chb) {
+  return chb->chunks.b1.used / sizeof (struct AU_Chunk);
+}
+
+size_t
+AU_CHB_GetSealedCount(const AU_ChunkBuilder *chb) {
+  return chb->sealed;
+}
+
+/*
+ * The decompressed contents of compressed chunk k, from the cache. On a miss,
+ * the slot used longest ago is taken.
+ */
+static void *
+AU_CHB_Unpack(AU_ChunkBuilder *chb, size_t k) {
+  struct AU_Chunk *chunk = &AU_CHB_Chunks(chb)[k];
+  size_t id = chb->first_id + k;
+  for (int i = 0; i < AU_CHB_CACHE_SLOTS; i++) {
+    if (chb->cache[i].b1.mem && chb->cache[i].id == id) {
+      return AU_B1_GetMemory(&chb->cache[i].b1);
+    }
+  }
+
+  struct AU_ChunkCacheSlot *slot = &chb->cache[chb->cache_next];
+  if (!slot->b1.mem) {
+    if (AU_B1_Setup(&slot->b1, chb->chunk_size + AU_LZ_DECODE_SLACK) < 0) {
+      return 0;
+    }
+  }
+  AU_B1_DiscardAppends(&slot->b1);
+  if (AU_B1_DecodeLZ(&slot->b1, chunk->packed, chunk->packed_size) < 0) {
+    // The slot held another chunk, and doesn't anymore.
+    AU_B1_Destroy(&slot->b1);
+    return 0;
+  }
+  assert(AU_B1_GetUsedCount(&slot->b1) == chunk->used);
+  slot->id = id;
+  chb->cache_next = (chb->cache_next + 1) % AU_CHB_CACHE_SLOTS;
+  return AU_B1_GetMemory(&slot->b1);
+}
+
+/*
+ * Turns compressed chunk k back into a regular one, for writing it out.
+ */
+static int
+AU_CHB_Thaw(AU_ChunkBuilder *chb, size_t k) {
+  struct AU_Chunk *chunk = &AU_CHB_Chunks(chb)[k];
+  if (chunk->mem) {
+    return 0;
+  }
+  void *data = AU_CHB_Unpack(chb, k);
+  if (!data) {
+    return AU_ERR_DECODE;
+  }
+  void *mem = AU_CHB_TakeMemory(chb);
+  if (!mem) {
+    return AU_ERR_XMALLOC;
+  }
+  memcpy(mem, data, chunk->used);
+  xfree(chunk->packed);
+  chunk->mem = mem;
+  chunk->packed = 0;
+  chunk->packed_size = 0;
+  return 0;
+}
+
+void *
+AU_CHB_GetChunk(AU_ChunkBuilder *chb, size_t k, size_t *size) {
+  ASSERT_VALID_CHB(chb);
+  assert(k < AU_CHB_GetChunkCount(chb));
+  assert(size);
+
+  struct AU_Chunk *chunk = &AU_CHB_Chunks(chb)[k];
+  *size = chunk->used;
+  return chunk->mem ? chunk->mem : AU_CHB_Unpack(chb, k);
+}
+
+size_t
+AU_CHB_GetUsedCount(const AU_ChunkBuilder *chb) {
+  return chb->used;
+}
+
+int
+AU_CHB_CompressCold(AU_ChunkBuilder *chb, size_t keep) {
+  ASSERT_VALID_CHB(chb);
+
+  size_t last = chb->sealed > keep ? chb->sealed - keep : 0;
+  if (chb->cold >= last) {
+    return 0;
+  }
+  AU_ByteBuilder out;
+  int res = AU_B1_Setup(&out, chb->chunk_size);
+  if (res < 0) {
+    return res;
+  }
+  struct AU_Chunk *chunks = AU_CHB_Chunks(chb);
+  for (; chb->cold < last; chb->cold++) {
+    struct AU_Chunk *chunk = &chunks[chb->cold];
+    if (!chunk->mem) {
+      continue;
+    }
+    AU_B1_DiscardAppends(&out);
+    res = AU_B1_AppendLZ(&out, chunk->mem, chunk->used);
+    if (res < 0) {
+      break;
+    }
+    size_t packed_size = AU_B1_GetUsedCount(&out);
+    if (packed_size > chunk->used/8*CHB_MAX_PACKED_EIGHTHS) {
+      continue;
+    }
+    void *packed = xmalloc(packed_size);
+    if (!packed) {
+      ISSUE_ERROR(AU_ERR_XMALLOC);
+      res = AU_ERR_XMALLOC;
+      break;
+    }
+    memcpy(packed, AU_B1_GetMemory(&out), packed_size);
+    AU_CHB_DropMemory(chb, chunk->mem);
+    chunk->mem = 0;
+    chunk->packed = packed;
+    chunk->packed_size = packed_size;
+  }
+  AU_B1_Destroy(&out);
+  return res < 0 ? res : 0;
+}
+
+size_t
+AU_CHB_GetMemoryUsage(const AU_ChunkBuilder *chb) {
+  ASSERT_VALID_CHB(chb);
+
+  const struct AU_Chunk *chunks = AU_CHB_Chunks(chb);
+  size_t count = AU_CHB_GetChunkCount(chb);
+  size_t nspare = chb->spare.b1.used / sizeof (void*);
+  size_t total = nspare*chb->chunk_size;
+  for (size_t k = 0; k < count; k++) {
+    total += chunks[k].mem ? chb->chunk_size : chunks[k].packed_size;
+  }
+  for (int i = 0; i < AU_CHB_CACHE_SLOTS; i++) {
+    if (chb->cache[i].b1.mem) {
+      total += chb->cache[i].b1.cap;
+    }
+  }
+  return total;
+}
+
+/*
+ * pwrite, until all size bytes are written. Returns non zero on success.
+ */
+static int
+AU_CHB_WriteAll(int fd, const char *p, size_t size, off_t offset) {
+  while (size > 0) {
+    ssize_t n = pwrite(fd, p, size, offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return 0;
+    }
+    p += n;
+    size -= (size_t)n;
+    offset += n;
+  }
+  return 1;
+}
+
+int
+AU_CHB_WriteSealed(AU_ChunkBuilder *chb, int fd, off_t *offset) {
+  ASSERT_VALID_CHB(chb);
+  assert(offset);
+
+  struct AU_Chunk *chunks = AU_CHB_Chunks(chb);
+  size_t k;
+  for (k = 0; k < chb->sealed; k++) {
+    int res = AU_CHB_Thaw(chb, k);
+    if (res < 0) {
+      AU_CHB_DropChunks(chb, k, 1);
+      return res;
+    }
+    size_t size = (chunks[k].used + chb->block_size - 1)
+                  / chb->block_size*chb->block_size;
+    memset((char*)chunks[k].mem + chunks[k].used, 0, size - chunks[k].used);
+    if (!AU_CHB_WriteAll(fd, chunks[k].mem, size, *offset)) {
+      AU_CHB_DropChunks(chb, k, 1);
+      ISSUE_ERROR(AU_ERR_IO);
+      return AU_ERR_IO;
+    }
+    *offset += (off_t)size;
+  }
+  AU_CHB_DropChunks(chb, k, 1);
+  return 0;
+}
+
+#ifdef __linux__
+
+/*
+ * Moves size bytes from the pipe to out_fd. Returns non zero on success.
+ */
+static int
+AU_CHB_DrainPipe(int pipe_rd, int out_fd, size_t size, size_t *sent) {
+  while (size > 0) {
+    ssize_t n = splice(pipe_rd, 0, out_fd, 0, size,
+                       SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return 0;
+    }
+    size -= (size_t)n;
+    *sent += (size_t)n;
+  }
+  return 1;
+}
+
+int
+AU_CHB_SpliceSealed(AU_ChunkBuilder *chb,
+                    const int pipefd[2],
+                    int out_fd,
+                    size_t *sent) {
+  ASSERT_VALID_CHB(chb);
+  assert(pipefd);
+
+  size_t total = 0;
+  struct AU_Chunk *chunks = AU_CHB_Chunks(chb);
+  size_t k;
+  for (k = 0; k < chb->sealed; k++) {
+    int res = AU_CHB_Thaw(chb, k);
+    if (res < 0) {
+      AU_CHB_DropChunks(chb, k, 0);
+      if (sent) {
+        *sent = total;
+      }
+      return res;
+    }
+
+    // The pipe takes only so much at a time (64 KiB by default), so chunks go
+    // in pieces, each spliced out before the next one goes in.
+    size_t done = 0;
+    while (done < chunks[k].used) {
+      struct iovec iov;
+      iov.iov_base = (char*)chunks[k].mem + done;
+      iov.iov_len = chunks[k].used - done;
+      ssize_t n = vmsplice(pipefd[1], &iov, 1, SPLICE_F_GIFT);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0 || !AU_CHB_DrainPipe(pipefd[0], out_fd, (size_t)n, &total)) {
+        AU_CHB_DropChunks(chb, k + (done > 0 || n > 0), 0);
+        if (sent) {
+          *sent = total;
+        }
+        ISSUE_ERROR(AU_ERR_IO);
+        return AU_ERR_IO;
+      }
+      done += (size_t)n;
+    }
+  }
+  AU_CHB_DropChunks(chb, k, 0);
+  if (sent) {
+    *sent = total;
+  }
+  return 0;
+}
+
+#endif
+
+void
+AU_CHB_DiscardAppends(AU_ChunkBuilder *chb) {
+  ASSERT_VALID_CHB(chb);
+
+  AU_CHB_Seal(chb);
+  AU_CHB_DropChunks(chb, chb->sealed, 1);
+  chb->used = 0;
+}
+
+void
+AU_CHB_Destroy(AU_ChunkBuilder *chb) {
+  ASSERT_VALID_CHB(chb);
+
+  struct AU_Chunk *chunks = AU_CHB_Chunks(chb);
+  size_t count = AU_CHB_GetChunkCount(chb);
+  for (size_t k = 0; k < count; k++) {
+    if (chunks[k].mem) {
+      munmap(chunks[k].mem, chb->chunk_size);
+    } else {
+      xfree(chunks[k].packed);
+    }
+  }
+  for (int i = 0; i < AU_CHB_CACHE_SLOTS; i++) {
+    if (chb->cache[i].b1.mem) {
+      AU_B1_Destroy(&chb->cache[i].b1);
+    }
+  }
+  void **spare = AU_FSB_GetMemory(&chb->spare);
+  size_t nspare = AU_FSB_GetUsedCount(&chb->spare);
+  for (size_t k = 0; k < nspare; k++) {
+    munmap(spare[k], chb->chunk_size);
+  }
+  AU_FSB_Destroy(&chb->chunks);
+  AU_FSB_Destroy(&chb->spare);
+}
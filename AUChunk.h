@@ -0,0 +1,226 @@
+#ifndef ALLOC_UTILS_CHUNK_H
+#define ALLOC_UTILS_CHUNK_H
+
+/**
+ * Chunk builders: byte builders made of separately allocated, page aligned
+ * chunks of a fixed size, for writing what's built to files (or elsewhere)
+ * without copying it first.
+ *
+ * A chunk builder appends into its open chunk (the last one) until it's full,
+ * then seals it and opens another one. Chunks never move and never grow, so
+ * growing the builder never copies anything, and pointers into it stay good
+ * for as long as their chunk is around. Sealed chunks are handed to the
+ * kernel as they are: their memory is aligned to the page size, and their
+ * sizes are multiples of a block size of your choice, which is what O_DIRECT
+ * writes need.
+ *
+ * Chunks are mapped (anonymous mmap), rather than allocated through xmalloc,
+ * so they're page granular and go back to the system when dropped. A few
+ * dropped chunks are kept around for reuse.
+ *
+ * Chunk builders need POSIX (and use Linux specific calls where noted).
+ */
+
+#include <sys/types.h>
+
+#include "AU.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct AU_Chunk {
+  void *mem;
+  size_t used;
+
+  // For compressed chunks, which have no mem, their LZ block.
+  void *packed;
+  size_t packed_size;
+};
+
+enum {
+  // How many compressed chunks can be looked at (decompressed) at once.
+  AU_CHB_CACHE_SLOTS = 4
+};
+
+struct AU_ChunkCacheSlot {
+  // Set up on first use. Holds the decompressed contents of chunk id.
+  AU_ByteBuilder b1;
+  size_t id;
+};
+
+struct AU_ChunkBuilder {
+  // The chunks, oldest first. All but the last one are sealed. The last one
+  // is open, unless sealed says otherwise.
+  AU_FixedSizeBuilder chunks;
+  size_t sealed;
+
+  // Dropped chunks' memory, for reuse.
+  AU_FixedSizeBuilder spare;
+
+  size_t chunk_size;
+  size_t block_size;
+
+  // Bytes appended, dropped chunks included.
+  size_t used;
+
+  // Chunks before cold were compressed already, or found not worth it.
+  size_t cold;
+
+  // Chunks get ids in append order, so cache slots can tell them apart
+  // after drops shift their indices. Chunk k has id first_id + k.
+  size_t first_id;
+  struct AU_ChunkCacheSlot cache[AU_CHB_CACHE_SLOTS];
+  unsigned cache_next;
+};
+
+/**
+ * As with all other other builder/allocator types, the representation of an
+ * AU_ChunkBuilder shouldn't be relied upon (check the other comment in the
+ * beginning of AU.h).
+ *
+ * Chunks are indexed from the oldest one still in the builder. Writing out
+ * chunks drops them, so indices shift down then.
+ */
+typedef struct AU_ChunkBuilder AU_ChunkBuilder;
+
+/**
+ * block_size is a power of two, no larger than the page size (512 or 4096
+ * for O_DIRECT, typically). chunk_size is rounded up to a multiple of the page
+ * size.
+ */
+int
+AU_CHB_Setup(AU_ChunkBuilder *chb, size_t chunk_size, size_t block_size);
+
+/**
+ * Appends size bytes, filling up the open chunk and opening new ones as
+ * needed. Either all of them are appended or, on failure, none.
+ */
+int
+AU_CHB_Append(AU_ChunkBuilder *chb, const void *mem, size_t size);
+
+/**
+ * Appends size bytes, which have to be contiguous, for you to set up. So size
+ * can't be larger than the chunk size. If they don't fit in the open chunk,
+ * the chunk is sealed as it is and the bytes go in a new one.
+ */
+void *
+AU_CHB_AppendForSetup(AU_ChunkBuilder *chb, size_t size);
+
+/**
+ * Pads the open chunk with bytes of value byte up to a multiple of the block
+ * size, and gives how many bytes it took. If it's already there, or there is
+ * no open chunk, that's 0.
+ */
+size_t
+AU_CHB_PadToBlock(AU_ChunkBuilder *chb, int byte);
+
+/**
+ * Seals the open chunk (if any), so the next append opens a new one.
+ */
+void
+AU_CHB_Seal(AU_ChunkBuilder *chb);
+
+size_t
+AU_CHB_GetChunkCount(const AU_ChunkBuilder *chb);
+
+size_t
+AU_CHB_GetSealedCount(const AU_ChunkBuilder *chb);
+
+/**
+ * The memory of chunk k, storing its used byte count in *size.
+ *
+ * For a compressed chunk, that's a decompressed copy in one of the cache
+ * slots, which is good until the slot is taken by another compressed chunk,
+ * AU_CHB_CACHE_SLOTS gets later at the earliest. Changes to the copy are lost.
+ * If decompressing fails, this gives a null pointer.
+ */
+void *
+AU_CHB_GetChunk(AU_ChunkBuilder *chb, size_t k, size_t *size);
+
+/**
+ * Number of bytes appended since setup (or since the last discard), dropped
+ * chunks included.
+ */
+size_t
+AU_CHB_GetUsedCount(const AU_ChunkBuilder *chb);
+
+/**
+ * Compresses the sealed chunks, except for the keep newest ones, with the LZ
+ * codec in AUCodec.h. A compressed chunk only holds its compressed bytes, and
+ * its memory is dropped. Chunks that don't shrink by at least an eighth are
+ * left as they are. Either way, chunks are only looked at once.
+ *
+ * Appends aren't affected, since the open chunk is never compressed. Reads of
+ * compressed chunks go through AU_CHB_GetChunk's cache. Writing them out
+ * decompresses them first.
+ *
+ * There are no threads in here: call this when it suits you, e.g. after each
+ * so many appends, or when memory gets tight.
+ */
+int
+AU_CHB_CompressCold(AU_ChunkBuilder *chb, size_t keep);
+
+/**
+ * Bytes of memory the builder holds for chunks: whole chunks for those that
+ * aren't compressed and for spare ones, compressed sizes for the others, and
+ * the cache.
+ */
+size_t
+AU_CHB_GetMemoryUsage(const AU_ChunkBuilder *chb);
+
+/**
+ * Writes the sealed chunks to fd (with pwrite) one after the other, starting
+ * at *offset, which is advanced past what's written. Chunks are dropped as
+ * they're written out.
+ *
+ * Each chunk is written up to a multiple of the block size, with the last
+ * block zero padded (in the chunk's memory), so all writes are block aligned
+ * as long as *offset is. Pad with AU_CHB_PadToBlock before sealing to avoid
+ * that padding, or to pad differently.
+ *
+ * Fails with AU_ERR_IO if a write does, in which case the chunks written
+ * before it are dropped and *offset is past them, but the others stay.
+ */
+int
+AU_CHB_WriteSealed(AU_ChunkBuilder *chb, int fd, off_t *offset);
+
+#ifdef __linux__
+
+/**
+ * Sends the sealed chunks to out_fd (a socket, usually) without copying them:
+ * each chunk is vmspliced into the pipe pipefd with SPLICE_F_GIFT, and then
+ * spliced from the pipe to out_fd. Only the pages go through the kernel. The
+ * pipe should be empty and both it and out_fd blocking.
+ *
+ * Gifted pages belong to the kernel until it's done with them, so sent chunks
+ * are dropped for good: unmapped, and never reused by the builder. Writing to
+ * them is impossible from then on, and not only unwise.
+ *
+ * If sent isn't null, the number of bytes that got to out_fd is stored in
+ * it. Fails with AU_ERR_IO if vmsplice or splice do, in which case the chunks
+ * sent before are dropped, and so is the one being sent if any of it was
+ * gifted already. What was left in the pipe stays there.
+ */
+int
+AU_CHB_SpliceSealed(AU_ChunkBuilder *chb,
+                    const int pipefd[2],
+                    int out_fd,
+                    size_t *sent);
+
+#endif
+
+/**
+ * Drops everything. The chunks are kept for reuse, within limits.
+ */
+void
+AU_CHB_DiscardAppends(AU_ChunkBuilder *chb);
+
+void
+AU_CHB_Destroy(AU_ChunkBuilder *chb);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
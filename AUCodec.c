@@ -0,0 +1,1760 @@
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include "AUCodec.h"
+#include "XMalloc.h"
+
+#define ISSUE_ERROR(err) xerror(err, # err)
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define AU_X86_DISPATCH 1
+#include <immintrin.h>
+#endif
+
+/////////////////////
+//// Byte Access ////
+/////////////////////
+
+/*
+ * Unaligned little endian loads and stores. On little endian targets, these
+ * are plain (unaligned) moves.
+ */
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define AU_LITTLE_ENDIAN 1
+#endif
+
+static inline uint64_t
+LoadU64LE(const unsigned char *p) {
+  uint64_t v;
+#ifdef AU_LITTLE_ENDIAN
+  memcpy(&v, p, sizeof v);
+#else
+  v = 0;
+  for (int i = 0; i < 8; i++) {
+    v |= (uint64_t)p[i] << 8*i;
+  }
+#endif
+  return v;
+}
+
+static inline uint32_t
+LoadU32LE(const unsigned char *p) {
+  uint32_t v;
+#ifdef AU_LITTLE_ENDIAN
+  memcpy(&v, p, sizeof v);
+#else
+  v = 0;
+  for (int i = 0; i < 4; i++) {
+    v |= (uint32_t)p[i] << 8*i;
+  }
+#endif
+  return v;
+}
+
+static inline void
+StoreU64LE(unsigned char *p, uint64_t v) {
+#ifdef AU_LITTLE_ENDIAN
+  memcpy(p, &v, sizeof v);
+#else
+  for (int i = 0; i < 8; i++) {
+    p[i] = (unsigned char)(v >> 8*i);
+  }
+#endif
+}
+
+static inline void
+StoreU32LE(unsigned char *p, uint32_t v) {
+#ifdef AU_LITTLE_ENDIAN
+  memcpy(p, &v, sizeof v);
+#else
+  for (int i = 0; i < 4; i++) {
+    p[i] = (unsigned char)(v >> 8*i);
+  }
+#endif
+}
+
+// Index of the lowest set bit of a non zero value.
+static inline unsigned
+LowestBit64(uint64_t v) {
+  assert(v != 0);
+#if defined(__GNUC__)
+  return (unsigned)__builtin_ctzll(v);
+#else
+  unsigned k = 0;
+  while (!(v & 1)) {
+    v >>= 1;
+    k++;
+  }
+  return k;
+#endif
+}
+
+// Number of significant bits, at least 1.
+static inline unsigned
+BitLength64(uint64_t v) {
+#if defined(__GNUC__)
+  return v ? 64 - (unsigned)__builtin_clzll(v) : 1;
+#else
+  unsigned k = 1;
+  while (v >>= 1) {
+    k++;
+  }
+  return k;
+#endif
+}
+
+/*
+ * Shared by the encoders: reserves the worst case output size (n values of at
+ * most max_len bytes, plus slack bytes for whole word stores past the end),
+ * storing the address to write to in *out.
+ */
+static int
+ReserveOutput(AU_ByteBuilder *b1, size_t n, size_t max_len, size_t slack,
+              unsigned char **out) {
+  if (n > (SIZE_MAX - slack)/max_len) {
+    ISSUE_ERROR(AU_ERR_OVERFLOW);
+    return AU_ERR_OVERFLOW;
+  }
+  int res = AU_B1_MakeRoom(b1, n*max_len + slack);
+  if (res < 0) {
+    return res;
+  }
+  *out = AU_B1_AppendForSetup(b1, n*max_len + slack);
+  return 0;
+}
+
+// Gives back what was reserved but not written, from end on.
+static void
+ReleaseOutput(AU_ByteBuilder *b1, const unsigned char *end) {
+  size_t written = (size_t)(end - (unsigned char*)AU_B1_GetMemory(b1));
+  AU_B1_DiscardLastBytes(b1, AU_B1_GetUsedCount(b1) - written);
+}
+
+/*
+ * Shared by the decoders: appends room for n elements of elt_size bytes,
+ * storing its address in *out. The builder's elements have to be elt_size
+ * bytes, or the decoder would write past what it reserved.
+ */
+static int
+ReserveElements(AU_FixedSizeBuilder *fsb, size_t elt_size, size_t n,
+                void **out) {
+  if (fsb->elt_size != elt_size) {
+    ISSUE_ERROR(AU_ERR_ELT_SIZE);
+    return AU_ERR_ELT_SIZE;
+  }
+  int res = AU_FSB_MakeRoom(fsb, n);
+  if (res < 0) {
+    return res;
+  }
+  *out = AU_FSB_AppendForSetup(fsb, n);
+  return 0;
+}
+
+/////////////////
+//// Varints ////
+/////////////////
+
+enum {
+  VARINT32_MAX_LEN = 5,
+  VARINT64_MAX_LEN = 10,
+
+  // The 32 bit encoder always stores 8 bytes, and a varint takes up at least
+  // 5 of those in the worst case.
+  VARINT32_SLACK = 8 - VARINT32_MAX_LEN
+};
+
+static const uint64_t CONTINUATION_BITS = 0x8080808080808080u;
+
+/*
+ * Spreads the low 7*groups bits of v into bytes of 7 bits each, in the low
+ * bytes of the result. Constant groups make this a handful of shifts and
+ * masks, with no branches.
+ */
+static inline uint64_t
+SpreadGroups(uint64_t v, int groups) {
+  uint64_t x = 0;
+  for (int k = 0; k < groups; k++) {
+    x |= ((v >> 7*k) & 0x7f) << 8*k;
+  }
+  return x;
+}
+
+// The inverse of SpreadGroups.
+static inline uint64_t
+GatherGroups(uint64_t x, int groups) {
+  uint64_t v = 0;
+  for (int k = 0; k < groups; k++) {
+    v |= ((x >> 8*k) & 0x7f) << 7*k;
+  }
+  return v;
+}
+
+// Continuation bits for the first len - 1 bytes of a varint of len <= 8.
+static inline uint64_t
+ContinuationMask(unsigned len) {
+  assert(len >= 1 && len <= 8);
+  return len == 8 ? CONTINUATION_BITS & ~((uint64_t)0x80 << 56)
+                  : CONTINUATION_BITS & (((uint64_t)1 << 8*(len - 1)) - 1);
+}
+
+/*
+ * Encodes v at out, always storing 8 bytes. Returns the varint's length.
+ */
+static inline size_t
+EncodeVarint32(unsigned char *out, uint32_t v) {
+  unsigned len = (BitLength64(v) + 6)/7;
+  StoreU64LE(out, SpreadGroups(v, VARINT32_MAX_LEN) | ContinuationMask(len));
+  return len;
+}
+
+/*
+ * Encodes v at out, storing 8 bytes, or 10 for values of more than 56 bits.
+ * Returns the varint's length.
+ */
+static inline size_t
+EncodeVarint64(unsigned char *out, uint64_t v) {
+  unsigned len = (BitLength64(v) + 6)/7;
+  if (len <= 8) {
+    StoreU64LE(out, SpreadGroups(v, 8) | ContinuationMask(len));
+    return len;
+  }
+  StoreU64LE(out, SpreadGroups(v, 8) | CONTINUATION_BITS);
+  v >>= 56;
+  if (len == 9) {
+    out[8] = (unsigned char)v;
+  } else {
+    out[8] = (unsigned char)(v | 0x80);
+    out[9] = (unsigned char)(v >> 7);
+  }
+  return len;
+}
+
+/*
+ * Decodes a varint of at most max_len bytes from [p, end). Returns its length,
+ * or 0 if it's truncated or too long.
+ *
+ * With 8 bytes to look at, the terminating byte is found from the
+ * continuation bits of a whole word at once.
+ */
+static inline size_t
+DecodeVarint(const unsigned char *p, const unsigned char *end,
+             unsigned max_len, uint64_t *out) {
+  if (end - p >= 8) {
+    uint64_t x = LoadU64LE(p);
+    uint64_t stops = ~x & CONTINUATION_BITS;
+    if (stops) {
+      unsigned len = LowestBit64(stops)/8 + 1;
+      if (len > max_len) {
+        return 0;
+      }
+      // Masking the bytes past the varint keeps the gather branch free.
+      uint64_t keep = len == 8 ? ~(uint64_t)0 : ((uint64_t)1 << 8*len) - 1;
+      *out = GatherGroups(x & keep, 8);
+      return len;
+    }
+  }
+
+  uint64_t v = 0;
+  for (unsigned i = 0; i < max_len && p + i < end; i++) {
+    v |= (uint64_t)(p[i] & 0x7f) << 7*i;
+    if (!(p[i] & 0x80)) {
+      *out = v;
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+static inline uint32_t
+ZigzagEncode32(int32_t v) {
+  uint32_t u = (uint32_t)v;
+  return (u << 1) ^ (0u - (u >> 31));
+}
+
+static inline uint64_t
+ZigzagEncode64(int64_t v) {
+  uint64_t u = (uint64_t)v;
+  return (u << 1) ^ (0u - (u >> 63));
+}
+
+static inline int32_t
+ZigzagDecode32(uint32_t u) {
+  return (int32_t)((u >> 1) ^ (0u - (u & 1)));
+}
+
+static inline int64_t
+ZigzagDecode64(uint64_t u) {
+  return (int64_t)((u >> 1) ^ (0u - (u & 1)));
+}
+
+int
+AU_B1_AppendVarintsU32(AU_ByteBuilder *b1, const uint32_t *arr, size_t n) {
+  assert(n == 0 || arr);
+
+  unsigned char *out;
+  int res = ReserveOutput(b1, n, VARINT32_MAX_LEN, VARINT32_SLACK, &out);
+  if (res < 0) {
+    return res;
+  }
+  unsigned char *p = out;
+  for (size_t i = 0; i < n; i++) {
+    p += EncodeVarint32(p, arr[i]);
+  }
+  ReleaseOutput(b1, p);
+  return 0;
+}
+
+int
+AU_B1_AppendVarintsU64(AU_ByteBuilder *b1, const uint64_t *arr, size_t n) {
+  assert(n == 0 || arr);
+
+  unsigned char *out;
+  int res = ReserveOutput(b1, n, VARINT64_MAX_LEN, 0, &out);
+  if (res < 0) {
+    return res;
+  }
+  unsigned char *p = out;
+  for (size_t i = 0; i < n; i++) {
+    p += EncodeVarint64(p, arr[i]);
+  }
+  ReleaseOutput(b1, p);
+  return 0;
+}
+
+int
+AU_B1_AppendZigzagsI32(AU_ByteBuilder *b1, const int32_t *arr, size_t n) {
+  assert(n == 0 || arr);
+
+  unsigned char *out;
+  int res = ReserveOutput(b1, n, VARINT32_MAX_LEN, VARINT32_SLACK, &out);
+  if (res < 0) {
+    return res;
+  }
+  unsigned char *p = out;
+  for (size_t i = 0; i < n; i++) {
+    p += EncodeVarint32(p, ZigzagEncode32(arr[i]));
+  }
+  ReleaseOutput(b1, p);
+  return 0;
+}
+
+int
+AU_B1_AppendZigzagsI64(AU_ByteBuilder *b1, const int64_t *arr, size_t n) {
+  assert(n == 0 || arr);
+
+  unsigned char *out;
+  int res = ReserveOutput(b1, n, VARINT64_MAX_LEN, 0, &out);
+  if (res < 0) {
+    return res;
+  }
+  unsigned char *p = out;
+  for (size_t i = 0; i < n; i++) {
+    p += EncodeVarint64(p, ZigzagEncode64(arr[i]));
+  }
+  ReleaseOutput(b1, p);
+  return 0;
+}
+
+/*
+ * The four decoders only differ in the output type and the transformation of
+ * the decoded value, so they're stamped out from this.
+ */
+#define DEFINE_VARINT_DECODER(name, type, max_len, check, convert) \
+  int \
+  name(AU_FixedSizeBuilder *fsb, \
+       const void *mem, \
+       size_t size, \
+       size_t n, \
+       size_t *consumed) { \
+    assert(mem || size == 0); \
+    \
+    void *reserved; \
+    int res = ReserveElements(fsb, sizeof (type), n, &reserved); \
+    if (res < 0) { \
+      return res; \
+    } \
+    type *out = reserved; \
+    const unsigned char *p = mem; \
+    const unsigned char *end = p + size; \
+    for (size_t i = 0; i < n; i++) { \
+      uint64_t v; \
+      size_t len = DecodeVarint(p, end, (max_len), &v); \
+      if (len == 0 || !(check)) { \
+        AU_FSB_DiscardLastAppends(fsb, n); \
+        ISSUE_ERROR(AU_ERR_DECODE); \
+        return AU_ERR_DECODE; \
+      } \
+      out[i] = (convert); \
+      p += len; \
+    } \
+    if (consumed) { \
+      *consumed = (size_t)(p - (const unsigned char*)mem); \
+    } \
+    return 0; \
+  }
+
+DEFINE_VARINT_DECODER(AU_FSB_DecodeVarintsU32, uint32_t, VARINT32_MAX_LEN,
+                      v <= UINT32_MAX, (uint32_t)v)
+
+DEFINE_VARINT_DECODER(AU_FSB_DecodeVarintsU64, uint64_t, VARINT64_MAX_LEN,
+                      len < VARINT64_MAX_LEN || p[len - 1] <= 1, v)
+
+DEFINE_VARINT_DECODER(AU_FSB_DecodeZigzagsI32, int32_t, VARINT32_MAX_LEN,
+                      v <= UINT32_MAX, ZigzagDecode32((uint32_t)v))
+
+DEFINE_VARINT_DECODER(AU_FSB_DecodeZigzagsI64, int64_t, VARINT64_MAX_LEN,
+                      len < VARINT64_MAX_LEN || p[len - 1] <= 1,
+                      ZigzagDecode64(v))
+
+//////////////////////
+//// Stream VByte ////
+//////////////////////
+
+/*
+ * For each control byte, the pshufb mask that moves the 4 values' bytes into
+ * 4 zero extended 32 bit lanes, and the number of data bytes it covers. They
+ * are computed at compile time from the control byte through these macros.
+ * A mask byte with the high bit set (0xff) makes pshufb write a zero.
+ */
+
+#define SVB_LEN(c, i) ((((c) >> (2*(i))) & 3) + 1)
+#define SVB_OFF(c, i) \
+  (((i) > 0 ? SVB_LEN(c, 0) : 0) \
+   + ((i) > 1 ? SVB_LEN(c, 1) : 0) \
+   + ((i) > 2 ? SVB_LEN(c, 2) : 0))
+#define SVB_BYTE(c, i, k) \
+  ((k) < SVB_LEN(c, i) ? SVB_OFF(c, i) + (k) : 0xff)
+#define SVB_LANE(c, i) \
+  SVB_BYTE(c, i, 0), SVB_BYTE(c, i, 1), SVB_BYTE(c, i, 2), SVB_BYTE(c, i, 3)
+#define SVB_MASK(c) \
+  {SVB_LANE(c, 0), SVB_LANE(c, 1), SVB_LANE(c, 2), SVB_LANE(c, 3)}
+#define SVB_MASK4(c) \
+  SVB_MASK(c), SVB_MASK((c) + 1), SVB_MASK((c) + 2), SVB_MASK((c) + 3)
+#define SVB_MASK16(c) \
+  SVB_MASK4(c), SVB_MASK4((c) + 4), SVB_MASK4((c) + 8), SVB_MASK4((c) + 12)
+#define SVB_MASK64(c) \
+  SVB_MASK16(c), SVB_MASK16((c) + 16), SVB_MASK16((c) + 32), \
+  SVB_MASK16((c) + 48)
+
+#define SVB_TOTAL(c) (SVB_OFF(c, 3) + SVB_LEN(c, 3))
+#define SVB_TOTAL4(c) \
+  SVB_TOTAL(c), SVB_TOTAL((c) + 1), SVB_TOTAL((c) + 2), SVB_TOTAL((c) + 3)
+#define SVB_TOTAL16(c) \
+  SVB_TOTAL4(c), SVB_TOTAL4((c) + 4), SVB_TOTAL4((c) + 8), \
+  SVB_TOTAL4((c) + 12)
+#define SVB_TOTAL64(c) \
+  SVB_TOTAL16(c), SVB_TOTAL16((c) + 16), SVB_TOTAL16((c) + 32), \
+  SVB_TOTAL16((c) + 48)
+
+#ifdef AU_X86_DISPATCH
+static const unsigned char svb_masks[256][16] = {
+  SVB_MASK64(0), SVB_MASK64(64), SVB_MASK64(128), SVB_MASK64(192)
+};
+#endif
+
+static const unsigned char svb_totals[256] = {
+  SVB_TOTAL64(0), SVB_TOTAL64(64), SVB_TOTAL64(128), SVB_TOTAL64(192)
+};
+
+static inline size_t
+SVBControlSize(size_t n) {
+  return n/4 + (n % 4 != 0);
+}
+
+int
+AU_B1_AppendStreamVByte(AU_ByteBuilder *b1, const uint32_t *arr, size_t n) {
+  assert(n == 0 || arr);
+
+  // n/4 + 4*n bytes, at most. Each value stores all its 4 bytes, but the
+  // ones after it overwrite those it doesn't need, so there is no slack.
+  size_t ctrl_size = SVBControlSize(n);
+  unsigned char *out;
+  int res = ReserveOutput(b1, n, 5, 0, &out);
+  if (res < 0) {
+    return res;
+  }
+  unsigned char *ctrl = out;
+  unsigned char *data = out + ctrl_size;
+  memset(ctrl, 0, ctrl_size);
+  for (size_t i = 0; i < n; i++) {
+    uint32_t v = arr[i];
+    unsigned code = (v > 0xff) + (v > 0xffff) + (v > 0xffffff);
+    ctrl[i/4] |= (unsigned char)(code << 2*(i % 4));
+    StoreU32LE(data, v);
+    data += code + 1;
+  }
+  ReleaseOutput(b1, data);
+  return 0;
+}
+
+/*
+ * Scalar decoding of values [i, n), given their control bytes and data.
+ * Returns the end of the data read, or a null pointer if it goes past end.
+ */
+static const unsigned char *
+DecodeSVBScalar(const unsigned char *ctrl, const unsigned char *data,
+                const unsigned char *end, uint32_t *out, size_t i, size_t n) {
+  for (; i < n; i++) {
+    unsigned len = ((ctrl[i/4] >> 2*(i % 4)) & 3) + 1;
+    if ((size_t)(end - data) < len) {
+      return 0;
+    }
+    uint32_t v = 0;
+    for (unsigned k = 0; k < len; k++) {
+      v |= (uint32_t)data[k] << 8*k;
+    }
+    out[i] = v;
+    data += len;
+  }
+  return data;
+}
+
+#ifdef AU_X86_DISPATCH
+
+/*
+ * Decodes whole groups of 4 values while at least 16 data bytes are left
+ * (a group is loaded as 16 bytes, whatever its length). Stores in *groups how
+ * many groups it decoded, and returns the end of their data.
+ */
+__attribute__((target("ssse3")))
+static const unsigned char *
+DecodeSVBSSSE3(const unsigned char *ctrl, const unsigned char *data,
+               const unsigned char *end, uint32_t *out, size_t *groups) {
+  size_t g = 0;
+  for (; g < *groups && end - data >= 16; g++) {
+    unsigned c = ctrl[g];
+    __m128i in = _mm_loadu_si128((const __m128i*)(const void*)data);
+    __m128i mask = _mm_loadu_si128((const __m128i*)(const void*)svb_masks[c]);
+    _mm_storeu_si128((__m128i*)(void*)(out + 4*g), _mm_shuffle_epi8(in, mask));
+    data += svb_totals[c];
+  }
+  *groups = g;
+  return data;
+}
+
+#endif
+
+int
+AU_FSB_DecodeStreamVByte(AU_FixedSizeBuilder *fsb,
+                         const void *mem,
+                         size_t size,
+                         size_t n,
+                         size_t *consumed) {
+  assert(mem || size == 0);
+
+  const unsigned char *ctrl = mem;
+  size_t ctrl_size = SVBControlSize(n);
+  if (size < ctrl_size) {
+    ISSUE_ERROR(AU_ERR_DECODE);
+    return AU_ERR_DECODE;
+  }
+  void *reserved;
+  int res = ReserveElements(fsb, sizeof (uint32_t), n, &reserved);
+  if (res < 0) {
+    return res;
+  }
+  uint32_t *out = reserved;
+
+  const unsigned char *data = ctrl + ctrl_size;
+  const unsigned char *end = ctrl + size;
+  size_t done = 0;
+#ifdef AU_X86_DISPATCH
+  if (__builtin_cpu_supports("ssse3")) {
+    size_t groups = n/4;
+    data = DecodeSVBSSSE3(ctrl, data, end, out, &groups);
+    done = groups*4;
+  }
+#endif
+  data = DecodeSVBScalar(ctrl, data, end, out, done, n);
+  if (!data) {
+    AU_FSB_DiscardLastAppends(fsb, n);
+    ISSUE_ERROR(AU_ERR_DECODE);
+    return AU_ERR_DECODE;
+  }
+  if (consumed) {
+    *consumed = (size_t)(data - ctrl);
+  }
+  return 0;
+}
+
+//////////////////////
+//// Bit Builders ////
+//////////////////////
+
+void
+AU_BB_Setup(AU_BitBuilder *bb, AU_ByteBuilder *b1) {
+  assert(bb);
+  assert(b1);
+
+  bb->b1 = b1;
+  bb->flushed = 0;
+  bb->acc = 0;
+  bb->nbits = 0;
+}
+
+int
+AU_BB_PutBitsSlow(AU_BitBuilder *bb, uint64_t v, unsigned n) {
+  // The accumulator has room for 1 to 64 more bits, and v fills it up.
+  unsigned room = 64 - bb->nbits;
+  assert(n >= room);
+
+  unsigned char word[8];
+  StoreU64LE(word, bb->acc | v << bb->nbits);
+  int res = AU_B1_Append(bb->b1, word, sizeof word);
+  if (res < 0) {
+    return res;
+  }
+  bb->flushed += sizeof word;
+  bb->nbits = n - room;
+  bb->acc = bb->nbits ? v >> room : 0;
+  return 0;
+}
+
+int
+AU_BB_Flush(AU_BitBuilder *bb) {
+  unsigned char word[8];
+  size_t nbytes = (bb->nbits + 7)/8;
+  StoreU64LE(word, bb->acc);
+  int res = AU_B1_Append(bb->b1, word, nbytes);
+  if (res < 0) {
+    return res;
+  }
+  bb->flushed += nbytes;
+  bb->acc = 0;
+  bb->nbits = 0;
+  return 0;
+}
+
+size_t
+AU_BB_GetBitCount(const AU_BitBuilder *bb) {
+  return bb->flushed*8 + bb->nbits;
+}
+
+/////////////////////
+//// Bit Readers ////
+/////////////////////
+
+void
+AU_BR_Setup(AU_BitReader *br, const void *mem, size_t size) {
+  assert(br);
+  assert(mem || size == 0);
+
+  br->start = mem;
+  br->p = br->start;
+  br->end = br->start + size;
+  br->acc = 0;
+  br->nbits = 0;
+}
+
+/*
+ * With 8 bytes left to load, this is a single load and no branches: it ORs in
+ * a whole word above the bits already there, and only counts the whole bytes
+ * that fit. The bits of the partially fitting byte are already in place, and
+ * the next refill ORs in the same bits again. The bits above nbits in the
+ * accumulator are always the input's, so the OR doesn't change them.
+ */
+void
+AU_BR_Refill(AU_BitReader *br) {
+  if (br->end - br->p >= 8) {
+    br->acc |= LoadU64LE(br->p) << br->nbits;
+    br->p += (63 - br->nbits) >> 3;
+    br->nbits |= 56;
+    return;
+  }
+  while (br->nbits < 56 && br->p < br->end) {
+    br->acc |= (uint64_t)*br->p++ << br->nbits;
+    br->nbits += 8;
+  }
+}
+
+int
+AU_BR_GetBitsSlow(AU_BitReader *br, unsigned n, uint64_t *v) {
+  AU_BR_Refill(br);
+  if (br->nbits < n) {
+    ISSUE_ERROR(AU_ERR_DECODE);
+    return AU_ERR_DECODE;
+  }
+  *v = br->acc & (((uint64_t)1 << n) - 1);
+  AU_BR_SkipBits(br, n);
+  return 0;
+}
+
+void
+AU_BR_AlignToByte(AU_BitReader *br) {
+  AU_BR_SkipBits(br, br->nbits % 8);
+}
+
+size_t
+AU_BR_GetBitCount(const AU_BitReader *br) {
+  return (size_t)(br->p - br->start)*8 - br->nbits;
+}
+
+////////////////////////
+//// Text Encodings ////
+////////////////////////
+
+/*
+ * Each encoding has a scalar loop, which does everything, and SSSE3 and AVX2
+ * loops, which do as much of the input as they can in whole vectors and leave
+ * the rest (or anything unusual, like invalid input) to the scalar loop. The
+ * vector loops return how much input they did.
+ */
+
+enum {
+  // The widest vector store past the end of a decoder's output.
+  TEXT_DECODE_SLACK = 4
+};
+
+#ifdef AU_X86_DISPATCH
+
+static int
+HasAVX2(void) {
+  return __builtin_cpu_supports("avx2");
+}
+
+static int
+HasSSSE3(void) {
+  return __builtin_cpu_supports("ssse3");
+}
+
+#endif
+
+////// Base64 //////
+
+static const char base64_chars[] =
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static int
+Base64Value(unsigned char c) {
+  if (c >= 'A' && c <= 'Z') {
+    return c - 'A';
+  }
+  if (c >= 'a' && c <= 'z') {
+    return c - 'a' + 26;
+  }
+  if (c >= '0' && c <= '9') {
+    return c - '0' + 52;
+  }
+  if (c == '+') {
+    return 62;
+  }
+  if (c == '/') {
+    return 63;
+  }
+  return -1;
+}
+
+static void
+EncodeBase64Scalar(const unsigned char *in, size_t size, unsigned char *out) {
+  for (; size >= 3; size -= 3, in += 3, out += 4) {
+    uint32_t v = (uint32_t)in[0] << 16 | (uint32_t)in[1] << 8 | in[2];
+    out[0] = (unsigned char)base64_chars[v >> 18];
+    out[1] = (unsigned char)base64_chars[(v >> 12) & 63];
+    out[2] = (unsigned char)base64_chars[(v >> 6) & 63];
+    out[3] = (unsigned char)base64_chars[v & 63];
+  }
+  if (size > 0) {
+    uint32_t v = (uint32_t)in[0] << 16 | (size > 1 ? (uint32_t)in[1] << 8 : 0);
+    out[0] = (unsigned char)base64_chars[v >> 18];
+    out[1] = (unsigned char)base64_chars[(v >> 12) & 63];
+    out[2] = size > 1 ? (unsigned char)base64_chars[(v >> 6) & 63] : '=';
+    out[3] = '=';
+  }
+}
+
+/*
+ * Decodes size characters (a multiple of 4) to out. Returns the end of the
+ * output, or a null pointer if the input isn't valid. Padding is only valid
+ * at the end.
+ */
+static unsigned char *
+DecodeBase64Scalar(const unsigned char *in, size_t size, unsigned char *out) {
+  for (; size > 0; size -= 4, in += 4) {
+    int pad = size == 4 ? (in[3] == '=') + (in[3] == '=' && in[2] == '=') : 0;
+    int a = Base64Value(in[0]);
+    int b = Base64Value(in[1]);
+    int c = pad < 2 ? Base64Value(in[2]) : 0;
+    int d = pad < 1 ? Base64Value(in[3]) : 0;
+    if ((a | b | c | d) < 0) {
+      return 0;
+    }
+    uint32_t v = (uint32_t)a << 18 | (uint32_t)b << 12 | (uint32_t)c << 6
+                 | (uint32_t)d;
+    *out++ = (unsigned char)(v >> 16);
+    if (pad < 2) {
+      *out++ = (unsigned char)(v >> 8);
+    }
+    if (pad < 1) {
+      *out++ = (unsigned char)v;
+    }
+  }
+  return out;
+}
+
+#ifdef AU_X86_DISPATCH
+
+/*
+ * Encoding is Muła's: bytes are shuffled so each 32 bit lane has the 3 bytes
+ * of one output group, the 4 6 bit indices are moved into bytes of their own
+ * with two multiplications, and the indices are turned into characters by
+ * adding an offset looked up (with pshufb) from the range they're in.
+ *
+ * Decoding classifies characters with compares, adds each its range's offset,
+ * and packs 4 6 bit values into 3 bytes with two multiply adds and a shuffle.
+ * Vectors with anything else in them (padding, invalid input) are left to the
+ * scalar code.
+ */
+
+__attribute__((target("ssse3")))
+static inline __m128i
+Base64Indices128(__m128i in) {
+  const __m128i spread = _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+                                      4, 5, 3, 4, 1, 2, 0, 1);
+  in = _mm_shuffle_epi8(in, spread);
+  __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+  __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+  __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+  __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+  return _mm_or_si128(t1, t3);
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i
+Base64Chars128(__m128i idx) {
+  const __m128i offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52,
+                                        '0' - 52, '0' - 52, '0' - 52,
+                                        '0' - 52, '0' - 52, '0' - 52,
+                                        '0' - 52, '0' - 52, '+' - 62,
+                                        '/' - 63, 'A', 0, 0);
+  __m128i range = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+  __m128i upper = _mm_cmpgt_epi8(_mm_set1_epi8(26), idx);
+  range = _mm_or_si128(range, _mm_and_si128(upper, _mm_set1_epi8(13)));
+  return _mm_add_epi8(_mm_shuffle_epi8(offsets, range), idx);
+}
+
+__attribute__((target("ssse3")))
+static size_t
+EncodeBase64SSSE3(const unsigned char *in, size_t size, unsigned char *out) {
+  size_t done = 0;
+  for (; size - done >= 16; done += 12, out += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(const void*)(in + done));
+    _mm_storeu_si128((__m128i*)(void*)out,
+                     Base64Chars128(Base64Indices128(v)));
+  }
+  return done;
+}
+
+// In range [lo, hi], as a byte mask. Only for ASCII bounds.
+__attribute__((target("ssse3")))
+static inline __m128i
+InRange128(__m128i c, char lo, char hi) {
+  return _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8((char)(lo - 1))),
+                       _mm_cmplt_epi8(c, _mm_set1_epi8((char)(hi + 1))));
+}
+
+/*
+ * Values of 16 base64 characters, or -1 if any of them isn't one (padding
+ * included), in which case *ok is set to 0.
+ */
+__attribute__((target("ssse3")))
+static inline __m128i
+Base64Values128(__m128i c, int *ok) {
+  __m128i upper = InRange128(c, 'A', 'Z');
+  __m128i lower = InRange128(c, 'a', 'z');
+  __m128i digit = InRange128(c, '0', '9');
+  __m128i plus = _mm_cmpeq_epi8(c, _mm_set1_epi8('+'));
+  __m128i slash = _mm_cmpeq_epi8(c, _mm_set1_epi8('/'));
+  __m128i valid = _mm_or_si128(_mm_or_si128(upper, lower),
+                               _mm_or_si128(digit, _mm_or_si128(plus, slash)));
+  *ok = _mm_movemask_epi8(valid) == 0xffff;
+  __m128i shift = _mm_or_si128(
+    _mm_or_si128(_mm_and_si128(upper, _mm_set1_epi8(-'A')),
+                 _mm_and_si128(lower, _mm_set1_epi8(26 - 'a'))),
+    _mm_or_si128(_mm_and_si128(digit, _mm_set1_epi8(52 - '0')),
+                 _mm_or_si128(_mm_and_si128(plus, _mm_set1_epi8(62 - '+')),
+                              _mm_and_si128(slash, _mm_set1_epi8(63 - '/')))));
+  return _mm_add_epi8(c, shift);
+}
+
+// 16 values to 12 bytes, in the low bytes.
+__attribute__((target("ssse3")))
+static inline __m128i
+Base64Pack128(__m128i v) {
+  const __m128i order = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+                                      -1, -1, -1, -1);
+  __m128i pairs = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+  __m128i quads = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000));
+  return _mm_shuffle_epi8(quads, order);
+}
+
+__attribute__((target("ssse3")))
+static size_t
+DecodeBase64SSSE3(const unsigned char *in, size_t size, unsigned char *out) {
+  size_t done = 0;
+  for (; size - done >= 16; done += 16, out += 12) {
+    int ok;
+    __m128i c = _mm_loadu_si128((const __m128i*)(const void*)(in + done));
+    __m128i v = Base64Values128(c, &ok);
+    if (!ok) {
+      break;
+    }
+    _mm_storeu_si128((__m128i*)(void*)out, Base64Pack128(v));
+  }
+  return done;
+}
+
+__attribute__((target("avx2")))
+static size_t
+EncodeBase64AVX2(const unsigned char *in, size_t size, unsigned char *out) {
+  const __m256i spread = _mm256_broadcastsi128_si256(
+    _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+  const __m256i offsets = _mm256_broadcastsi128_si256(
+    _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                  '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                  '/' - 63, 'A', 0, 0));
+  size_t done = 0;
+  // Each lane gets 12 bytes, loaded as 16.
+  for (; size - done >= 28; done += 24, out += 32) {
+    const unsigned char *p = in + done;
+    __m256i v = _mm256_inserti128_si256(
+      _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(const void*)p)),
+      _mm_loadu_si128((const __m128i*)(const void*)(p + 12)), 1);
+    v = _mm256_shuffle_epi8(v, spread);
+    __m256i t0 = _mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00));
+    __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+    __m256i t2 = _mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0));
+    __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+    __m256i idx = _mm256_or_si256(t1, t3);
+    __m256i range = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+    __m256i upper = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx);
+    range = _mm256_or_si256(range,
+                            _mm256_and_si256(upper, _mm256_set1_epi8(13)));
+    __m256i chars = _mm256_add_epi8(_mm256_shuffle_epi8(offsets, range), idx);
+    _mm256_storeu_si256((__m256i*)(void*)out, chars);
+  }
+  return done;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+InRange256(__m256i c, char lo, char hi) {
+  return _mm256_and_si256(
+    _mm256_cmpgt_epi8(c, _mm256_set1_epi8((char)(lo - 1))),
+    _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(hi + 1)), c));
+}
+
+__attribute__((target("avx2")))
+static size_t
+DecodeBase64AVX2(const unsigned char *in, size_t size, unsigned char *out) {
+  const __m256i order = _mm256_broadcastsi128_si256(
+    _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+  size_t done = 0;
+  for (; size - done >= 32; done += 32, out += 24) {
+    __m256i c = _mm256_loadu_si256((const __m256i*)(const void*)(in + done));
+    __m256i upper = InRange256(c, 'A', 'Z');
+    __m256i lower = InRange256(c, 'a', 'z');
+    __m256i digit = InRange256(c, '0', '9');
+    __m256i plus = _mm256_cmpeq_epi8(c, _mm256_set1_epi8('+'));
+    __m256i slash = _mm256_cmpeq_epi8(c, _mm256_set1_epi8('/'));
+    __m256i valid = _mm256_or_si256(
+      _mm256_or_si256(upper, lower),
+      _mm256_or_si256(digit, _mm256_or_si256(plus, slash)));
+    if ((uint32_t)_mm256_movemask_epi8(valid) != 0xffffffffu) {
+      break;
+    }
+    __m256i shift = _mm256_or_si256(
+      _mm256_or_si256(_mm256_and_si256(upper, _mm256_set1_epi8(-'A')),
+                      _mm256_and_si256(lower, _mm256_set1_epi8(26 - 'a'))),
+      _mm256_or_si256(
+        _mm256_and_si256(digit, _mm256_set1_epi8(52 - '0')),
+        _mm256_or_si256(_mm256_and_si256(plus, _mm256_set1_epi8(62 - '+')),
+                        _mm256_and_si256(slash,
+                                         _mm256_set1_epi8(63 - '/')))));
+    __m256i v = _mm256_add_epi8(c, shift);
+    __m256i pairs = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+    __m256i quads = _mm256_madd_epi16(pairs, _mm256_set1_epi32(0x00011000));
+    __m256i bytes = _mm256_shuffle_epi8(quads, order);
+    _mm_storeu_si128((__m128i*)(void*)out, _mm256_castsi256_si128(bytes));
+    _mm_storeu_si128((__m128i*)(void*)(out + 12),
+                     _mm256_extracti128_si256(bytes, 1));
+  }
+  return done;
+}
+
+#endif
+
+int
+AU_B1_AppendBase64(AU_ByteBuilder *b1, const void *mem, size_t size) {
+  assert(mem || size == 0);
+
+  unsigned char *out;
+  int res = ReserveOutput(b1, size/3 + (size % 3 != 0), 4, 0, &out);
+  if (res < 0) {
+    return res;
+  }
+  const unsigned char *in = mem;
+  size_t done = 0;
+#ifdef AU_X86_DISPATCH
+  if (HasAVX2()) {
+    done = EncodeBase64AVX2(in, size, out);
+  } else if (HasSSSE3()) {
+    done = EncodeBase64SSSE3(in, size, out);
+  }
+#endif
+  EncodeBase64Scalar(in + done, size - done, out + done/3*4);
+  return 0;
+}
+
+int
+AU_B1_DecodeBase64(AU_ByteBuilder *b1, const void *mem, size_t size) {
+  assert(mem || size == 0);
+
+  if (size % 4 != 0) {
+    ISSUE_ERROR(AU_ERR_DECODE);
+    return AU_ERR_DECODE;
+  }
+  unsigned char *out;
+  int res = ReserveOutput(b1, size/4, 3, TEXT_DECODE_SLACK, &out);
+  if (res < 0) {
+    return res;
+  }
+  const unsigned char *in = mem;
+  size_t done = 0;
+#ifdef AU_X86_DISPATCH
+  if (HasAVX2()) {
+    done = DecodeBase64AVX2(in, size, out);
+  }
+  if (HasSSSE3()) {
+    done += DecodeBase64SSSE3(in + done, size - done, out + done/4*3);
+  }
+#endif
+  unsigned char *end = DecodeBase64Scalar(in + done, size - done,
+                                          out + done/4*3);
+  if (!end) {
+    ReleaseOutput(b1, out);
+    ISSUE_ERROR(AU_ERR_DECODE);
+    return AU_ERR_DECODE;
+  }
+  ReleaseOutput(b1, end);
+  return 0;
+}
+
+////// Hex //////
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static void
+EncodeHexScalar(const unsigned char *in, size_t size, unsigned char *out) {
+  for (size_t i = 0; i < size; i++) {
+    out[2*i] = (unsigned char)hex_digits[in[i] >> 4];
+    out[2*i + 1] = (unsigned char)hex_digits[in[i] & 15];
+  }
+}
+
+static int
+HexValue(unsigned char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  c |= 0x20;
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  return -1;
+}
+
+// Returns 0 if the input isn't valid.
+static int
+DecodeHexScalar(const unsigned char *in, size_t size, unsigned char *out) {
+  for (size_t i = 0; i < size; i += 2) {
+    int hi = HexValue(in[i]);
+    int lo = HexValue(in[i + 1]);
+    if ((hi | lo) < 0) {
+      return 0;
+    }
+    out[i/2] = (unsigned char)(hi << 4 | lo);
+  }
+  return 1;
+}
+
+#ifdef AU_X86_DISPATCH
+
+/*
+ * Encoding looks the nibbles' digits up with pshufb and interleaves them.
+ * Decoding computes digits' and letters' values apart, with masks for which
+ * is which, and joins pairs of them with a multiply add.
+ */
+
+__attribute__((target("ssse3")))
+static size_t
+EncodeHexSSSE3(const unsigned char *in, size_t size, unsigned char *out) {
+  const __m128i digits = _mm_loadu_si128((const __m128i*)(const void*)
+                                         hex_digits);
+  const __m128i nibble = _mm_set1_epi8(15);
+  size_t done = 0;
+  for (; size - done >= 16; done += 16, out += 32) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(const void*)(in + done));
+    __m128i hi = _mm_shuffle_epi8(digits,
+                                  _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+    __m128i lo = _mm_shuffle_epi8(digits, _mm_and_si128(v, nibble));
+    _mm_storeu_si128((__m128i*)(void*)out, _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128((__m128i*)(void*)(out + 16), _mm_unpackhi_epi8(hi, lo));
+  }
+  return done;
+}
+
+__attribute__((target("ssse3")))
+static size_t
+DecodeHexSSSE3(const unsigned char *in, size_t size, unsigned char *out) {
+  size_t done = 0;
+  for (; size - done >= 16; done += 16, out += 8) {
+    __m128i c = _mm_loadu_si128((const __m128i*)(const void*)(in + done));
+    __m128i folded = _mm_or_si128(c, _mm_set1_epi8(0x20));
+    __m128i digit = InRange128(c, '0', '9');
+    __m128i letter = InRange128(folded, 'a', 'f');
+    if (_mm_movemask_epi8(_mm_or_si128(digit, letter)) != 0xffff) {
+      break;
+    }
+    __m128i v = _mm_or_si128(
+      _mm_and_si128(digit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+      _mm_and_si128(letter, _mm_sub_epi8(folded, _mm_set1_epi8('a' - 10))));
+    __m128i pairs = _mm_maddubs_epi16(v, _mm_set1_epi16(0x0110));
+    _mm_storel_epi64((__m128i*)(void*)out, _mm_packus_epi16(pairs, pairs));
+  }
+  return done;
+}
+
+__attribute__((target("avx2")))
+static size_t
+EncodeHexAVX2(const unsigned char *in, size_t size, unsigned char *out) {
+  const __m256i digits = _mm256_broadcastsi128_si256(
+    _mm_loadu_si128((const __m128i*)(const void*)hex_digits));
+  const __m256i nibble = _mm256_set1_epi8(15);
+  size_t done = 0;
+  for (; size - done >= 32; done += 32, out += 64) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(const void*)(in + done));
+    __m256i hi = _mm256_shuffle_epi8(
+      digits, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+    __m256i lo = _mm256_shuffle_epi8(digits, _mm256_and_si256(v, nibble));
+    // Unpacking works within lanes, so the halves come out interleaved.
+    __m256i a = _mm256_unpacklo_epi8(hi, lo);
+    __m256i b = _mm256_unpackhi_epi8(hi, lo);
+    _mm256_storeu_si256((__m256i*)(void*)out,
+                        _mm256_permute2x128_si256(a, b, 0x20));
+    _mm256_storeu_si256((__m256i*)(void*)(out + 32),
+                        _mm256_permute2x128_si256(a, b, 0x31));
+  }
+  return done;
+}
+
+__attribute__((target("avx2")))
+static size_t
+DecodeHexAVX2(const unsigned char *in, size_t size, unsigned char *out) {
+  size_t done = 0;
+  for (; size - done >= 32; done += 32, out += 16) {
+    __m256i c = _mm256_loadu_si256((const __m256i*)(const void*)(in + done));
+    __m256i folded = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+    __m256i digit = InRange256(c, '0', '9');
+    __m256i letter = InRange256(folded, 'a', 'f');
+    __m256i valid = _mm256_or_si256(digit, letter);
+    if ((uint32_t)_mm256_movemask_epi8(valid) != 0xffffffffu) {
+      break;
+    }
+    __m256i v = _mm256_or_si256(
+      _mm256_and_si256(digit, _mm256_sub_epi8(c, _mm256_set1_epi8('0'))),
+      _mm256_and_si256(letter,
+                       _mm256_sub_epi8(folded, _mm256_set1_epi8('a' - 10))));
+    __m256i pairs = _mm256_maddubs_epi16(v, _mm256_set1_epi16(0x0110));
+    __m256i packed = _mm256_permute4x64_epi64(
+      _mm256_packus_epi16(pairs, pairs), 0x08);
+    _mm_storeu_si128((__m128i*)(void*)out, _mm256_castsi256_si128(packed));
+  }
+  return done;
+}
+
+#endif
+
+int
+AU_B1_AppendHex(AU_ByteBuilder *b1, const void *mem, size_t size) {
+  assert(mem || size == 0);
+
+  unsigned char *out;
+  int res = ReserveOutput(b1, size, 2, 0, &out);
+  if (res < 0) {
+    return res;
+  }
+  const unsigned char *in = mem;
+  size_t done = 0;
+#ifdef AU_X86_DISPATCH
+  if (HasAVX2()) {
+    done = EncodeHexAVX2(in, size, out);
+  } else if (HasSSSE3()) {
+    done = EncodeHexSSSE3(in, size, out);
+  }
+#endif
+  EncodeHexScalar(in + done, size - done, out + 2*done);
+  return 0;
+}
+
+int
+AU_B1_DecodeHex(AU_ByteBuilder *b1, const void *mem, size_t size) {
+  assert(mem || size == 0);
+
+  if (size % 2 != 0) {
+    ISSUE_ERROR(AU_ERR_DECODE);
+    return AU_ERR_DECODE;
+  }
+  unsigned char *out;
+  int res = ReserveOutput(b1, size/2, 1, 0, &out);
+  if (res < 0) {
+    return res;
+  }
+  const unsigned char *in = mem;
+  size_t done = 0;
+#ifdef AU_X86_DISPATCH
+  if (HasAVX2()) {
+    done = DecodeHexAVX2(in, size, out);
+  }
+  if (HasSSSE3()) {
+    done += DecodeHexSSSE3(in + done, size - done, out + done/2);
+  }
+#endif
+  if (!DecodeHexScalar(in + done, size - done, out + done/2)) {
+    ReleaseOutput(b1, out);
+    ISSUE_ERROR(AU_ERR_DECODE);
+    return AU_ERR_DECODE;
+  }
+  return 0;
+}
+
+////// JSON Strings //////
+
+/*
+ * What needs escaping in a JSON string (control characters, quotes and
+ * backslashes) is exactly what can't appear unescaped in one, so encoding and
+ * decoding both go from one of those bytes to the next. Finding them is what
+ * the vector code does; runs of bytes between them are copied as they are.
+ */
+
+static inline int
+IsJSONSpecial(unsigned char c) {
+  return c < 0x20 || c == '"' || c == '\\';
+}
+
+static const unsigned char *
+NextJSONSpecialScalar(const unsigned char *p, const unsigned char *end) {
+  while (p < end && !IsJSONSpecial(*p)) {
+    p++;
+  }
+  return p;
+}
+
+#ifdef AU_X86_DISPATCH
+
+__attribute__((target("ssse3")))
+static const unsigned char *
+NextJSONSpecialSSSE3(const unsigned char *p, const unsigned char *end) {
+  const __m128i control = _mm_set1_epi8(0x1f);
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  for (; end - p >= 16; p += 16) {
+    __m128i c = _mm_loadu_si128((const __m128i*)(const void*)p);
+    __m128i special = _mm_or_si128(
+      _mm_cmpeq_epi8(_mm_min_epu8(c, control), c),
+      _mm_or_si128(_mm_cmpeq_epi8(c, quote), _mm_cmpeq_epi8(c, backslash)));
+    int mask = _mm_movemask_epi8(special);
+    if (mask) {
+      return p + __builtin_ctz((unsigned)mask);
+    }
+  }
+  return NextJSONSpecialScalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static const unsigned char *
+NextJSONSpecialAVX2(const unsigned char *p, const unsigned char *end) {
+  const __m256i control = _mm256_set1_epi8(0x1f);
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i backslash = _mm256_set1_epi8('\\');
+  for (; end - p >= 32; p += 32) {
+    __m256i c = _mm256_loadu_si256((const __m256i*)(const void*)p);
+    __m256i special = _mm256_or_si256(
+      _mm256_cmpeq_epi8(_mm256_min_epu8(c, control), c),
+      _mm256_or_si256(_mm256_cmpeq_epi8(c, quote),
+                      _mm256_cmpeq_epi8(c, backslash)));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(special);
+    if (mask) {
+      return p + __builtin_ctz(mask);
+    }
+  }
+  return NextJSONSpecialScalar(p, end);
+}
+
+#endif
+
+typedef const unsigned char *NextJSONSpecialFn(const unsigned char *p,
+                                               const unsigned char *end);
+
+static NextJSONSpecialFn *
+PickNextJSONSpecial(void) {
+#ifdef AU_X86_DISPATCH
+  if (HasAVX2()) {
+    return NextJSONSpecialAVX2;
+  }
+  if (HasSSSE3()) {
+    return NextJSONSpecialSSSE3;
+  }
+#endif
+  return NextJSONSpecialScalar;
+}
+
+// The short escapes, or 0 for those written as \u00XX.
+static unsigned char
+JSONShortEscape(unsigned char c) {
+  switch (c) {
+  case '"': return '"';
+  case '\\': return '\\';
+  case '\b': return 'b';
+  case '\f': return 'f';
+  case '\n': return 'n';
+  case '\r': return 'r';
+  case '\t': return 't';
+  default: return 0;
+  }
+}
+
+int
+AU_B1_AppendJSONEscaped(AU_ByteBuilder *b1, const void *mem, size_t size) {
+  assert(mem || size == 0);
+
+  if (size == 0) {
+    return 0;
+  }
+  NextJSONSpecialFn *next = PickNextJSONSpecial();
+  const unsigned char *in = mem;
+  const unsigned char *end = in + size;
+
+  // The exact output size first, so it's reserved once.
+  size_t extra = 0;
+  for (const unsigned char *p = next(in, end); p < end; p = next(p + 1, end)) {
+    extra += JSONShortEscape(*p) ? 1 : 5;
+  }
+  if (extra > SIZE_MAX - size) {
+    ISSUE_ERROR(AU_ERR_OVERFLOW);
+    return AU_ERR_OVERFLOW;
+  }
+  unsigned char *out;
+  int res = ReserveOutput(b1, 1, size + extra, 0, &out);
+  if (res < 0) {
+    return res;
+  }
+
+  const unsigned char *p = in;
+  for (const unsigned char *q = next(p, end); q < end; q = next(p, end)) {
+    memcpy(out, p, (size_t)(q - p));
+    out += q - p;
+    unsigned char e = JSONShortEscape(*q);
+    *out++ = '\\';
+    if (e) {
+      *out++ = e;
+    } else {
+      memcpy(out, "u00", 3);
+      out[3] = (unsigned char)hex_digits[*q >> 4];
+      out[4] = (unsigned char)hex_digits[*q & 15];
+      out += 5;
+    }
+    p = q + 1;
+  }
+  memcpy(out, p, (size_t)(end - p));
+  return 0;
+}
+
+// The value of 4 hex digits at p, or -1.
+static long
+JSONHex4(const unsigned char *p) {
+  long v = 0;
+  for (int i = 0; i < 4; i++) {
+    int d = HexValue(p[i]);
+    if (d < 0) {
+      return -1;
+    }
+    v = v << 4 | d;
+  }
+  return v;
+}
+
+/*
+ * Decodes the escape sequence at p (after its backslash) to out. Stores the
+ * end of its output in *out_end, and returns the end of its input, or a null
+ * pointer if it isn't valid.
+ */
+static const unsigned char *
+DecodeJSONEscape(const unsigned char *p, const unsigned char *end,
+                 unsigned char *out, unsigned char **out_end) {
+  if (p == end) {
+    return 0;
+  }
+  unsigned char c = *p++;
+  if (c != 'u') {
+    switch (c) {
+    case '"': case '\\': case '/': break;
+    case 'b': c = '\b'; break;
+    case 'f': c = '\f'; break;
+    case 'n': c = '\n'; break;
+    case 'r': c = '\r'; break;
+    case 't': c = '\t'; break;
+    default: return 0;
+    }
+    *out++ = c;
+    *out_end = out;
+    return p;
+  }
+
+  if (end - p < 4) {
+    return 0;
+  }
+  long cp = JSONHex4(p);
+  p += 4;
+  if (cp >= 0xd800 && cp <= 0xdbff) {
+    // A high surrogate, which has to be followed by a low one.
+    if (end - p < 6 || p[0] != '\\' || p[1] != 'u') {
+      return 0;
+    }
+    long lo = JSONHex4(p + 2);
+    if (lo < 0xdc00 || lo > 0xdfff) {
+      return 0;
+    }
+    cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+    p += 6;
+  } else if (cp < 0 || (cp >= 0xdc00 && cp <= 0xdfff)) {
+    return 0;
+  }
+
+  // UTF-8. At most 4 bytes, from at least 6 of input.
+  if (cp < 0x80) {
+    *out++ = (unsigned char)cp;
+  } else if (cp < 0x800) {
+    *out++ = (unsigned char)(0xc0 | cp >> 6);
+    *out++ = (unsigned char)(0x80 | (cp & 0x3f));
+  } else if (cp < 0x10000) {
+    *out++ = (unsigned char)(0xe0 | cp >> 12);
+    *out++ = (unsigned char)(0x80 | ((cp >> 6) & 0x3f));
+    *out++ = (unsigned char)(0x80 | (cp & 0x3f));
+  } else {
+    *out++ = (unsigned char)(0xf0 | cp >> 18);
+    *out++ = (unsigned char)(0x80 | ((cp >> 12) & 0x3f));
+    *out++ = (unsigned char)(0x80 | ((cp >> 6) & 0x3f));
+    *out++ = (unsigned char)(0x80 | (cp & 0x3f));
+  }
+  *out_end = out;
+  return p;
+}
+
+int
+AU_B1_DecodeJSONEscaped(AU_ByteBuilder *b1, const void *mem, size_t size) {
+  assert(mem || size == 0);
+
+  if (size == 0) {
+    return 0;
+  }
+  // Escapes never decode to more bytes than they take.
+  unsigned char *out;
+  int res = ReserveOutput(b1, size, 1, 0, &out);
+  if (res < 0) {
+    return res;
+  }
+  unsigned char *start = out;
+
+  NextJSONSpecialFn *next = PickNextJSONSpecial();
+  const unsigned char *p = mem;
+  const unsigned char *end = p + size;
+  for (const unsigned char *q = next(p, end); q < end; q = next(p, end)) {
+    memcpy(out, p, (size_t)(q - p));
+    out += q - p;
+    p = *q == '\\' ? DecodeJSONEscape(q + 1, end, out, &out) : 0;
+    if (!p) {
+      ReleaseOutput(b1, start);
+      ISSUE_ERROR(AU_ERR_DECODE);
+      return AU_ERR_DECODE;
+    }
+  }
+  memcpy(out, p, (size_t)(end - p));
+  ReleaseOutput(b1, out + (end - p));
+  return 0;
+}
+
+////////////////////////
+//// LZ Compression ////
+////////////////////////
+
+enum {
+  LZ_MIN_MATCH = 4,
+  LZ_MAX_OFFSET = 65535,
+
+  // The hash table has 2^LZ_HASH_BITS positions (on the stack).
+  LZ_HASH_BITS = 12,
+
+  // Literals are searched for matches at a step that grows by 1 for each
+  // 2^LZ_SKIP_SHIFT bytes without one, so incompressible data goes by fast.
+  LZ_SKIP_SHIFT = 6,
+
+  // The length nibbles of a token.
+  LZ_RUN_MASK = 15,
+
+  LZ_BOUND_SLACK = 16,
+
+  // Short literal runs are copied 16 bytes at once.
+  LZ_SHORT_RUN = 16
+};
+
+static inline size_t
+LZHash(uint32_t v) {
+  return (size_t)((v*2654435761u) >> (32 - LZ_HASH_BITS));
+}
+
+/*
+ * Number of bytes a and b have in common, up to limit (from a).
+ */
+static inline size_t
+LZMatchLength(const unsigned char *a, const unsigned char *b,
+              const unsigned char *limit) {
+  const unsigned char *start = a;
+  while (limit - a >= 8) {
+    uint64_t diff = LoadU64LE(a) ^ LoadU64LE(b);
+    if (diff) {
+      return (size_t)(a - start) + LowestBit64(diff)/8;
+    }
+    a += 8;
+    b += 8;
+  }
+  while (a < limit && *a == *b) {
+    a++;
+    b++;
+  }
+  return (size_t)(a - start);
+}
+
+/*
+ * Writes the rest of a length that didn't fit in its token nibble.
+ */
+static inline unsigned char *
+LZPutLength(unsigned char *out, size_t n) {
+  while (n >= 255) {
+    *out++ = 255;
+    n -= 255;
+  }
+  *out++ = (unsigned char)n;
+  return out;
+}
+
+/*
+ * Reads the rest of a length whose nibble was 15, adding it to *n. Returns the
+ * position past it, or a null pointer if it's truncated or absurdly long.
+ */
+static inline const unsigned char *
+LZGetLength(const unsigned char *in, const unsigned char *end, size_t *n) {
+  unsigned char b;
+  do {
+    if (in == end || *n > SIZE_MAX - 255) {
+      return 0;
+    }
+    b = *in++;
+    *n += b;
+  } while (b == 255);
+  return in;
+}
+
+/*
+ * Writes a sequence: the literals from lit to match, then (if len isn't 0) a
+ * match of len bytes, offset bytes back.
+ */
+static inline unsigned char *
+LZPutSequence(unsigned char *out,
+              const unsigned char *lit,
+              const unsigned char *match,
+              size_t offset,
+              size_t len) {
+  size_t nlit = (size_t)(match - lit);
+  unsigned char *token = out++;
+  if (nlit >= LZ_RUN_MASK) {
+    *token = LZ_RUN_MASK << 4;
+    out = LZPutLength(out, nlit - LZ_RUN_MASK);
+  } else {
+    *token = (unsigned char)(nlit << 4);
+  }
+  memcpy(out, lit, nlit);
+  out += nlit;
+  if (len == 0) {
+    return out;
+  }
+
+  out[0] = (unsigned char)offset;
+  out[1] = (unsigned char)(offset >> 8);
+  out += 2;
+  len -= LZ_MIN_MATCH;
+  if (len >= LZ_RUN_MASK) {
+    *token |= LZ_RUN_MASK;
+    out = LZPutLength(out, len - LZ_RUN_MASK);
+  } else {
+    *token |= (unsigned char)len;
+  }
+  return out;
+}
+
+int
+AU_B1_AppendLZ(AU_ByteBuilder *b1, const void *mem, size_t size) {
+  assert(mem || size == 0);
+
+  // Sequences never take more than the input they stand for, plus a byte per
+  // 255 for run lengths, plus a few bytes.
+  if (size > SIZE_MAX - size/255 - LZ_BOUND_SLACK - VARINT64_MAX_LEN) {
+    ISSUE_ERROR(AU_ERR_OVERFLOW);
+    return AU_ERR_OVERFLOW;
+  }
+  unsigned char *out;
+  int res = ReserveOutput(b1,
+                          size + size/255 + LZ_BOUND_SLACK + VARINT64_MAX_LEN,
+                          1, 0, &out);
+  if (res < 0) {
+    return res;
+  }
+  out += EncodeVarint64(out, size);
+
+  const unsigned char *in = mem;
+  const unsigned char *end = in + size;
+  const unsigned char *anchor = in;
+  const unsigned char *ip = in;
+  size_t table[(size_t)1 << LZ_HASH_BITS] = {0};
+  if (size >= LZ_MIN_MATCH) {
+    const unsigned char *limit = end - LZ_MIN_MATCH;
+    while (ip <= limit) {
+      uint32_t v = LoadU32LE(ip);
+      size_t h = LZHash(v);
+      const unsigned char *ref = in + table[h];
+      table[h] = (size_t)(ip - in);
+      if (ref >= ip
+          || ip - ref > LZ_MAX_OFFSET
+          || LoadU32LE(ref) != v) {
+        ip += 1 + ((size_t)(ip - anchor) >> LZ_SKIP_SHIFT);
+        continue;
+      }
+
+      size_t len = LZ_MIN_MATCH + LZMatchLength(ip + LZ_MIN_MATCH,
+                                                ref + LZ_MIN_MATCH,
+                                                end);
+      while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+        ip--;
+        ref--;
+        len++;
+      }
+      out = LZPutSequence(out, anchor, ip, (size_t)(ip - ref), len);
+      ip += len;
+      anchor = ip;
+
+      // Positions within a match aren't hashed, except for one near its end,
+      // which catches the next match often enough.
+      if (ip - 2 <= limit) {
+        table[LZHash(LoadU32LE(ip - 2))] = (size_t)(ip - 2 - in);
+      }
+    }
+  }
+  out = LZPutSequence(out, anchor, end, 0, 0);
+  ReleaseOutput(b1, out);
+  return 0;
+}
+
+/*
+ * Decodes the sequences in [in, end) into [out, oend), where start is the
+ * beginning of the output (matches can't reach before it). Returns non zero
+ * if they decode to exactly that much output. There have to be
+ * AU_LZ_DECODE_SLACK writable bytes past oend.
+ */
+static int
+DecodeLZSequences(const unsigned char *in, const unsigned char *end,
+                  unsigned char *start, unsigned char *oend) {
+  unsigned char *out = start;
+  for (;;) {
+    if (in == end) {
+      return 0;
+    }
+    unsigned token = *in++;
+    size_t nlit = token >> 4;
+    if (nlit == LZ_RUN_MASK && !(in = LZGetLength(in, end, &nlit))) {
+      return 0;
+    }
+    if (nlit > (size_t)(end - in) || nlit > (size_t)(oend - out)) {
+      return 0;
+    }
+    if (nlit <= LZ_SHORT_RUN && end - in >= LZ_SHORT_RUN) {
+      memcpy(out, in, LZ_SHORT_RUN);
+    } else {
+      memcpy(out, in, nlit);
+    }
+    in += nlit;
+    out += nlit;
+    if (in == end) {
+      return out == oend;
+    }
+
+    if (end - in < 2) {
+      return 0;
+    }
+    size_t offset = (size_t)in[0] | (size_t)in[1] << 8;
+    in += 2;
+    size_t len = token & LZ_RUN_MASK;
+    if (len == LZ_RUN_MASK && !(in = LZGetLength(in, end, &len))) {
+      return 0;
+    }
+    len += LZ_MIN_MATCH;
+    if (offset == 0
+        || offset > (size_t)(out - start)
+        || len > (size_t)(oend - out)) {
+      return 0;
+    }
+    const unsigned char *ref = out - offset;
+    if (offset >= 8) {
+      // Each word is read before it's written, even when the match overlaps
+      // its own output.
+      for (size_t i = 0; i < len; i += 8) {
+        memcpy(out + i, ref + i, 8);
+      }
+      out += len;
+    } else {
+      // The match repeats its last offset bytes.
+      for (size_t i = 0; i < len; i++) {
+        *out++ = ref[i];
+      }
+    }
+  }
+}
+
+int
+AU_B1_DecodeLZ(AU_ByteBuilder *b1, const void *mem, size_t size) {
+  assert(mem || size == 0);
+
+  const unsigned char *in = mem;
+  const unsigned char *end = in + size;
+  uint64_t osize;
+  size_t len = DecodeVarint(in, end, VARINT64_MAX_LEN, &osize);
+
+  // Each input byte adds 255 output bytes at most, so a size beyond that is
+  // bogus, and shouldn't be reserved.
+  if (len == 0 || osize/255 > size) {
+    ISSUE_ERROR(AU_ERR_DECODE);
+    return AU_ERR_DECODE;
+  }
+  unsigned char *out;
+  int res = ReserveOutput(b1, (size_t)osize, 1, AU_LZ_DECODE_SLACK, &out);
+  if (res < 0) {
+    return res;
+  }
+  if (!DecodeLZSequences(in + len, end, out, out + osize)) {
+    ReleaseOutput(b1, out);
+    ISSUE_ERROR(AU_ERR_DECODE);
+    return AU_ERR_DECODE;
+  }
+  ReleaseOutput(b1, out + osize);
+  return 0;
+}
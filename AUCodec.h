@@ -0,0 +1,333 @@
+#ifndef ALLOC_UTILS_CODEC_H
+#define ALLOC_UTILS_CODEC_H
+
+/**
+ * Encoders which append into builders, and decoders which read into them.
+ *
+ * Encoders reserve the worst case output size up front, with a single
+ * capacity check, write straight into the builder's memory and then give back
+ * whatever they didn't use. Decoders append their output the same way.
+ *
+ * Decoders return AU_ERR_DECODE on malformed input, in which case nothing is
+ * appended. Otherwise, if consumed isn't null, they store in it how many input
+ * bytes they read. Decoding into a fixed size builder whose element size isn't
+ * the decoded type's fails with AU_ERR_ELT_SIZE, also without appending.
+ */
+
+#include <assert.h>
+
+#include "AU.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/////////////////
+//// Varints ////
+/////////////////
+
+/*
+ * Varints here are unsigned LEB128: 7 bits per byte, least significant group
+ * first, with the high bit set in all bytes but the last one. Signed integers
+ * are zigzag encoded first (0, -1, 1, -2, ... become 0, 1, 2, 3, ...), so
+ * small negative values stay short as well.
+ */
+
+int
+AU_B1_AppendVarintsU32(AU_ByteBuilder *b1, const uint32_t *arr, size_t n);
+
+int
+AU_B1_AppendVarintsU64(AU_ByteBuilder *b1, const uint64_t *arr, size_t n);
+
+int
+AU_B1_AppendZigzagsI32(AU_ByteBuilder *b1, const int32_t *arr, size_t n);
+
+int
+AU_B1_AppendZigzagsI64(AU_ByteBuilder *b1, const int64_t *arr, size_t n);
+
+/**
+ * Decode n values from the size bytes at mem, appending them to a fixed size
+ * builder whose elements have the size of the decoded type.
+ */
+int
+AU_FSB_DecodeVarintsU32(AU_FixedSizeBuilder *fsb,
+                        const void *mem,
+                        size_t size,
+                        size_t n,
+                        size_t *consumed);
+
+int
+AU_FSB_DecodeVarintsU64(AU_FixedSizeBuilder *fsb,
+                        const void *mem,
+                        size_t size,
+                        size_t n,
+                        size_t *consumed);
+
+int
+AU_FSB_DecodeZigzagsI32(AU_FixedSizeBuilder *fsb,
+                        const void *mem,
+                        size_t size,
+                        size_t n,
+                        size_t *consumed);
+
+int
+AU_FSB_DecodeZigzagsI64(AU_FixedSizeBuilder *fsb,
+                        const void *mem,
+                        size_t size,
+                        size_t n,
+                        size_t *consumed);
+
+//////////////////////
+//// Stream VByte ////
+//////////////////////
+
+/*
+ * Stream VByte (Lemire et al.) keeps the lengths apart from the data: first
+ * a control byte for each 4 values (2 bits per value, its length in bytes
+ * minus 1, lowest bits first), then the values' bytes, little endian. It
+ * isn't as compact as LEB128, but it decodes 4 values at a time with a single
+ * shuffle, and that's what the decoder does on processors with SSSE3.
+ */
+
+int
+AU_B1_AppendStreamVByte(AU_ByteBuilder *b1, const uint32_t *arr, size_t n);
+
+int
+AU_FSB_DecodeStreamVByte(AU_FixedSizeBuilder *fsb,
+                         const void *mem,
+                         size_t size,
+                         size_t n,
+                         size_t *consumed);
+
+//////////////////////
+//// Bit Builders ////
+//////////////////////
+
+/**
+ * Appends bit fields of any width (up to 64 bits) to a byte builder, least
+ * significant bit first (the deflate order).
+ *
+ * Bits are gathered in a 64 bit accumulator and only appended to the byte
+ * builder, as 8 bytes at once, when it fills up. So the builder's capacity is
+ * checked once per 64 bits, and PutBits is inline for the common case.
+ *
+ * The bits in the accumulator aren't in the byte builder until AU_BB_Flush,
+ * which pads them with zero bits up to a byte boundary and appends them. Flush
+ * before looking at the byte builder, or before appending to it directly.
+ */
+typedef struct AU_BitBuilder {
+  AU_ByteBuilder *b1;
+  size_t flushed;
+  uint64_t acc;
+  unsigned nbits;
+} AU_BitBuilder;
+
+void
+AU_BB_Setup(AU_BitBuilder *bb, AU_ByteBuilder *b1);
+
+/**
+ * The accumulator filled up. Out of line part of AU_BB_PutBits.
+ */
+int
+AU_BB_PutBitsSlow(AU_BitBuilder *bb, uint64_t v, unsigned n);
+
+/**
+ * Appends the n low bits of v. Bits of v above those must be 0.
+ */
+static inline int
+AU_BB_PutBits(AU_BitBuilder *bb, uint64_t v, unsigned n) {
+  assert(n <= 64);
+  assert(n == 64 || v >> n == 0);
+
+  if (n < 64 - bb->nbits) {
+    bb->acc |= v << bb->nbits;
+    bb->nbits += n;
+    return 0;
+  }
+  return AU_BB_PutBitsSlow(bb, v, n);
+}
+
+int
+AU_BB_Flush(AU_BitBuilder *bb);
+
+/**
+ * Number of bits put since setup, flushed or not. Padding counts too.
+ */
+size_t
+AU_BB_GetBitCount(const AU_BitBuilder *bb);
+
+/////////////////////
+//// Bit Readers ////
+/////////////////////
+
+/**
+ * Reads back what a bit builder wrote, from size bytes at mem.
+ *
+ * The reader keeps a 64 bit accumulator with at least 56 bits in it after a
+ * refill (fewer only near the end of the input). Refills load 8 bytes at a
+ * time, so they happen about once per 7 bytes read, and reads of fields that
+ * are already in the accumulator are inline.
+ *
+ * Fields read through a reader are at most AU_BR_MAX_BITS wide. Reading past
+ * the end of the input fails with AU_ERR_DECODE.
+ */
+typedef struct AU_BitReader {
+  const unsigned char *start;
+  const unsigned char *p;
+  const unsigned char *end;
+  uint64_t acc;
+  unsigned nbits;
+} AU_BitReader;
+
+enum {
+  AU_BR_MAX_BITS = 56
+};
+
+void
+AU_BR_Setup(AU_BitReader *br, const void *mem, size_t size);
+
+/**
+ * Fills the accumulator with as many bits as are left, up to at least
+ * AU_BR_MAX_BITS of them. The inline functions call this when they run out.
+ */
+void
+AU_BR_Refill(AU_BitReader *br);
+
+/**
+ * The next n bits, without consuming them. Bits past the end read as 0.
+ */
+static inline uint64_t
+AU_BR_PeekBits(AU_BitReader *br, unsigned n) {
+  assert(n <= AU_BR_MAX_BITS);
+
+  if (br->nbits < n) {
+    AU_BR_Refill(br);
+  }
+  return br->acc & (((uint64_t)1 << n) - 1);
+}
+
+/**
+ * Consumes n bits, which have to have been peeked already.
+ */
+static inline void
+AU_BR_SkipBits(AU_BitReader *br, unsigned n) {
+  assert(n <= br->nbits);
+
+  br->acc >>= n;
+  br->nbits -= n;
+}
+
+/**
+ * Out of line part of AU_BR_GetBits, refilling first.
+ */
+int
+AU_BR_GetBitsSlow(AU_BitReader *br, unsigned n, uint64_t *v);
+
+/**
+ * Reads the next n bits into *v.
+ */
+static inline int
+AU_BR_GetBits(AU_BitReader *br, unsigned n, uint64_t *v) {
+  assert(n <= AU_BR_MAX_BITS);
+
+  if (br->nbits < n) {
+    return AU_BR_GetBitsSlow(br, n, v);
+  }
+  *v = br->acc & (((uint64_t)1 << n) - 1);
+  AU_BR_SkipBits(br, n);
+  return 0;
+}
+
+/**
+ * Skips to the next byte boundary, which is where the writer's Flush padding
+ * ends.
+ */
+void
+AU_BR_AlignToByte(AU_BitReader *br);
+
+/**
+ * Number of bits consumed since setup.
+ */
+size_t
+AU_BR_GetBitCount(const AU_BitReader *br);
+
+////////////////////////
+//// Text Encodings ////
+////////////////////////
+
+/*
+ * Base64 (the standard alphabet, with padding), hex, and JSON string escaping.
+ * Encoders append the encoding of size bytes at mem, reserving its exact size
+ * once. Decoders append the decoding of the size characters at mem, all of
+ * which have to be valid.
+ *
+ * The bulk of the work is done 16 or 32 bytes at a time with SSSE3 or AVX2
+ * when the processor has them.
+ *
+ * Hex is encoded in lower case, and decoded in either. JSON escaping only
+ * escapes what has to be (quotes, backslashes and control characters), and
+ * gives the contents of a string, without the quotes around it. Decoding it
+ * turns \u escapes into UTF-8, but other than that, bytes are passed along as
+ * they are (the input isn't checked to be valid UTF-8).
+ */
+
+int
+AU_B1_AppendBase64(AU_ByteBuilder *b1, const void *mem, size_t size);
+
+int
+AU_B1_DecodeBase64(AU_ByteBuilder *b1, const void *mem, size_t size);
+
+int
+AU_B1_AppendHex(AU_ByteBuilder *b1, const void *mem, size_t size);
+
+int
+AU_B1_DecodeHex(AU_ByteBuilder *b1, const void *mem, size_t size);
+
+int
+AU_B1_AppendJSONEscaped(AU_ByteBuilder *b1, const void *mem, size_t size);
+
+int
+AU_B1_DecodeJSONEscaped(AU_ByteBuilder *b1, const void *mem, size_t size);
+
+////////////////////////
+//// LZ Compression ////
+////////////////////////
+
+/*
+ * A small, fast LZ77 compressor, in the style of LZ4: no entropy coding, just
+ * literal runs and back references (of 4 bytes or more, up to 64 KiB back)
+ * found through a hash table of recent positions. It compresses text and
+ * other redundant data a few times over, at hundreds of MB/s, and decompresses
+ * several times faster than that.
+ *
+ * A compressed block is the decompressed size as a varint, and then
+ * sequences. Each sequence is a token byte (the literal run length in the high
+ * 4 bits, the match length minus 4 in the low ones, with 15 meaning more
+ * length follows in bytes of 255 and a last one below that), the literals, and
+ * then the match offset (2 bytes, little endian) and more match length. The
+ * last sequence has literals only.
+ *
+ * AU_B1_AppendLZ compresses size bytes at mem into a block. AU_B1_DecodeLZ
+ * decompresses the whole block of size bytes at mem.
+ *
+ * The decoder copies in whole words, so it needs AU_LZ_DECODE_SLACK bytes of
+ * room past its output, which it gives back when it's done. Builders that are
+ * only decoded into can be set up with that much extra capacity, so they
+ * don't grow just for it.
+ */
+
+enum {
+  AU_LZ_DECODE_SLACK = 16
+};
+
+int
+AU_B1_AppendLZ(AU_ByteBuilder *b1, const void *mem, size_t size);
+
+int
+AU_B1_DecodeLZ(AU_ByteBuilder *b1, const void *mem, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,144 @@
+#ifndef ALLOC_UTILS_CORO_HPP
+#define ALLOC_UTILS_CORO_HPP
+
+/**
+ * Coroutine frames from fixed size allocators, for C++20 coroutines (the
+ * header itself only needs C++17).
+ *
+ * Each call to a coroutine allocates its frame, with the promise type's
+ * operator new if it has one, and the global one otherwise. Deriving the
+ * promise type from au::pooled_frame routes those allocations to the calling
+ * thread's frame pools instead:
+ *
+ *   struct task {
+ *     struct promise_type : au::pooled_frame {
+ *       ...
+ *     };
+ *   };
+ *
+ * The pools are size classes, an AU_FixedSizeAllocator per 64 bytes of frame
+ * size up to au::max_pooled_frame, each set up on its first use. The compiler
+ * passes the frame size to both operator new and operator delete, so finding
+ * the class takes a shift, and a frame allocation is a free list pop in the
+ * common case. Larger frames go to the global operator new.
+ *
+ * As in the benchmark runner, frames can be freed by any thread: a frame goes
+ * to the free list of the thread destroying it, whichever thread allocated it.
+ * So a coroutine can be resumed, finished and destroyed elsewhere, but a
+ * thread's pools can only be destroyed (with au::destroy_frame_pools) when no
+ * thread will use frames from them anymore, which usually means at shutdown.
+ * Pools that aren't destroyed leak when their thread exits.
+ *
+ * Allocation failures throw std::bad_alloc.
+ */
+
+#include <cstddef>
+#include <new>
+
+#include "AU.h"
+
+namespace au {
+
+enum : std::size_t {
+  frame_class_size = 64,
+  frame_classes = 16,
+  max_pooled_frame = frame_class_size * frame_classes,
+
+  // Frames set up per pool at once, at first.
+  frame_pool_cap = 64
+};
+
+static_assert(__STDCPP_DEFAULT_NEW_ALIGNMENT__
+              <= sizeof (union AU_AlignmentType),
+              "FSA elements are only aligned to the conservative boundary");
+
+namespace detail {
+
+// Trivial, so it's zero initialized and its accesses need no guard.
+struct frame_pools {
+  AU_FixedSizeAllocator fsa[frame_classes];
+  bool live[frame_classes];
+};
+
+inline thread_local frame_pools tl_frame_pools;
+
+inline std::size_t
+frame_class(std::size_t size) noexcept {
+  return (size - 1) / frame_class_size;
+}
+
+inline void *
+frame_alloc_slow(std::size_t c) {
+  // The free list is empty, so the pool either grows or is set up.
+  frame_pools &fp = tl_frame_pools;
+  if (!fp.live[c]) {
+    if (AU_FSA_Setup(&fp.fsa[c], (c + 1)*frame_class_size,
+                     frame_pool_cap) < 0) {
+      throw std::bad_alloc();
+    }
+    fp.live[c] = true;
+  }
+  void *p = AU_FSA_Alloc(&fp.fsa[c]);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+}
+
+/**
+ * The promise mixin. The sized operator delete is the one the compiler calls
+ * for frames.
+ */
+struct pooled_frame {
+  static void *operator new(std::size_t size) {
+    if (size > max_pooled_frame) {
+      return ::operator new(size);
+    }
+    // Inline AU_FSA_Alloc, as in AU_DEFINE_FSA.
+    std::size_t c = detail::frame_class(size);
+    AU_FixedSizeAllocator &fsa = detail::tl_frame_pools.fsa[c];
+    char *node = static_cast<char*>(fsa.free_head);
+    if (!node) {
+      return detail::frame_alloc_slow(c);
+    }
+    fsa.free_head = *static_cast<void**>(static_cast<void*>(node));
+    return node + AU_FSA_NODE_HEADER;
+  }
+
+  static void operator delete(void *p, std::size_t size) noexcept {
+    if (size > max_pooled_frame) {
+      ::operator delete(p);
+      return;
+    }
+    // Inline AU_FSA_Free. The pool may not be set up yet (the frame is from
+    // another thread), which is fine: setup only happens once the free list
+    // is empty, so it doesn't lose anything.
+    AU_FixedSizeAllocator &fsa =
+      detail::tl_frame_pools.fsa[detail::frame_class(size)];
+    void *node = static_cast<char*>(p) - AU_FSA_NODE_HEADER;
+    *static_cast<void**>(node) = fsa.free_head;
+    fsa.free_head = node;
+  }
+};
+
+/**
+ * Destroys the calling thread's frame pools (see the comment at the top of
+ * this file for when that's fine to do).
+ */
+inline void
+destroy_frame_pools() noexcept {
+  detail::frame_pools &fp = detail::tl_frame_pools;
+  for (std::size_t c = 0; c < frame_classes; c++) {
+    if (fp.live[c]) {
+      AU_FSA_Destroy(&fp.fsa[c]);
+      fp.live[c] = false;
+    }
+    fp.fsa[c].free_head = 0;
+  }
+}
+
+}
+
+#endif
@@ -0,0 +1,360 @@
+#ifndef ALLOC_UTILS_VECTOR_HPP
+#define ALLOC_UTILS_VECTOR_HPP
+
+/**
+ * au::vector<T>, a std::vector look alike for C++ (11 or later) whose memory
+ * is an AU_ByteBuilder's.
+ *
+ * std::vector can't use realloc: allocators have no way to grow a block in
+ * place, so every growth allocates a new block, moves the elements over one by
+ * one and frees the old one. That's a copy of everything, even for types that
+ * memcpy would have done fine for. au::vector grows the builder instead, which
+ * means xrealloc for trivially relocatable element types. The allocator can
+ * often grow the block where it is then, and large blocks are moved by
+ * remapping their pages (glibc's realloc uses mremap for those), not by
+ * copying them. Other types are moved the std::vector way.
+ *
+ * Types are taken as trivially relocatable when they're trivially copyable.
+ * Plenty of others are too (most std::unique_ptr and std::string
+ * implementations, say). Specialize au::is_trivially_relocatable for those if
+ * you know better.
+ *
+ * Vectors are move only. Copy one through its iterators if you mean it.
+ * release() hands the memory over to you, as a raw buffer of size() elements
+ * which you destroy and give to xfree when you're done with it.
+ *
+ * Failures to allocate throw std::bad_alloc (after xerror is called, as
+ * usual), and sizes that don't fit in a size_t throw std::length_error. The
+ * builder's own error codes don't get past the vector.
+ */
+
+#include <cstddef>
+#include <initializer_list>
+#include <iterator>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <algorithm>
+
+#include "AU.h"
+
+namespace au {
+
+template <typename T>
+struct is_trivially_relocatable : std::is_trivially_copyable<T> {};
+
+template <typename T>
+class vector {
+  static_assert(alignof(T) <= alignof(std::max_align_t),
+                "the builder's memory is only aligned as malloc's is");
+
+public:
+  typedef T value_type;
+  typedef std::size_t size_type;
+  typedef std::ptrdiff_t difference_type;
+  typedef T &reference;
+  typedef const T &const_reference;
+  typedef T *pointer;
+  typedef const T *const_pointer;
+  typedef T *iterator;
+  typedef const T *const_iterator;
+  typedef std::reverse_iterator<iterator> reverse_iterator;
+  typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+  /**
+   * Nothing is allocated until the first element (or reserve) needs it.
+   */
+  vector() noexcept {
+    b1_.mem = 0;
+    b1_.used = 0;
+    b1_.cap = 0;
+  }
+
+  explicit vector(size_type n) : vector() {
+    resize(n);
+  }
+
+  vector(size_type n, const T &v) : vector() {
+    resize(n, v);
+  }
+
+  vector(std::initializer_list<T> il) : vector() {
+    reserve(il.size());
+    for (const T &v : il) {
+      emplace_back(v);
+    }
+  }
+
+  vector(vector &&other) noexcept : b1_(other.b1_) {
+    other.b1_.mem = 0;
+    other.b1_.used = 0;
+    other.b1_.cap = 0;
+  }
+
+  vector &operator=(vector &&other) noexcept {
+    if (this != &other) {
+      destroy();
+      b1_ = other.b1_;
+      other.b1_.mem = 0;
+      other.b1_.used = 0;
+      other.b1_.cap = 0;
+    }
+    return *this;
+  }
+
+  vector(const vector &) = delete;
+  vector &operator=(const vector &) = delete;
+
+  ~vector() {
+    destroy();
+  }
+
+  //// Size and Capacity ////
+
+  size_type size() const noexcept { return b1_.used / sizeof(T); }
+  size_type capacity() const noexcept { return b1_.cap / sizeof(T); }
+  bool empty() const noexcept { return b1_.used == 0; }
+  size_type max_size() const noexcept { return SIZE_MAX / sizeof(T); }
+
+  void reserve(size_type n) {
+    if (n > capacity()) {
+      grow(n - size());
+    }
+  }
+
+  void resize(size_type n) {
+    if (n < size()) {
+      truncate(n);
+      return;
+    }
+    reserve(n);
+    while (size() < n) {
+      emplace_back();
+    }
+  }
+
+  void resize(size_type n, const T &v) {
+    if (n < size()) {
+      truncate(n);
+      return;
+    }
+    // v may be an element, which reserve would move.
+    T copy(v);
+    reserve(n);
+    while (size() < n) {
+      emplace_back(copy);
+    }
+  }
+
+  void clear() noexcept {
+    truncate(0);
+  }
+
+  //// Element Access ////
+
+  T *data() noexcept { return static_cast<T*>(b1_.mem); }
+  const T *data() const noexcept { return static_cast<const T*>(b1_.mem); }
+
+  T &operator[](size_type i) noexcept { return data()[i]; }
+  const T &operator[](size_type i) const noexcept { return data()[i]; }
+
+  T &at(size_type i) {
+    if (i >= size()) {
+      throw std::out_of_range("au::vector::at");
+    }
+    return data()[i];
+  }
+
+  const T &at(size_type i) const {
+    if (i >= size()) {
+      throw std::out_of_range("au::vector::at");
+    }
+    return data()[i];
+  }
+
+  T &front() noexcept { return data()[0]; }
+  const T &front() const noexcept { return data()[0]; }
+  T &back() noexcept { return data()[size() - 1]; }
+  const T &back() const noexcept { return data()[size() - 1]; }
+
+  //// Iterators ////
+
+  iterator begin() noexcept { return data(); }
+  const_iterator begin() const noexcept { return data(); }
+  const_iterator cbegin() const noexcept { return data(); }
+  iterator end() noexcept { return data() + size(); }
+  const_iterator end() const noexcept { return data() + size(); }
+  const_iterator cend() const noexcept { return data() + size(); }
+
+  reverse_iterator rbegin() noexcept { return reverse_iterator(end()); }
+  const_reverse_iterator rbegin() const noexcept {
+    return const_reverse_iterator(end());
+  }
+  reverse_iterator rend() noexcept { return reverse_iterator(begin()); }
+  const_reverse_iterator rend() const noexcept {
+    return const_reverse_iterator(begin());
+  }
+
+  //// Modifiers ////
+
+  template <typename... Args>
+  T &emplace_back(Args &&...args) {
+    if (b1_.cap - b1_.used < sizeof(T)) {
+      // The arguments may refer to elements, which growing would move.
+      T v(std::forward<Args>(args)...);
+      grow(1);
+      return construct_back(std::move(v));
+    }
+    return construct_back(std::forward<Args>(args)...);
+  }
+
+  void push_back(const T &v) { emplace_back(v); }
+  void push_back(T &&v) { emplace_back(std::move(v)); }
+
+  void pop_back() noexcept {
+    back().~T();
+    AU_B1_DiscardLastBytes(&b1_, sizeof(T));
+  }
+
+  /**
+   * Inserts before pos by appending and rotating the new element into place.
+   */
+  template <typename... Args>
+  iterator emplace(const_iterator pos, Args &&...args) {
+    size_type i = static_cast<size_type>(pos - cbegin());
+    emplace_back(std::forward<Args>(args)...);
+    std::rotate(begin() + i, end() - 1, end());
+    return begin() + i;
+  }
+
+  iterator insert(const_iterator pos, const T &v) { return emplace(pos, v); }
+  iterator insert(const_iterator pos, T &&v) {
+    return emplace(pos, std::move(v));
+  }
+
+  iterator erase(const_iterator pos) { return erase(pos, pos + 1); }
+
+  iterator erase(const_iterator first, const_iterator last) {
+    iterator f = begin() + (first - cbegin());
+    iterator l = begin() + (last - cbegin());
+    if (f != l) {
+      truncate(static_cast<size_type>(std::move(l, end(), f) - begin()));
+    }
+    return f;
+  }
+
+  void swap(vector &other) noexcept {
+    std::swap(b1_, other.b1_);
+  }
+
+  /**
+   * Gives up the memory, leaving the vector empty. The elements in it are
+   * still alive, and they're yours: destroy them and xfree the buffer. Null
+   * if nothing was ever allocated.
+   */
+  T *release() noexcept {
+    T *p = data();
+    b1_.mem = 0;
+    b1_.used = 0;
+    b1_.cap = 0;
+    return p;
+  }
+
+private:
+  static const bool relocatable = is_trivially_relocatable<T>::value;
+
+  AU_ByteBuilder b1_;
+
+  template <typename... Args>
+  T &construct_back(Args &&...args) {
+    // There is room already, so this doesn't fail, and nothing's appended
+    // until the constructor is done.
+    T *p = ::new (static_cast<char*>(b1_.mem) + b1_.used)
+           T(std::forward<Args>(args)...);
+    AU_B1_AppendForSetup(&b1_, sizeof(T));
+    return *p;
+  }
+
+  void truncate(size_type n) noexcept {
+    if (n >= size()) {
+      return;
+    }
+    if (!std::is_trivially_destructible<T>::value) {
+      for (T *p = data() + n, *e = end(); p != e; p++) {
+        p->~T();
+      }
+    }
+    AU_B1_DiscardLastBytes(&b1_, (size() - n) * sizeof(T));
+  }
+
+  void destroy() noexcept {
+    if (b1_.mem) {
+      truncate(0);
+      AU_B1_Destroy(&b1_);
+    }
+  }
+
+  static void check(int res) {
+    if (res == AU_ERR_OVERFLOW) {
+      throw std::length_error("au::vector");
+    }
+    if (res < 0) {
+      throw std::bad_alloc();
+    }
+  }
+
+  /*
+   * Makes room for n more elements, at least doubling the capacity.
+   */
+  void grow(size_type n) {
+    if (n > max_size() - size()) {
+      throw std::length_error("au::vector");
+    }
+    size_type bytes = n * sizeof(T);
+    if (!b1_.mem) {
+      check(AU_B1_Setup(&b1_, bytes));
+    } else if (relocatable) {
+      check(AU_B1_MakeRoom(&b1_, bytes));
+    } else {
+      relocate(bytes);
+    }
+  }
+
+  /*
+   * Growing for types which memcpy can't move: a new builder, with the
+   * elements moved over (or copied, if moving them could throw).
+   */
+  void relocate(size_type bytes) {
+    size_type cap = b1_.cap > SIZE_MAX/2 ? SIZE_MAX : b1_.cap*2;
+    cap = std::max(cap, b1_.used + bytes);
+
+    AU_ByteBuilder nb;
+    check(AU_B1_Setup(&nb, cap));
+    T *dst = static_cast<T*>(nb.mem);
+    size_type n = size(), i = 0;
+    try {
+      for (; i < n; i++) {
+        ::new (dst + i) T(std::move_if_noexcept(data()[i]));
+      }
+    } catch (...) {
+      while (i > 0) {
+        dst[--i].~T();
+      }
+      AU_B1_Destroy(&nb);
+      throw;
+    }
+    AU_B1_AppendForSetup(&nb, b1_.used);
+    destroy();
+    b1_ = nb;
+  }
+};
+
+template <typename T>
+inline void swap(vector<T> &a, vector<T> &b) noexcept {
+  a.swap(b);
+}
+
+}
+
+#endif